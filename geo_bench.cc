@@ -0,0 +1,326 @@
+#include "geo_bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <random>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "base/exceptions.h"
+#include "base/log.h"
+#include "base/utils.h"
+#include "protobuf/geo.pb.h"
+
+using namespace ggAdNet;
+using namespace ggAdNet::Tools;
+
+namespace {
+
+const char *phaseNames[] = {"steady", "reload"};
+
+/*  dTLB load misses of the calling thread, -1 if perf events are not permitted  */
+int
+openDtlbCounter()
+{
+    struct perf_event_attr attr{};
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+uint64_t
+readCounter(int fd)
+{
+    uint64_t value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+    }
+    return value;
+}
+
+}
+
+GeoBench::GeoBench()
+{
+    config_ = Utils::loadJsonFile(configFile_);
+    initConfig(config_);
+    Log::init(config_);
+}
+
+GeoBench::~GeoBench()
+{
+    Log::clean();
+}
+
+void
+GeoBench::initConfig(const rapidjson::Document& config)
+{
+    const auto& bench = Utils::configSection(config, "bench");
+    int threads = Utils::configInt(bench, "threads", static_cast<int>(std::thread::hardware_concurrency()));
+    if (threads <= 0) {
+        throw ConfigException("bench.threads must be positive");
+    }
+    threads_ = static_cast<size_t>(threads);
+    duration_ = Utils::configInt(bench, "duration", defaultDuration_);
+    reloadInterval_ = Utils::configInt(bench, "reload_interval", defaultReloadInterval_);
+    reloadTail_ = Utils::configInt(bench, "reload_tail", defaultReloadTail_);
+    if (duration_ <= 0 || reloadTail_ < 0) {
+        throw ConfigException("bench.duration must be positive, bench.reload_tail not negative");
+    }
+    /*  the watcher wants the file unchanged for one check before it loads  */
+    if (reloadInterval_ < 3) {
+        throw ConfigException("bench.reload_interval can't be less than 3");
+    }
+    int ranges = Utils::configInt(bench, "ranges", defaultRanges_);
+    if (ranges <= 0 || ranges > (1 << 24)) {
+        throw ConfigException("bench.ranges must be within 1 .. 16777216");
+    }
+    ranges_ = static_cast<uint64_t>(ranges);
+    ipv4Step_ = (1ULL << 32) / ranges_;
+    /*  the geodb file is the one GeoDb watches  */
+    const auto& geodb = Utils::configSection(config, "geodb");
+    geoDbFile_ = Utils::configString(geodb, "file", defaultGeoDbFile_);
+    /*  strings to check elements against  */
+    countryKeys_ = {"US", "DE", "RU", "JP"};
+    cityNames_.clear();
+    for (int i = 0; i < 1000; i++) {
+        cityNames_.push_back("city" + std::to_string(i + 1));
+    }
+    stateKeys_.clear();
+    for (int i = 0; i <= duration_ / reloadInterval_ + 2; i++) {
+        stateKeys_.push_back("v" + std::to_string(i));
+    }
+}
+
+void
+GeoBench::run()
+{
+    unsigned int version = 1;
+    version_.store(version);
+    std::string tmp = writeGeoDb(version);
+    if (rename(tmp.c_str(), geoDbFile_.c_str()) != 0) {
+        logError("can't rename %s to %s, error: %s (%d)", tmp.c_str(), geoDbFile_.c_str(), strerror(errno), errno);
+        throw GeoBenchException("can't write geodb file");
+    }
+    GeoDb::init(config_);
+    GeoDb::whenReady().get();
+    /**/
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (size_t i = 0; i < threads_; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < threads_; i++) {
+        Worker *worker = workers[i].get();
+        worker->thread = std::thread([this, worker, i] {
+            lookupLoop(*worker, i + 1);
+        });
+    }
+    /**/
+    double seconds[p_count] = {0.0, 0.0};
+    auto begin = Utils::nowMicros();
+    auto end = begin + static_cast<uint64_t>(duration_) * 1000000;
+    auto phaseBegin = begin;
+    unsigned int reloads = 0;
+    for (;;) {
+        auto next = std::min(phaseBegin + static_cast<uint64_t>(reloadInterval_) * 1000000, end);
+        while (Utils::nowMicros() < next) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (version + 1 >= stateKeys_.size() || Utils::nowMicros() >= end) {
+            break;
+        }
+        tmp = writeGeoDb(version + 1);
+        uint64_t loaded = GeoDb::stats().reloads;
+        /*  steady till the new file shows up  */
+        auto now = Utils::nowMicros();
+        seconds[p_steady] += (double) (now - phaseBegin) / 1000000.0;
+        phaseBegin = now;
+        version_.store(++version);
+        phase_.store(p_reload);
+        if (rename(tmp.c_str(), geoDbFile_.c_str()) != 0) {
+            logError("can't rename %s to %s, error: %s (%d)", tmp.c_str(), geoDbFile_.c_str(), strerror(errno), errno);
+            break;
+        }
+        /*  a load competing with the lookup threads for cores takes a while  */
+        auto timeout = now + static_cast<uint64_t>(reloadInterval_) * 10000000;
+        while (GeoDb::stats().reloads == loaded && Utils::nowMicros() < timeout) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        if (GeoDb::stats().reloads == loaded) {
+            logError("geodb version %u not loaded in %d sec", version, reloadInterval_ * 10);
+        } else {
+            reloads++;
+            logInfo("geodb version %u loaded in %f sec", version, GeoDb::stats().lastReloadSeconds);
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(reloadTail_));
+        now = Utils::nowMicros();
+        seconds[p_reload] += (double) (now - phaseBegin) / 1000000.0;
+        phaseBegin = now;
+        phase_.store(p_steady);
+    }
+    seconds[p_steady] += (double) (Utils::nowMicros() - phaseBegin) / 1000000.0;
+    stop_.store(true);
+    for (auto& worker : workers) {
+        worker->thread.join();
+    }
+    report(workers, seconds, reloads);
+    GeoDb::stop();
+}
+
+std::string
+GeoBench::writeGeoDb(unsigned int version) const
+{
+    /*  range r: ipv4 [r * step, r * step + step / 2), ipv6 the first half of its /48  */
+    protobuf::Geo geo;
+    for (uint64_t r = 0; r < ranges_; r++) {
+        auto countryId = static_cast<unsigned int>(r + 1);
+        auto cityId = static_cast<unsigned int>(r % cityNames_.size() + 1);
+        const auto& countryKey = countryKeys_[r % countryKeys_.size()];
+        auto e = geo.add_ipsv4();
+        e->set_from(static_cast<uint32_t>(r * ipv4Step_));
+        e->set_to(static_cast<uint32_t>(r * ipv4Step_ + ipv4Step_ / 2 - 1));
+        e->set_country_id(countryId);
+        e->set_state_id(version);
+        e->set_city_id(cityId);
+        e->set_country_key(countryKey);
+        e->set_state_key(stateKeys_[version]);
+        e->set_city_name(cityNames_[cityId - 1]);
+        auto e6 = geo.add_ipsv6();
+        e6->set_from_hi(ipv6Base_ + r * ipv6Step_);
+        e6->set_from_lo(0);
+        e6->set_to_hi(ipv6Base_ + r * ipv6Step_ + ipv6Step_ / 2 - 1);
+        e6->set_to_lo(0xffffffffffffffffULL);
+        e6->set_country_id(countryId);
+        e6->set_state_id(version);
+        e6->set_city_id(cityId);
+        e6->set_country_key(countryKey);
+        e6->set_state_key(stateKeys_[version]);
+        e6->set_city_name(cityNames_[cityId - 1]);
+    }
+    std::string s = geo.SerializeAsString();
+    std::string tmp = geoDbFile_ + ".tmp";
+    FILE *fd = fopen(tmp.c_str(), "wb");
+    if (!fd) {
+        logError("can't fopen %s for writing", tmp.c_str());
+        throw GeoBenchException("can't write geodb file");
+    }
+    size_t rc = fwrite(s.c_str(), 1, s.size(), fd);
+    if (rc != s.size()) {
+        logError("can't write, rc: %zu, error: %s (%d)", rc, strerror(errno), errno);
+        fclose(fd);
+        throw GeoBenchException("can't write geodb file");
+    }
+    fclose(fd);
+    return tmp;
+}
+
+bool
+GeoBench::consistent(const GeoDb::Element& el, uint64_t range) const
+{
+    /*  any loaded version may serve, but all fields must come from the same one  */
+    if (el.countryId != range + 1 || el.cityId != range % cityNames_.size() + 1 || el.stateId == 0
+            || el.stateId > version_.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    return el.countryKey == countryKeys_[range % countryKeys_.size()] && el.cityName == cityNames_[el.cityId - 1]
+        && el.stateKey == stateKeys_[el.stateId];
+}
+
+void
+GeoBench::lookupLoop(Worker& worker, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    int fd = openDtlbCounter();
+    worker.dtlb = fd >= 0;
+    uint64_t misses = readCounter(fd);
+    int phase = phase_.load(std::memory_order_relaxed);
+    while (!stop_.load(std::memory_order_relaxed)) {
+        int current = phase_.load(std::memory_order_relaxed);
+        if (current != phase) {
+            uint64_t now = readCounter(fd);
+            worker.dtlbMisses[phase] += now - misses;
+            misses = now;
+            phase = current;
+        }
+        uint64_t x = rng();
+        uint64_t range = (x & 0xffffffff) % ranges_;
+        bool ipv6 = (x >> 32) & 1;
+        GeoDb::Element el;
+        bool covered;
+        auto begin = std::chrono::steady_clock::now();
+        if (ipv6) {
+            uint64_t offset = (x >> 33) % ipv6Step_;
+            covered = offset < ipv6Step_ / 2;
+            el = GeoDb::getIpv6(GeoDb::IPv6(ipv6Base_ + range * ipv6Step_ + offset, x));
+        } else {
+            uint64_t offset = (x >> 33) % ipv4Step_;
+            covered = offset < ipv4Step_ / 2;
+            el = GeoDb::getIpv4(static_cast<GeoDb::IPv4>(range * ipv4Step_ + offset));
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+        worker.latency[phase].add(static_cast<uint64_t>(ns));
+        worker.lookups[phase]++;
+        if (covered ? !consistent(el, range) : (el.countryId != 0 || !el.countryKey.empty())) {
+            worker.mismatches++;
+        }
+    }
+    worker.dtlbMisses[phase] += readCounter(fd) - misses;
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+uint64_t
+GeoBench::Histogram::percentile(double p) const
+{
+    auto rank = static_cast<uint64_t>(p * static_cast<double>(count));
+    uint64_t seen = 0;
+    for (size_t b = 0; b < size; b++) {
+        seen += buckets[b];
+        if (seen > rank) {
+            return value(b);
+        }
+    }
+    return 0;
+}
+
+void
+GeoBench::report(const std::vector<std::unique_ptr<Worker>>& workers, const double seconds[p_count], unsigned int reloads) const
+{
+    uint64_t mismatches = 0;
+    bool dtlb = true;
+    for (const auto& worker : workers) {
+        mismatches += worker->mismatches;
+        dtlb = dtlb && worker->dtlb;
+    }
+    logInfo("%zu threads, %llu ranges per family, %u reloads, %llu mismatches", threads_, (unsigned long long) ranges_,
+        reloads, (unsigned long long) mismatches);
+    for (int phase = 0; phase < p_count; phase++) {
+        Histogram latency;
+        uint64_t lookups = 0;
+        uint64_t misses = 0;
+        for (const auto& worker : workers) {
+            latency.merge(worker->latency[phase]);
+            lookups += worker->lookups[phase];
+            misses += worker->dtlbMisses[phase];
+        }
+        if (lookups == 0) {
+            continue;
+        }
+        char tlb[64] = "n/a";
+        if (dtlb) {
+            snprintf(tlb, sizeof(tlb), "%f", (double) misses / (double) lookups);
+        }
+        logInfo("%s: %f sec, %llu lookups, %.0f lookups/sec, p50 %llu ns, p99 %llu ns, p999 %llu ns, dTLB misses per lookup %s",
+            phaseNames[phase], seconds[phase], (unsigned long long) lookups,
+            seconds[phase] > 0.0 ? (double) lookups / seconds[phase] : 0.0,
+            (unsigned long long) latency.percentile(0.5), (unsigned long long) latency.percentile(0.99),
+            (unsigned long long) latency.percentile(0.999), tlb);
+    }
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rapidjson/document.h"
+
+#include "base/geo_db.h"
+
+namespace ggAdNet {
+namespace Tools {
+
+class GeoBenchException: public std::runtime_error
+{
+public:
+    explicit GeoBenchException(const std::string& what) : std::runtime_error(what) {};
+    explicit GeoBenchException(const char *what) : std::runtime_error(what) {};
+};
+
+/*
+ *  Reload under load: lookup threads call GeoDb at full speed while the geodb file is
+ *  rewritten with a generated dataset to trigger reloads. Reports throughput, p50/p99/p999
+ *  latency and dTLB misses in steady state and during reloads, and lookups returning
+ *  inconsistent elements. Build it with -fsanitize=thread to catch snapshot switch races.
+ */
+class GeoBench
+{
+public:
+
+    GeoBench();
+    ~GeoBench();
+    void run();
+
+private:
+
+    enum Phase {
+        p_steady,
+        p_reload,
+        p_count
+    };
+
+    /*  log-linear, 16 buckets per power of two of nanoseconds  */
+    struct Histogram {
+        static constexpr unsigned int subBits = 4;
+        static constexpr size_t size = 64 << subBits;
+
+        std::vector<uint64_t> buckets = std::vector<uint64_t>(size);
+        uint64_t count{0};
+
+        void add(uint64_t ns) {
+            buckets[bucket(ns)]++;
+            count++;
+        }
+
+        void merge(const Histogram& h) {
+            for (size_t b = 0; b < size; b++) {
+                buckets[b] += h.buckets[b];
+            }
+            count += h.count;
+        }
+
+        [[nodiscard]] uint64_t percentile(double p) const;
+
+        static size_t bucket(uint64_t v) {
+            if (v < (1u << subBits)) {
+                return static_cast<size_t>(v);
+            }
+            auto msb = static_cast<unsigned int>(63 - __builtin_clzll(v));
+            return ((msb - subBits + 1) << subBits) | ((v >> (msb - subBits)) & ((1u << subBits) - 1));
+        }
+
+        static uint64_t value(size_t b) {
+            if (b < (1u << subBits)) {
+                return b;
+            }
+            size_t octave = b >> subBits;
+            return ((1ULL << subBits) | (b & ((1u << subBits) - 1))) << (octave - 1);
+        }
+    };
+
+    struct Worker {
+        std::thread thread;
+        Histogram latency[p_count];
+        uint64_t lookups[p_count]{};
+        uint64_t dtlbMisses[p_count]{};
+        bool dtlb{false};
+        uint64_t mismatches{0};
+    };
+
+    void initConfig(const rapidjson::Document& config);
+    [[nodiscard]] std::string writeGeoDb(unsigned int version) const;
+    void lookupLoop(Worker& worker, uint64_t seed);
+    [[nodiscard]] bool consistent(const GeoDb::Element& el, uint64_t range) const;
+    void report(const std::vector<std::unique_ptr<Worker>>& workers, const double seconds[p_count], unsigned int reloads) const;
+
+    const std::string configFile_ = "geo_bench.conf";
+    const std::string defaultGeoDbFile_ = "geodb_bench.dat";
+    const int defaultDuration_ = 60;
+    const int defaultReloadInterval_ = 15;
+    const int defaultReloadTail_ = 1;
+    const int defaultRanges_ = 1000000;
+    const uint64_t ipv6Base_ = 0x2a00000000000000ULL;
+    const uint64_t ipv6Step_ = 0x10000;     // /48 per range, the first half is covered
+
+    /*  config  */
+    rapidjson::Document config_;
+    std::string geoDbFile_;
+    size_t threads_{0};
+    int duration_{0};                   // sec
+    int reloadInterval_{0};             // sec, between file rewrites
+    int reloadTail_{0};                 // sec, still counted as reload after the switch
+    uint64_t ranges_{0};                // per address family
+    uint64_t ipv4Step_{0};
+    /**/
+    std::vector<std::string> countryKeys_;
+    std::vector<std::string> stateKeys_;    // by version
+    std::vector<std::string> cityNames_;
+    std::atomic<bool> stop_{false};
+    std::atomic<int> phase_{p_steady};
+    std::atomic<unsigned int> version_{0};
+};
+
+} // end of Tools namespace
+} // end of ggAdNet namespace
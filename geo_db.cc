@@ -1,45 +1,480 @@
 #include "geo_db.h"
 
 #include <arpa/inet.h>
+#include <numa.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstring>
+#include <map>
 #include <memory>
 
 #include "cstring.h"
 #include "exceptions.h"
 #include "file_utils.h"
+#include "geo_mmdb.h"
+#include "geo_ring_buffer.h"
+#include "geo_shm.h"
 #include "utils.h"
 
 #include "protobuf/geo.pb.h"
 
 using namespace ggAdNet;
 
-GeoDb *GeoDb::instance_ = nullptr;
+std::shared_ptr<GeoDb::Handle> GeoDb::instance_;
+
+namespace {
+
+/*  false if file can't be stat'ed  */
+bool
+statFile(const std::string& file, int64_t& modified, uint64_t& size)
+{
+    struct stat st{};
+    if (stat(file.c_str(), &st) != 0) {
+        return false;
+    }
+    modified = static_cast<int64_t>(st.st_mtime);
+    size = static_cast<uint64_t>(st.st_size);
+    return true;
+}
+
+void
+readGeo(const std::string& file, protobuf::Geo& geo)
+{
+    FileUtils::Mmap mmap(file);
+    if (mmap.open() != FileUtils::Mmap::ReturnCode::SUCCESS) {
+        logError("can't mmap file %s", file.c_str());
+        throw GeoDbException("can't mmap file");
+    }
+    const char *p = mmap.ptr();
+    if (!p) {
+        logError("file %s is empty", file.c_str());
+        throw GeoDbException("geodb file is empty");
+    }
+    if (!geo.ParseFromArray(p, static_cast<int>(mmap.size()))) {
+        logError("can't parse geodb file %s", file.c_str());
+        throw GeoDbException("can't parse geodb file");
+    }
+}
+
+std::chrono::time_point<std::chrono::system_clock>
+timeToChrono(uint64_t tm)
+{
+    auto sec = static_cast<time_t>(tm / 1000000);
+    auto usec = tm - sec * 1000000;
+    return std::chrono::system_clock::from_time_t(sec)
+        + std::chrono::microseconds(usec);
+}
+
+}
+
+/*
+ *  One thread checks the files of all open instances, each on its own schedule, and runs
+ *  async initial loads. It is started with the first instance and stopped with the last.
+ */
+class GeoDb::Watcher
+{
+public:
+
+    static void add(GeoDb *geodb) {
+        watcher().addInstance(geodb);
+    }
+
+    /*  waits for a check of geodb the thread may be running  */
+    static void remove(GeoDb *geodb) {
+        watcher().removeInstance(geodb);
+    }
+
+private:
+
+    struct Instance {
+        GeoDb *geodb;
+        uint64_t nextCheck;
+    };
+
+    /*  never destroyed, an instance left open at exit keeps the thread  */
+    static Watcher& watcher() {
+        static auto *watcher = new Watcher();
+        return *watcher;
+    }
+
+    void addInstance(GeoDb *geodb);
+    void removeInstance(GeoDb *geodb);
+    void run(uint64_t epoch);
+
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::vector<Instance> instances_;
+    const GeoDb *running_{nullptr};
+    std::thread thread_;
+    uint64_t epoch_{0};             // a thread of an older epoch exits
+};
+
+void
+GeoDb::Watcher::addInstance(GeoDb *geodb)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    /*  due right away, the first check takes the file time or does the async load  */
+    instances_.push_back({geodb, 0});
+    if (!thread_.joinable()) {
+        thread_ = std::thread([this, epoch = epoch_] {
+            run(epoch);
+        });
+    } else {
+        cond_.notify_all();
+    }
+}
+
+void
+GeoDb::Watcher::removeInstance(GeoDb *geodb)
+{
+    std::thread thread;
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+        instances_.erase(std::remove_if(instances_.begin(), instances_.end(), [geodb](const Instance& instance) {
+            return instance.geodb == geodb;
+        }), instances_.end());
+        cond_.wait(lock, [this, geodb] {
+            return running_ != geodb;
+        });
+        if (instances_.empty()) {
+            epoch_++;
+            thread = std::move(thread_);
+            cond_.notify_all();
+        }
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void
+GeoDb::Watcher::run(uint64_t epoch)
+{
+    std::unique_lock<std::mutex> lock(lock_);
+    while (epoch == epoch_) {
+        const Instance *due = nullptr;
+        for (const auto& instance : instances_) {
+            if (!due || instance.nextCheck < due->nextCheck) {
+                due = &instance;
+            }
+        }
+        if (!due) {
+            cond_.wait(lock);
+            continue;
+        }
+        if (Utils::nowMicros() < due->nextCheck) {
+            cond_.wait_until(lock, timeToChrono(due->nextCheck));
+            continue;
+        }
+        GeoDb *geodb = due->geodb;
+        uint64_t scheduled = due->nextCheck;
+        running_ = geodb;
+        lock.unlock();
+        uint64_t nextCheck = geodb->checkForUpdate(scheduled);
+        lock.lock();
+        running_ = nullptr;
+        for (auto& instance : instances_) {
+            if (instance.geodb == geodb) {
+                instance.nextCheck = nextCheck;
+            }
+        }
+        cond_.notify_all();
+    }
+}
+
+/*
+ *  Shadow verification: sampled lookups are queued with their results and looked up
+ *  again on a background thread, against a std::map search over the ranges read back from
+ *  the file the snapshot was built from, so index build bugs show, or against the previous
+ *  snapshot, divergences are counted and logged. Lookups only pay a push into a lock-free
+ *  ring, a full ring drops the sample.
+ */
+class GeoDb::Shadow
+{
+public:
+
+    struct Sample {
+        uint64_t seq;               // of the snapshot looked up
+        IPv6Key key;
+        bool ipv6;
+        uint32_t countryId;
+        uint32_t stateId;
+        uint32_t cityId;
+        uint32_t asn;
+    };
+
+    Shadow(GeoDb& geodb, ShadowMode mode) : geodb_(geodb), mode_(mode), ring_(queueSize) {
+        thread_ = std::thread([this] {
+            run();
+        });
+    }
+
+    Shadow(const Shadow&) = delete;
+    Shadow& operator=(const Shadow&) = delete;
+
+    ~Shadow() {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stop_.store(true);
+        }
+        cond_.notify_all();
+        thread_.join();
+    }
+
+    void push(const Sample& sample) {
+        if (!ring_.push(sample)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void counters(Stats& stats) const {
+        stats.shadowChecked = checked_.load(std::memory_order_relaxed);
+        stats.shadowDivergences = divergences_.load(std::memory_order_relaxed);
+        stats.shadowSkipped = skipped_.load(std::memory_order_relaxed);
+        stats.shadowDropped = dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    static constexpr size_t queueSize = 4096;
+    static constexpr int pollMillis = 50;
+    static constexpr size_t logLimit = 100;         // divergences logged per snapshot
+
+    /*  values of a source range  */
+    struct Reference {
+        IPv6Key to;
+        uint32_t countryId;
+        uint32_t stateId;
+        uint32_t cityId;
+        uint32_t asn;
+    };
+
+    void run();
+    void check(const Sample& sample);
+    /*  false when the source file changed since the snapshot was built  */
+    [[nodiscard]] bool reference(const Snapshot& snapshot, const Sample& sample, Element& expected);
+    [[nodiscard]] bool loadReference(const Db::Source& source);
+
+    GeoDb& geodb_;
+    ShadowMode mode_;
+    GeoRingBuffer<Sample> ring_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+    /*  the thread's own, ranges by from  */
+    uint64_t referenceSeq_{0};
+    bool referenceLoaded_{false};
+    std::map<IPv6Key, Reference> reference4_;
+    std::map<IPv6Key, Reference> reference6_;
+    uint64_t loggedSeq_{0};
+    size_t logged_{0};
+    /**/
+    std::atomic<uint64_t> checked_{0};
+    std::atomic<uint64_t> divergences_{0};
+    std::atomic<uint64_t> skipped_{0};
+    std::atomic<uint64_t> dropped_{0};
+};
+
+void
+GeoDb::Shadow::run()
+{
+    std::unique_lock<std::mutex> lock(lock_);
+    while (!stop_.load()) {
+        lock.unlock();
+        Sample sample{};
+        while (!stop_.load() && ring_.pop(sample)) {
+            check(sample);
+        }
+        lock.lock();
+        /*  lookups don't signal, the ring is polled  */
+        cond_.wait_for(lock, std::chrono::milliseconds(pollMillis), [this] {
+            return stop_.load();
+        });
+    }
+}
+
+bool
+GeoDb::Shadow::loadReference(const Db::Source& source)
+{
+    reference4_.clear();
+    reference6_.clear();
+    auto unchanged = [&source] {
+        int64_t modified;
+        uint64_t size;
+        return statFile(source.file, modified, size) && modified == source.modified && size == source.size;
+    };
+    protobuf::Geo geo;
+    try {
+        if (!unchanged()) {
+            return false;
+        }
+        readGeo(source.file, geo);
+        if (!unchanged()) {
+            return false;
+        }
+    } catch (const GeoDbException&) {
+        return false;
+    }
+    auto asn = [&geo](uint32_t id) -> uint32_t {
+        return id && static_cast<int>(id) <= geo.asns_size() ? geo.asns(static_cast<int>(id - 1)).number() : 0;
+    };
+    for (int i = 0; i < geo.ipsv4_size(); i++) {
+        const auto& e = geo.ipsv4(i);
+        reference4_.emplace(static_cast<IPv6Key>(e.from()),
+            Reference{static_cast<IPv6Key>(e.to()), e.country_id(), e.state_id(), e.city_id(), asn(e.asn())});
+    }
+    for (int i = 0; i < geo.ipsv6_size(); i++) {
+        const auto& e = geo.ipsv6(i);
+        reference6_.emplace(GeoDb::ipv6Key(IPv6(e.from_hi(), e.from_lo())),
+            Reference{GeoDb::ipv6Key(IPv6(e.to_hi(), e.to_lo())), e.country_id(), e.state_id(), e.city_id(), asn(e.asn())});
+    }
+    return true;
+}
+
+bool
+GeoDb::Shadow::reference(const Snapshot& snapshot, const Sample& sample, Element& expected)
+{
+    if (referenceSeq_ != sample.seq) {
+        const auto& source = snapshot.db().source();
+        referenceLoaded_ = loadReference(source);
+        referenceSeq_ = sample.seq;
+        if (!referenceLoaded_) {
+            logWarn("geodb shadow can't read back %s as snapshot %llu was built from it, its samples are skipped",
+                source.file.c_str(), (unsigned long long) sample.seq);
+        }
+    }
+    if (!referenceLoaded_) {
+        return false;
+    }
+    const auto& ranges = sample.ipv6 ? reference6_ : reference4_;
+    auto it = ranges.upper_bound(sample.key);
+    if (it == ranges.begin()) {
+        return true;
+    }
+    --it;
+    if (sample.key <= it->second.to) {
+        expected.countryId = it->second.countryId;
+        expected.stateId = it->second.stateId;
+        expected.cityId = it->second.cityId;
+        expected.asn = it->second.asn;
+    }
+    return true;
+}
+
+void
+GeoDb::Shadow::check(const Sample& sample)
+{
+    std::shared_ptr<Snapshot> current;
+    std::shared_ptr<Snapshot> previous;
+    {
+        std::lock_guard<std::mutex> guard(geodb_.snapshotLock_);
+        current = geodb_.snapshot_;
+        previous = geodb_.prevSnapshot_;
+    }
+    if (!current || current->seq != sample.seq || (mode_ == ShadowMode::PREVIOUS && !previous)) {
+        skipped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    IPv6 ip(static_cast<uint64_t>(sample.key >> 64), static_cast<uint64_t>(sample.key));
+    auto ipv4 = static_cast<IPv4>(sample.key);
+    Element expected;
+    if (mode_ == ShadowMode::PREVIOUS) {
+        const Db& db = previous->db();
+        expected = sample.ipv6 ? db.find(ip) : db.find(ipv4);
+    } else if (!reference(*current, sample, expected)) {
+        skipped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    checked_.fetch_add(1, std::memory_order_relaxed);
+    if (expected.countryId == sample.countryId && expected.stateId == sample.stateId && expected.cityId == sample.cityId
+            && expected.asn == sample.asn) {
+        return;
+    }
+    divergences_.fetch_add(1, std::memory_order_relaxed);
+    if (loggedSeq_ != sample.seq) {
+        loggedSeq_ = sample.seq;
+        logged_ = 0;
+    }
+    if (logged_ < logLimit) {
+        logged_++;
+        logWarn("geodb shadow divergence for %s: country %u, state %u, city %u, asn %u, %s has %u, %u, %u, %u%s",
+            sample.ipv6 ? ip.toString().c_str() : GeoDb::ipv4ToString(ipv4).c_str(),
+            sample.countryId, sample.stateId, sample.cityId, sample.asn,
+            mode_ == ShadowMode::PREVIOUS ? "previous snapshot" : "reference",
+            expected.countryId, expected.stateId, expected.cityId, expected.asn,
+            logged_ == logLimit ? ", no more are logged for this snapshot" : "");
+    }
+}
+
+void
+GeoDb::shadowPush(const Snapshot& snapshot, bool ipv6, IPv6Key key, const Element& el)
+{
+    shadow_->push({snapshot.seq, key, ipv6, el.countryId, el.stateId, el.cityId, el.asn});
+}
 
 GeoDb::GeoDb(const rapidjson::Document& config)
-    : db_(nullptr)
 {
     initConfig(config);
-    if (!dontLoadDb_) {
-        db_ = loadDb();
-        if (!db_) {
+    if (shadowMode_ == ShadowMode::REFERENCE && format_ != Format::PROTOBUF) {
+        throw ConfigException("geodb.shadow reference needs the protobuf format");
+    }
+    if (shadowMode_ != ShadowMode::NONE) {
+        /*  the sampled fraction is rounded up to a power of two  */
+        uint64_t every = 1;
+        while (every * 2 <= static_cast<uint64_t>(1.0 / shadowSampleRate_)) {
+            every *= 2;
+        }
+        shadowMask_ = every - 1;
+        shadow_ = std::make_unique<Shadow>(*this, shadowMode_);
+    }
+    if (!shmName_.empty() && format_ == Format::PROTOBUF) {
+        GeoShm::Mapping mapping;
+        mapping.populate = prefault_;
+        mapping.hugePages = hugePages_ != HugePages::NONE;
+        mapping.lock = mlock_;
+        shm_ = std::make_unique<GeoShm>(shmName_, mapping);
+    }
+    readyFuture_ = readyPromise_.get_future().share();
+    if (dontLoadDb_) {
+        ready_.store(true);
+        readyPromise_.set_value();
+    } else if (asyncInit_) {
+        /*  the watcher thread loads the db, the fallback serves meanwhile  */
+        if (!fallbackFile_.empty()) {
+            setDb(buildDb(fallbackFile_));
+        }
+    } else {
+        auto begin = Utils::nowMicros();
+        auto db = loadDb();
+        if (!db) {
             throw GeoDbException("can't load db");
         }
+        setDb(db);
+        recordReload(begin);
+        ready_.store(true);
+        readyPromise_.set_value();
     }
-    doShutdown_.store(false);
-    watcherThread_ = std::make_unique<std::thread>([this] {
-        watcherThreadLoop();
-    });
+    Watcher::add(this);
 }
 
 GeoDb::~GeoDb()
 {
-    if (watcherThread_) {
-        doShutdown_.store(true);
-        watcherCond_.notify_all();
-        watcherThread_->join();
-        watcherThread_.reset();
-    }
+    Watcher::remove(this);
+    shadow_.reset();
+}
+
+std::shared_ptr<GeoDb::Handle>
+GeoDb::open(const rapidjson::Document& config)
+{
+    /*  the handle owns it from here  */
+    auto *geodb = new GeoDb(config);
+    return std::shared_ptr<Handle>(new Handle(geodb));
 }
 
 void
@@ -48,16 +483,13 @@ GeoDb::init(const rapidjson::Document& config)
     if (instance_ != nullptr) {
         return;
     }
-    instance_ = new GeoDb(config);
+    instance_ = GeoDb::open(config);
 }
 
 void
 GeoDb::stop()
 {
-    if (instance_ != nullptr) {
-        delete instance_;
-        instance_ = nullptr;
-    }
+    instance_.reset();
 }
 
 GeoDb::IPv4
@@ -107,6 +539,313 @@ GeoDb::ipv6FromString(const std::string& ipStr)
     return ip;
 }
 
+GeoDb::Route
+GeoDb::parseIp(const CString& s, IPv4& v4, IPv6& ip)
+{
+    if (s.size > INET6_ADDRSTRLEN) {
+        return r_count;
+    }
+    char buf[INET6_ADDRSTRLEN + 1];
+    memcpy(buf, s.data, s.size);
+    buf[s.size] = '\0';
+    struct in_addr in4{};
+    if (inet_pton(AF_INET, buf, &in4) == 1) {
+        v4 = static_cast<IPv4>(ntohl(in4.s_addr));
+        return r_ipv4;
+    }
+    struct in6_addr in6{};
+    if (inet_pton(AF_INET6, buf, &in6) != 1) {
+        return r_count;
+    }
+    ip = IPv6();
+    for (int j = 0; j < 8; j++) {
+        ip.hi = (ip.hi << 8) | in6.s6_addr[j];
+        ip.lo = (ip.lo << 8) | in6.s6_addr[j + 8];
+    }
+    return GeoDb::embeddedIpv4(ip, v4);
+}
+
+void
+GeoDb::Handle::getIps(const CString *ips, size_t n, Element *out) const
+{
+    /*  stats and shadow checks as for single lookups  */
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    auto& shard = geodb_->stats_.shard();
+    const Snapshot *snapshot = geodb_->current_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; i++) {
+        IPv4 v4 = 0;
+        IPv6 ip;
+        Route route = GeoDb::parseIp(ips[i], v4, ip);
+        if (route == r_count) {
+            shard.add(GeoStats::c_invalid);
+            out[i] = geodb_->empty_;
+            continue;
+        }
+        out[i] = geodb_->lookup(shard, snapshot, static_cast<GeoStats::Counter>(route),
+                route == r_ipv4 ? GeoStats::h_ipv4 : GeoStats::h_ipv6, route == r_ipv6,
+                route == r_ipv6 ? GeoDb::ipv6Key(ip) : v4, [&ip, v4, route](const Db& db) {
+            return route == r_ipv6 ? db.find(ip) : db.find(v4);
+        });
+    }
+}
+
+GeoDb::Attributes
+GeoDb::Handle::getAttributes(IPv4 ip) const
+{
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    const Db *db = geodb_->localDb();
+    return db ? db->attributes(ip) : Attributes();
+}
+
+GeoDb::Attributes
+GeoDb::Handle::getAttributes(const IPv6& ip) const
+{
+    IPv4 v4 = 0;
+    if (GeoDb::embeddedIpv4(ip, v4) != r_ipv6) {
+        return getAttributes(v4);
+    }
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    const Db *db = geodb_->localDb();
+    return db ? db->attributes(ip) : Attributes();
+}
+
+GeoDb::Attributes
+GeoDb::Handle::getAttributes(const CString& s) const
+{
+    IPv4 v4 = 0;
+    IPv6 ip;
+    Route route = GeoDb::parseIp(s, v4, ip);
+    if (route == r_count) {
+        return {};
+    }
+    return route == r_ipv6 ? getAttributes(ip) : getAttributes(v4);
+}
+
+namespace {
+
+const GeoSpatialIndex&
+spatialIndex(const GeoSpatialIndex *spatial)
+{
+    if (!spatial) {
+        throw GeoDbException("geodb spatial index is not built");
+    }
+    return *spatial;
+}
+
+}
+
+GeoDb::City
+GeoDb::Handle::nearestCity(double latitude, double longitude) const
+{
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    const Db *db = geodb_->localDb();
+    if (!db) {
+        return {};
+    }
+    auto hit = spatialIndex(db->spatial()).nearest(latitude, longitude);
+    if (hit.id == GeoSpatialIndex::npos) {
+        return {};
+    }
+    return {hit.id, hit.distance};
+}
+
+std::vector<GeoDb::City>
+GeoDb::Handle::citiesWithin(double latitude, double longitude, double km) const
+{
+    std::vector<City> cities;
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    const Db *db = geodb_->localDb();
+    if (!db) {
+        return cities;
+    }
+    std::vector<GeoSpatialIndex::Hit> hits;
+    spatialIndex(db->spatial()).within(latitude, longitude, km, hits);
+    cities.reserve(hits.size());
+    for (const auto& hit : hits) {
+        cities.push_back({hit.id, hit.distance});
+    }
+    return cities;
+}
+
+std::vector<unsigned int>
+GeoDb::Handle::cityNeighbors(unsigned int cityId) const
+{
+    std::vector<uint32_t> neighbors;
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    const Db *db = geodb_->localDb();
+    if (db) {
+        spatialIndex(db->spatial()).neighbors(cityId, neighbors);
+    }
+    return {neighbors.begin(), neighbors.end()};
+}
+
+bool
+GeoDb::Handle::cityLocation(unsigned int cityId, double& latitude, double& longitude) const
+{
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    const Db *db = geodb_->localDb();
+    return db && spatialIndex(db->spatial()).location(cityId, latitude, longitude);
+}
+
+template <typename Ip>
+bool
+GeoDb::withinRadius(const Db *db, const Ip& ip, unsigned int cityId, double km)
+{
+    if (!db) {
+        return false;
+    }
+    double latitude;
+    double longitude;
+    double cityLatitude;
+    double cityLongitude;
+    if (!spatialIndex(db->spatial()).location(cityId, cityLatitude, cityLongitude) || !db->locate(ip, latitude, longitude)) {
+        return false;
+    }
+    return GeoSpatialIndex::distance(latitude, longitude, cityLatitude, cityLongitude) <= km;
+}
+
+bool
+GeoDb::Handle::withinRadius(IPv4 ip, unsigned int cityId, double km) const
+{
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    return GeoDb::withinRadius(geodb_->localDb(), ip, cityId, km);
+}
+
+bool
+GeoDb::Handle::withinRadius(const IPv6& ip, unsigned int cityId, double km) const
+{
+    IPv4 v4 = 0;
+    if (GeoDb::embeddedIpv4(ip, v4) != r_ipv6) {
+        return withinRadius(v4, cityId, km);
+    }
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    return GeoDb::withinRadius(geodb_->localDb(), ip, cityId, km);
+}
+
+bool
+GeoDb::Handle::withinRadius(const CString& s, unsigned int cityId, double km) const
+{
+    IPv4 v4 = 0;
+    IPv6 ip;
+    Route route = GeoDb::parseIp(s, v4, ip);
+    if (route == r_count) {
+        return false;
+    }
+    return route == r_ipv6 ? withinRadius(ip, cityId, km) : withinRadius(v4, cityId, km);
+}
+
+std::shared_ptr<const GeoDb::Targeting>
+GeoDb::Handle::compile(const TargetSet& set, bool flatten) const
+{
+    auto targeting = std::make_shared<Targeting>();
+    targeting->handle_ = shared_from_this();
+    {
+        std::lock_guard<std::mutex> guard(geodb_->snapshotLock_);
+        targeting->snapshot_ = geodb_->snapshot_;
+    }
+    if (!targeting->snapshot_) {
+        throw GeoDbException("geodb is not loaded");
+    }
+    const Db& db = targeting->snapshot_->db();
+    if (db.mmdb()) {
+        throw GeoDbException("targeting needs a protobuf geodb");
+    }
+    auto sorted = [](std::vector<unsigned int> ids) {
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+    auto countries = sorted(set.countries);
+    auto states = sorted(set.states);
+    auto cities = sorted(set.cities);
+    auto has = [](const std::vector<unsigned int>& ids, unsigned int id) {
+        return id != 0 && std::binary_search(ids.begin(), ids.end(), id);
+    };
+    size_t count = db.elementCount();
+    std::vector<uint64_t> elements((count + 63) / 64);
+    for (uint32_t el = 0; el < count; el++) {
+        unsigned int countryId;
+        unsigned int stateId;
+        unsigned int cityId;
+        db.locations(el, countryId, stateId, cityId);
+        if (has(countries, countryId) || has(states, stateId) || has(cities, cityId)) {
+            elements[el >> 6] |= 1ULL << (el & 63);
+        }
+    }
+    if (flatten) {
+        for (int part = 0; part < Db::p_count; part++) {
+            size_t slots = db.slots(static_cast<Db::Part>(part));
+            auto& bits = targeting->slots_[part];
+            bits.assign((slots + 63) / 64, 0);
+            for (size_t i = 0; i < slots; i++) {
+                uint32_t el = db.slotElement(static_cast<Db::Part>(part), i);
+                if (el < count && Targeting::test(elements, el)) {
+                    bits[i >> 6] |= 1ULL << (i & 63);
+                }
+            }
+        }
+        targeting->flat_ = true;
+    } else {
+        targeting->elements_ = std::move(elements);
+    }
+    return targeting;
+}
+
+static_assert(static_cast<int>(GeoReverseIndex::l_country) == GeoDb::l_country && static_cast<int>(GeoReverseIndex::l_city) == GeoDb::l_city,
+    "locations must follow reverse index levels");
+
+std::vector<std::string>
+GeoDb::Handle::networks(Location location, unsigned int id, bool ipv6) const
+{
+    std::vector<std::string> networks;
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    const Db *db = geodb_->localDb();
+    if (!db) {
+        return networks;
+    }
+    const GeoReverseIndex *reverse = db->reverse();
+    if (!reverse) {
+        throw GeoDbException("geodb reverse index is not built");
+    }
+    std::vector<GeoReverseIndex::Range> ranges;
+    std::vector<GeoReverseIndex::Cidr> cidrs;
+    auto level = static_cast<GeoReverseIndex::Level>(location);
+    reverse->ranges(level, id, ipv6 ? GeoReverseIndex::f_ipv6 : GeoReverseIndex::f_ipv4, ranges);
+    for (const auto& range : ranges) {
+        GeoReverseIndex::cover(range, ipv6 ? 128 : 32, cidrs);
+    }
+    networks.reserve(cidrs.size());
+    for (const auto& cidr : cidrs) {
+        std::string net = ipv6
+            ? IPv6(static_cast<uint64_t>(cidr.prefix >> 64), static_cast<uint64_t>(cidr.prefix)).toString()
+            : GeoDb::ipv4ToString(static_cast<IPv4>(cidr.prefix));
+        net += '/';
+        net += std::to_string(cidr.length);
+        networks.push_back(std::move(net));
+    }
+    return networks;
+}
+
+GeoDb::Coverage
+GeoDb::Handle::coverage(Location location, unsigned int id) const
+{
+    Coverage coverage;
+    GeoEpochs::Guard guard(geodb_->epochs_);
+    const Db *db = geodb_->localDb();
+    if (!db) {
+        return coverage;
+    }
+    const GeoReverseIndex *reverse = db->reverse();
+    if (!reverse) {
+        throw GeoDbException("geodb reverse index is not built");
+    }
+    auto level = static_cast<GeoReverseIndex::Level>(location);
+    coverage.ipv4Ranges = reverse->rangeCount(level, id, GeoReverseIndex::f_ipv4);
+    coverage.ipv4Addresses = static_cast<uint64_t>(reverse->addresses(level, id, GeoReverseIndex::f_ipv4));
+    coverage.ipv6Ranges = reverse->rangeCount(level, id, GeoReverseIndex::f_ipv6);
+    coverage.ipv6Addresses = static_cast<double>(reverse->addresses(level, id, GeoReverseIndex::f_ipv6));
+    return coverage;
+}
+
 void
 GeoDb::net4ToRange(const std::string& net, IPv4& from, IPv4& to)
 {
@@ -151,6 +890,20 @@ void
 GeoDb::initConfig(const rapidjson::Document& config)
 {
     geodbFile_ = defaultGeodbFile_;
+    format_ = Format::PROTOBUF;
+    ipv6Compressed_ = false;
+    reverseIndex_ = false;
+    attributes_ = false;
+    spatialIndex_ = false;
+    shmName_.clear();
+    numaReplicas_ = false;
+    hugePages_ = HugePages::NONE;
+    prefault_ = false;
+    mlock_ = false;
+    asyncInit_ = false;
+    fallbackFile_.clear();
+    shadowMode_ = ShadowMode::NONE;
+    shadowSampleRate_ = defaultShadowSampleRate_;
     checkForUpdateTimeout_= defaultCheckForUpdateTimeout_;
     dontLoadDb_ = false;
     /*  parse  */
@@ -171,6 +924,121 @@ GeoDb::initConfig(const rapidjson::Document& config)
             }
             geodbFile_ = geodb["file"].GetString();
         }
+        if (geodb.HasMember("format")) {
+            if (!geodb["format"].IsString()) {
+                throw ConfigException("geodb.format must be a string");
+            }
+            std::string format = geodb["format"].GetString();
+            if (format == "protobuf") {
+                format_ = Format::PROTOBUF;
+            } else if (format == "mmdb") {
+                format_ = Format::MMDB;
+            } else {
+                throw ConfigException("geodb.format must be protobuf or mmdb");
+            }
+        }
+        if (geodb.HasMember("ipv6_compressed")) {
+            if (!geodb["ipv6_compressed"].IsBool()) {
+                throw ConfigException("geodb.ipv6_compressed must be a boolean");
+            }
+            ipv6Compressed_ = geodb["ipv6_compressed"].GetBool();
+        }
+        if (geodb.HasMember("reverse_index")) {
+            if (!geodb["reverse_index"].IsBool()) {
+                throw ConfigException("geodb.reverse_index must be a boolean");
+            }
+            reverseIndex_ = geodb["reverse_index"].GetBool();
+        }
+        if (geodb.HasMember("attributes")) {
+            if (!geodb["attributes"].IsBool()) {
+                throw ConfigException("geodb.attributes must be a boolean");
+            }
+            attributes_ = geodb["attributes"].GetBool();
+        }
+        if (geodb.HasMember("spatial_index")) {
+            if (!geodb["spatial_index"].IsBool()) {
+                throw ConfigException("geodb.spatial_index must be a boolean");
+            }
+            spatialIndex_ = geodb["spatial_index"].GetBool();
+        }
+        if (geodb.HasMember("shm_name")) {
+            if (!geodb["shm_name"].IsString()) {
+                throw ConfigException("geodb.shm_name must be a string");
+            }
+            shmName_ = geodb["shm_name"].GetString();
+            if (!shmName_.empty() && (shmName_[0] != '/' || shmName_.find('/', 1) != std::string::npos)) {
+                throw ConfigException("geodb.shm_name must start with / and contain no other /");
+            }
+        }
+        if (geodb.HasMember("numa_replicas")) {
+            if (!geodb["numa_replicas"].IsBool()) {
+                throw ConfigException("geodb.numa_replicas must be a boolean");
+            }
+            numaReplicas_ = geodb["numa_replicas"].GetBool();
+        }
+        if (geodb.HasMember("huge_pages")) {
+            if (!geodb["huge_pages"].IsString()) {
+                throw ConfigException("geodb.huge_pages must be a string");
+            }
+            std::string hugePages = geodb["huge_pages"].GetString();
+            if (hugePages == "none") {
+                hugePages_ = HugePages::NONE;
+            } else if (hugePages == "transparent") {
+                hugePages_ = HugePages::TRANSPARENT;
+            } else if (hugePages == "explicit") {
+                hugePages_ = HugePages::EXPLICIT;
+            } else {
+                throw ConfigException("geodb.huge_pages must be none, transparent or explicit");
+            }
+        }
+        if (geodb.HasMember("prefault")) {
+            if (!geodb["prefault"].IsBool()) {
+                throw ConfigException("geodb.prefault must be a boolean");
+            }
+            prefault_ = geodb["prefault"].GetBool();
+        }
+        if (geodb.HasMember("mlock")) {
+            if (!geodb["mlock"].IsBool()) {
+                throw ConfigException("geodb.mlock must be a boolean");
+            }
+            mlock_ = geodb["mlock"].GetBool();
+        }
+        if (geodb.HasMember("async_init")) {
+            if (!geodb["async_init"].IsBool()) {
+                throw ConfigException("geodb.async_init must be a boolean");
+            }
+            asyncInit_ = geodb["async_init"].GetBool();
+        }
+        if (geodb.HasMember("fallback_file")) {
+            if (!geodb["fallback_file"].IsString()) {
+                throw ConfigException("geodb.fallback_file must be a string");
+            }
+            fallbackFile_ = geodb["fallback_file"].GetString();
+        }
+        if (geodb.HasMember("shadow")) {
+            if (!geodb["shadow"].IsString()) {
+                throw ConfigException("geodb.shadow must be a string");
+            }
+            std::string shadow = geodb["shadow"].GetString();
+            if (shadow == "none") {
+                shadowMode_ = ShadowMode::NONE;
+            } else if (shadow == "reference") {
+                shadowMode_ = ShadowMode::REFERENCE;
+            } else if (shadow == "previous") {
+                shadowMode_ = ShadowMode::PREVIOUS;
+            } else {
+                throw ConfigException("geodb.shadow must be none, reference or previous");
+            }
+        }
+        if (geodb.HasMember("shadow_sample_rate")) {
+            if (!geodb["shadow_sample_rate"].IsDouble()) {
+                throw ConfigException("geodb.shadow_sample_rate must be a double");
+            }
+            shadowSampleRate_ = geodb["shadow_sample_rate"].GetDouble();
+            if (shadowSampleRate_ <= 0.0 || shadowSampleRate_ > 1.0) {
+                throw ConfigException("geodb.shadow_sample_rate must be in (0, 1]");
+            }
+        }
         if (geodb.HasMember("dont_load")) {
             if (!geodb["dont_load"].IsBool()) {
                 throw ConfigException("geodb.dont_load must be a boolean");
@@ -181,99 +1049,680 @@ GeoDb::initConfig(const rapidjson::Document& config)
 }
 
 std::shared_ptr<GeoDb::Db>
-GeoDb::loadDb() const
+GeoDb::loadDb()
 {
     auto begin = Utils::nowMicros();
-    FileUtils::Mmap mmap(geodbFile_);
-    if (mmap.open() != FileUtils::Mmap::ReturnCode::SUCCESS) {
-        logError("can't mmap file %s", geodbFile_.c_str());
-        throw GeoDbException("can't mmap file");
+    if (format_ == Format::MMDB) {
+        auto db = std::make_shared<Db>();
+        db->loadMmdb(geodbFile_);
+        logInfo("geodb mmdb opened in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
+        return db;
     }
-    const char *p = mmap.ptr();
-    if (!p) {
-        logError("file %s is empty", geodbFile_.c_str());
-        throw GeoDbException("geodb file is empty");
+    if (shm_) {
+        return loadSharedDb();
     }
+    auto db = buildDb(geodbFile_);
+    logInfo("geodb loaded in %f sec, ipv4 ranges: %zu, ipv6 ranges: %zu /64 aligned, %zu longer, %zu bytes",
+        (double) (Utils::nowMicros() - begin) / 1000000.0, db->ipv4Size(), db->ipv6HiSize(), db->ipv6LongSize(), db->ipv6Memory());
+    return db;
+}
+
+std::shared_ptr<GeoDb::Db>
+GeoDb::buildDb(const std::string& file) const
+{
+    Db::Source source{file, 0, 0};
+    statFile(file, source.modified, source.size);
     protobuf::Geo geo;
-    if (!geo.ParseFromArray(p, static_cast<int>(mmap.size()))) {
-        logError("can't parse geodb file %s", geodbFile_.c_str());
-        throw GeoDbException("can't parse geodb file");
-    }
+    readGeo(file, geo);
     /**/
-    auto db = std::make_shared<Db>();
+    Db::Options options;
+    options.ipv6Compressed = ipv6Compressed_;
+    options.reverseIndex = reverseIndex_;
+    options.attributes = attributes_;
+    options.spatialIndex = spatialIndex_;
+    auto db = std::make_shared<Db>(options);
+    db->setSource(std::move(source));
+    if (attributes_) {
+        static const std::string none;
+        for (int i = 0; i < geo.attributes_size(); i++) {
+            const auto& a = geo.attributes(i);
+            uint32_t postalCode = a.postal_code();
+            db->addAttributes(a.latitude(), a.longitude(), a.accuracy_radius(),
+                postalCode && static_cast<int>(postalCode) <= geo.postal_codes_size() ? geo.postal_codes(static_cast<int>(postalCode - 1)) : none,
+                a.flags());
+        }
+    }
+    if (spatialIndex_) {
+        for (int i = 0; i < geo.city_locations_size(); i++) {
+            const auto& c = geo.city_locations(i);
+            db->addCity(c.city_id(), c.latitude() / coordinateScale, c.longitude() / coordinateScale,
+                std::vector<uint32_t>(c.neighbors().begin(), c.neighbors().end()));
+        }
+    }
+    auto attributes = [&geo](uint32_t id) {
+        return static_cast<int>(id) <= geo.attributes_size() ? id : 0;
+    };
+    static const protobuf::Geo::Asn noAsn;
+    auto asn = [&geo](uint32_t id) -> const protobuf::Geo::Asn& {
+        return id && static_cast<int>(id) <= geo.asns_size() ? geo.asns(static_cast<int>(id - 1)) : noAsn;
+    };
     for (int i = 0; i < geo.ipsv4_size(); i++) {
         const auto& e = geo.ipsv4(i);
-        db->addRange(e.from(), e.to(), e.country_id(), e.state_id(), e.city_id(), e.country_key(), e.state_key(), e.city_name());
+        const auto& a = asn(e.asn());
+        db->addRange(e.from(), e.to(), e.country_id(), e.state_id(), e.city_id(), e.country_key(), e.state_key(), e.city_name(),
+            attributes(e.attributes()), a.number(), a.organization());
     }
     for (int i = 0; i < geo.ipsv6_size(); i++) {
         const auto& e = geo.ipsv6(i);
+        const auto& a = asn(e.asn());
         IPv6 from(e.from_hi(), e.from_lo());
         IPv6 to(e.to_hi(), e.to_lo());
-        db->addRange(from, to, e.country_id(), e.state_id(), e.city_id(), e.country_key(), e.state_key(), e.city_name());
+        db->addRange(from, to, e.country_id(), e.state_id(), e.city_id(), e.country_key(), e.state_key(), e.city_name(),
+            attributes(e.attributes()), a.number(), a.organization());
     }
-    logInfo("geodb loaded in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
+    db->build();
     return db;
 }
 
-namespace {
+std::shared_ptr<GeoDb::Db>
+GeoDb::loadSharedDb()
+{
+    auto begin = Utils::nowMicros();
+    struct stat st{};
+    if (stat(geodbFile_.c_str(), &st) != 0) {
+        logError("can't stat file %s, error: %s (%d)", geodbFile_.c_str(), strerror(errno), errno);
+        throw GeoDbException("can't stat geodb file");
+    }
+    auto modified = static_cast<int64_t>(st.st_mtime);
+    auto size = static_cast<uint64_t>(st.st_size);
+    /*  only the first process to get here builds the image for this file  */
+    std::lock_guard<GeoShm> guard(*shm_);
+    /*  a private copy served when publishing fails is not rebuilt till a newer generation shows up  */
+    shmGeneration_ = shm_->generation();
+    auto image = shm_->current();
+    bool built = false;
+    if (!image || image->header().sourceModified != modified || image->header().sourceSize != size) {
+        auto db = buildDb(geodbFile_);
+        GeoImageWriter writer;
+        db->save(writer);
+        image = shm_->publish(writer, modified, size);
+        shmGeneration_ = shm_->generation();
+        if (!image) {
+            logError("can't share geodb through %s, serving a private copy", shmName_.c_str());
+            return db;
+        }
+        built = true;
+    }
+    auto db = std::make_shared<Db>();
+    if (!db->attach(image)) {
+        logError("geodb image in %s misses sections", shmName_.c_str());
+        throw GeoDbException("bad geodb image");
+    }
+    db->setSource({geodbFile_, modified, size});
+    logInfo("geodb image generation %llu %s in %f sec, ipv4 ranges: %zu, ipv6 ranges: %zu /64 aligned, %zu longer, %zu bytes",
+        (unsigned long long) db->generation(), built ? "built" : "mapped", (double) (Utils::nowMicros() - begin) / 1000000.0,
+        db->ipv4Size(), db->ipv6HiSize(), db->ipv6LongSize(), db->memory());
+    return db;
+}
 
-std::chrono::time_point<std::chrono::system_clock>
-timeToChrono(uint64_t tm)
+static_assert(static_cast<int>(GeoStats::c_ipv6) == GeoDb::r_ipv6 && static_cast<int>(GeoStats::c_invalid) == GeoDb::r_count,
+    "lookup counters must follow routes");
+
+void
+GeoDb::recordReload(uint64_t begin)
 {
-    auto sec = static_cast<time_t>(tm / 1000000);
-    auto usec = tm - sec * 1000000;
-    return std::chrono::system_clock::from_time_t(sec)
-        + std::chrono::microseconds(usec);
+    auto now = Utils::nowMicros();
+    const Db& db = snapshot_->db();
+    std::lock_guard<std::mutex> guard(statsLock_);
+    reloadStats_.reloads++;
+    reloadStats_.lastReloadSeconds = (double) (now - begin) / 1000000.0;
+    reloadStats_.lastReloadTime = now;
+    reloadStats_.fileModified = static_cast<int64_t>(FileUtils::lastModified(geodbFile_));
+    reloadStats_.generation = db.generation();
+    reloadStats_.ipv4Ranges = db.ipv4Size();
+    reloadStats_.ipv6Ranges = db.ipv6HiSize() + db.ipv6LongSize();
+    reloadStats_.memory = snapshot_->memory();
+    reloadStats_.previousMemory = prevSnapshot_ ? prevSnapshot_->memory() : 0;
+}
+
+GeoDb::Stats
+GeoDb::Handle::stats() const
+{
+    Stats stats;
+    {
+        std::lock_guard<std::mutex> guard(geodb_->statsLock_);
+        stats = geodb_->reloadStats_;
+    }
+    stats.lookups = geodb_->stats_.totals();
+    stats.ready = geodb_->ready_.load();
+    if (geodb_->shadow_) {
+        geodb_->shadow_->counters(stats);
+    }
+    return stats;
+}
+
+std::string
+GeoDb::Handle::statsPrometheus() const
+{
+    static const char *counters[GeoStats::c_count] = {
+        "route=\"ipv4\"", "route=\"ipv4_mapped\"", "route=\"6to4\"", "route=\"teredo\"", "route=\"ipv6\"",
+        nullptr, nullptr
+    };
+    static const char *histograms[GeoStats::h_count] = {"ipv4", "ipv6"};
+    Stats stats = this->stats();
+    std::string out;
+    char buf[256];
+    auto append = [&out, &buf](const char *format, auto... args) {
+        snprintf(buf, sizeof(buf), format, args...);
+        out += buf;
+    };
+    out += "# HELP geodb_lookups_total Lookups by route.\n# TYPE geodb_lookups_total counter\n";
+    for (int c = 0; c < GeoStats::c_count; c++) {
+        if (counters[c]) {
+            append("geodb_lookups_total{%s} %llu\n", counters[c], (unsigned long long) stats.lookups.counters[c]);
+        }
+    }
+    out += "# HELP geodb_invalid_total Lookups of strings that are no ip address.\n# TYPE geodb_invalid_total counter\n";
+    append("geodb_invalid_total %llu\n", (unsigned long long) stats.lookups.counters[GeoStats::c_invalid]);
+    out += "# HELP geodb_misses_total Lookups found nothing.\n# TYPE geodb_misses_total counter\n";
+    append("geodb_misses_total %llu\n", (unsigned long long) stats.lookups.counters[GeoStats::c_miss]);
+    out += "# HELP geodb_lookup_seconds Sampled lookup latency.\n# TYPE geodb_lookup_seconds histogram\n";
+    for (int h = 0; h < GeoStats::h_count; h++) {
+        uint64_t count = 0;
+        for (size_t b = 0; b < GeoStats::buckets; b++) {
+            count += stats.lookups.histograms[h][b];
+            append("geodb_lookup_seconds_bucket{family=\"%s\",le=\"%g\"} %llu\n", histograms[h],
+                (double) (2ULL << b) / 1e9, (unsigned long long) count);
+        }
+        append("geodb_lookup_seconds_bucket{family=\"%s\",le=\"+Inf\"} %llu\n", histograms[h], (unsigned long long) count);
+        append("geodb_lookup_seconds_sum{family=\"%s\"} %g\n", histograms[h], (double) stats.lookups.sums[h] / 1e9);
+        append("geodb_lookup_seconds_count{family=\"%s\"} %llu\n", histograms[h], (unsigned long long) count);
+    }
+    out += "# HELP geodb_ready Whether the db is loaded.\n# TYPE geodb_ready gauge\n";
+    append("geodb_ready %d\n", stats.ready ? 1 : 0);
+    out += "# HELP geodb_reloads_total Db loads.\n# TYPE geodb_reloads_total counter\n";
+    append("geodb_reloads_total %llu\n", (unsigned long long) stats.reloads);
+    out += "# HELP geodb_last_reload_duration_seconds Duration of the last load.\n# TYPE geodb_last_reload_duration_seconds gauge\n";
+    append("geodb_last_reload_duration_seconds %f\n", stats.lastReloadSeconds);
+    out += "# HELP geodb_last_reload_timestamp_seconds Time of the last load.\n# TYPE geodb_last_reload_timestamp_seconds gauge\n";
+    append("geodb_last_reload_timestamp_seconds %f\n", (double) stats.lastReloadTime / 1000000.0);
+    out += "# HELP geodb_file_modified_timestamp_seconds Modification time of the loaded geodb file.\n"
+        "# TYPE geodb_file_modified_timestamp_seconds gauge\n";
+    append("geodb_file_modified_timestamp_seconds %lld\n", (long long) stats.fileModified);
+    out += "# HELP geodb_generation Shared image generation, 0 when private.\n# TYPE geodb_generation gauge\n";
+    append("geodb_generation %llu\n", (unsigned long long) stats.generation);
+    out += "# HELP geodb_ranges Ranges in the current snapshot.\n# TYPE geodb_ranges gauge\n";
+    append("geodb_ranges{family=\"ipv4\"} %zu\n", stats.ipv4Ranges);
+    append("geodb_ranges{family=\"ipv6\"} %zu\n", stats.ipv6Ranges);
+    out += "# HELP geodb_memory_bytes Index memory of the current snapshot and of the previous one kept for shadow checks.\n# TYPE geodb_memory_bytes gauge\n";
+    append("geodb_memory_bytes{snapshot=\"current\"} %zu\n", stats.memory);
+    append("geodb_memory_bytes{snapshot=\"previous\"} %zu\n", stats.previousMemory);
+    out += "# HELP geodb_shadow_checks_total Sampled lookups checked by shadow verification.\n# TYPE geodb_shadow_checks_total counter\n";
+    append("geodb_shadow_checks_total{result=\"match\"} %llu\n", (unsigned long long) (stats.shadowChecked - stats.shadowDivergences));
+    append("geodb_shadow_checks_total{result=\"divergence\"} %llu\n", (unsigned long long) stats.shadowDivergences);
+    append("geodb_shadow_checks_total{result=\"skipped\"} %llu\n", (unsigned long long) stats.shadowSkipped);
+    append("geodb_shadow_checks_total{result=\"dropped\"} %llu\n", (unsigned long long) stats.shadowDropped);
+    return out;
 }
 
+int
+GeoDb::localNode()
+{
+    thread_local int node = 0;
+    thread_local unsigned int calls = 0;
+    if ((calls++ & 1023) == 0) {
+        int cpu = sched_getcpu();
+        node = cpu >= 0 ? std::max(numa_node_of_cpu(cpu), 0) : 0;
+    }
+    return node;
+}
+
+std::shared_ptr<const GeoImage>
+GeoDb::placeImage(const GeoImageWriter& writer, uint64_t generation, int node) const
+{
+    size_t size = writer.size();
+    size_t mapSize = size;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (hugePages_ != HugePages::NONE) {
+        mapSize = (size + hugePageSize_ - 1) & ~(hugePageSize_ - 1);
+    }
+    void *p = MAP_FAILED;
+    if (hugePages_ == HugePages::EXPLICIT) {
+        p = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | hugeTlb2Mb_, -1, 0);
+        if (p == MAP_FAILED) {
+            logError("can't map %zu bytes of explicit huge pages, error: %s (%d), using transparent ones",
+                mapSize, strerror(errno), errno);
+        }
+    }
+    if (p == MAP_FAILED) {
+        p = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p == MAP_FAILED) {
+            logError("can't map %zu bytes, error: %s (%d)", mapSize, strerror(errno), errno);
+            throw GeoDbException("can't map geodb image");
+        }
+        if (hugePages_ != HugePages::NONE && madvise(p, mapSize, MADV_HUGEPAGE) != 0) {
+            logError("can't use transparent huge pages, error: %s (%d)", strerror(errno), errno);
+        }
+    }
+    /*  bind before the first touch  */
+    if (node >= 0) {
+        numa_tonode_memory(p, mapSize, node);
+    }
+    /*  writing it faults every page in before the snapshot is published  */
+    writer.write(static_cast<char *>(p), generation, 0, 0);
+    if (mprotect(p, mapSize, PROT_READ) != 0) {
+        logError("can't make %zu bytes read-only, error: %s (%d)", mapSize, strerror(errno), errno);
+    }
+    if (mlock_ && mlock(p, mapSize) != 0) {
+        logError("can't mlock %zu bytes, error: %s (%d)", mapSize, strerror(errno), errno);
+    }
+    return std::make_shared<const GeoImage>(static_cast<const char *>(p), size, [p, mapSize] {
+        munmap(p, mapSize);
+    });
+}
+
+std::shared_ptr<GeoDb::Snapshot>
+GeoDb::makeSnapshot(std::shared_ptr<Db> db) const
+{
+    auto snapshot = std::make_shared<Snapshot>();
+    bool numa = numaReplicas_ && numa_available() >= 0 && numa_max_node() > 0;
+    /*  shared images are mapped with these options already  */
+    bool place = numa || (!db->attached() && (hugePages_ != HugePages::NONE || mlock_));
+    if (format_ != Format::PROTOBUF || !place) {
+        snapshot->replicas.push_back(std::move(db));
+        return snapshot;
+    }
+    auto begin = Utils::nowMicros();
+    /*  the image is position independent, a plain copy serves as is  */
+    GeoImageWriter writer;
+    db->save(writer);
+    int nodes = numa ? numa_max_node() + 1 : 1;
+    for (int node = 0; node < nodes; node++) {
+        if (numa && !numa_bitmask_isbitset(numa_all_nodes_ptr, static_cast<unsigned int>(node))) {
+            snapshot->replicas.push_back(snapshot->replicas.empty() ? db : snapshot->replicas[0]);
+            continue;
+        }
+        auto replica = std::make_shared<Db>();
+        if (!replica->attach(placeImage(writer, db->generation(), numa ? node : -1))) {
+            throw GeoDbException("bad geodb image");
+        }
+        /*  the shadow reference reads back the file the copy came from  */
+        replica->setSource(db->source());
+        snapshot->replicas.push_back(std::move(replica));
+    }
+    logInfo("geodb placed in %f sec, %d copies of %zu bytes", (double) (Utils::nowMicros() - begin) / 1000000.0,
+        nodes, writer.size());
+    return snapshot;
 }
 
 void
-GeoDb::watcherThreadLoop()
-{
-    enum {
-        s_none,
-        s_started
-    } state;
-    state = s_none;
-    time_t dbLastModified = FileUtils::lastModified(geodbFile_);
-    auto nextCheck = Utils::nowMicros() + static_cast<uint64_t>(defaultCheckForUpdateTimeout_ * 1000000.0);
-    /**/
-    for (;;) {
-        std::unique_lock<std::mutex> lock(watcherLock_);
-        while (!doShutdown_.load() && Utils::nowMicros() < nextCheck) {
-            watcherCond_.wait_until(lock, timeToChrono(nextCheck));
-        }
-        if (doShutdown_) {
-            break;
-        }
-        switch (state) {
-            case s_none:
-                {
-                    time_t modified = FileUtils::lastModified(geodbFile_);
-                    if (modified > dbLastModified) {
-                        state = s_started;
-                        dbLastModified = modified;
-                    }
-                }
-                break;
-            case s_started:
-                {
-                    time_t modified = FileUtils::lastModified(geodbFile_);
-                    if (modified == dbLastModified) {
-                        auto db = loadDb();
-                        if (db != nullptr) {
-                            db_ = db;
-                        }
-                        state = s_none;
-                    }
-                    dbLastModified = modified;
-                }
-                break;
+GeoDb::setDb(std::shared_ptr<Db> db)
+{
+    auto snapshot = makeSnapshot(std::move(db));
+    std::lock_guard<std::mutex> guard(snapshotLock_);
+    snapshot->seq = ++snapshotSeq_;
+    auto previous = std::move(snapshot_);
+    snapshot_ = std::move(snapshot);
+    current_.store(snapshot_.get(), std::memory_order_release);
+    if (!previous) {
+        return;
+    }
+    /*  only previous mode shadow checks keep it, else it goes with its grace period  */
+    if (shadowMode_ == ShadowMode::PREVIOUS) {
+        prevSnapshot_ = previous;
+    }
+    /*  lookups hold no reference, running ones may still read the one switched out  */
+    retired_.push_back({std::move(previous), epochs_.advance(), Utils::nowMicros()});
+}
+
+void
+GeoDb::reclaim()
+{
+    if (retired_.empty()) {
+        return;
+    }
+    auto grace = static_cast<uint64_t>(checkForUpdateTimeout_ * 1000000.0);
+    auto now = Utils::nowMicros();
+    /*  retired in epoch order, the last one due decides for all before it  */
+    size_t due = 0;
+    while (due < retired_.size() && retired_[due].time + grace <= now) {
+        due++;
+    }
+    if (due == 0 || !epochs_.quiescent(retired_[due - 1].epoch)) {
+        return;
+    }
+    retired_.erase(retired_.begin(), retired_.begin() + static_cast<std::ptrdiff_t>(due));
+}
+
+GeoDb::Db::StringRef
+GeoDb::Db::intern(const std::string& s)
+{
+    auto it = stringRefs_.find(s);
+    if (it != stringRefs_.end()) {
+        return it->second;
+    }
+    StringRef ref{static_cast<uint32_t>(stagedStrings_.size()), static_cast<uint32_t>(s.size())};
+    stagedStrings_.insert(stagedStrings_.end(), s.begin(), s.end());
+    stagedStrings_.push_back('\0');
+    stringRefs_.emplace(s, ref);
+    return ref;
+}
+
+uint32_t
+GeoDb::Db::elementId(unsigned int countryId, unsigned int stateId, unsigned int cityId,
+        const std::string& countryKey, const std::string& stateKey, const std::string& cityName,
+        unsigned int asn, const std::string& asnOrg)
+{
+    PackedElement el{countryId, stateId, cityId, asn, intern(countryKey), intern(stateKey), intern(cityName), intern(asnOrg)};
+    /*  strings are interned, their offsets identify them  */
+    std::string key(reinterpret_cast<const char *>(&el), sizeof(el));
+    auto it = elementIds_.find(key);
+    if (it != elementIds_.end()) {
+        return it->second;
+    }
+    auto id = static_cast<uint32_t>(stagedElements_.size());
+    stagedElements_.push_back(el);
+    elementIds_.emplace(std::move(key), id);
+    return id;
+}
+
+void
+GeoDb::Db::build()
+{
+    ipv4_.build();
+    ipv6Hi_.build();
+    ipv6HiPacked_.build();
+    ipv6_.build();
+    flags_ = 0;
+    if (ipv6Compressed_) {
+        flags_ |= f_ipv6_compressed;
+    }
+    if (reverseIndex_) {
+        flags_ |= f_reverse_index;
+    }
+    if (attributes_) {
+        flags_ |= f_attributes;
+        buildAttributes();
+    }
+    if (spatialIndex_) {
+        flags_ |= f_spatial_index;
+        spatial_.build();
+    }
+    elements_.assign(std::move(stagedElements_));
+    strings_.assign(std::move(stagedStrings_));
+    elementIds_.clear();
+    stringRefs_.clear();
+    if (reverseIndex_) {
+        buildReverse();
+    }
+}
+
+void
+GeoDb::Db::stageNoAttributes()
+{
+    /*  attributes id 0  */
+    stagedPostalDictionary_.push_back(intern(""));
+    postalCodeIds_.emplace("", 0);
+    stagedLatitudes_.push_back(0);
+    stagedLongitudes_.push_back(0);
+    stagedAccuracyRadiuses_.push_back(0);
+    stagedPostalCodes_.push_back(0);
+    stagedAttributeFlags_.push_back(0);
+}
+
+void
+GeoDb::Db::addAttributes(int32_t latitude, int32_t longitude, unsigned int accuracyRadius, const std::string& postalCode,
+        unsigned int flags)
+{
+    if (!attributes_) {
+        return;
+    }
+    if (stagedLatitudes_.empty()) {
+        stageNoAttributes();
+    }
+    auto it = postalCodeIds_.find(postalCode);
+    if (it == postalCodeIds_.end()) {
+        it = postalCodeIds_.emplace(postalCode, static_cast<uint32_t>(stagedPostalDictionary_.size())).first;
+        stagedPostalDictionary_.push_back(intern(postalCode));
+    }
+    stagedLatitudes_.push_back(latitude);
+    stagedLongitudes_.push_back(longitude);
+    stagedAccuracyRadiuses_.push_back(static_cast<uint16_t>(std::min(accuracyRadius, 0xffffu)));
+    stagedPostalCodes_.push_back(it->second);
+    stagedAttributeFlags_.push_back(static_cast<uint8_t>(flags));
+}
+
+void
+GeoDb::Db::buildAttributes()
+{
+    if (stagedLatitudes_.empty()) {
+        stageNoAttributes();
+    }
+    /*  slots are known once indexes are built, the last range added wins like in the index  */
+    std::vector<uint32_t> slots[p_count];
+    for (int part = 0; part < p_count; part++) {
+        slots[part].resize(this->slots(static_cast<Part>(part)));
+    }
+    for (const auto& a : stagedSlotAttributes_) {
+        size_t i = noSlot;
+        if (a.part == p_ipv4) {
+            i = ipv4_.findSlot(static_cast<IPv4>(a.to));
+        } else if (a.part == p_ipv6) {
+            i = ipv6_.findSlot(a.to);
+        } else {
+            auto to = static_cast<uint64_t>(a.to);
+            i = ipv6Compressed_ ? ipv6HiPacked_.findSlot(to) : ipv6Hi_.findSlot(to);
         }
-        while (nextCheck < Utils::nowMicros()) {
-            nextCheck += static_cast<uint64_t>(defaultCheckForUpdateTimeout_ * 1000000.0);
+        if (i != noSlot && a.id < stagedLatitudes_.size()) {
+            slots[a.part][i] = a.id;
         }
     }
+    for (int part = 0; part < p_count; part++) {
+        slotAttributes_[part].assign(std::move(slots[part]));
+    }
+    latitudes_.assign(std::move(stagedLatitudes_));
+    longitudes_.assign(std::move(stagedLongitudes_));
+    accuracyRadiuses_.assign(std::move(stagedAccuracyRadiuses_));
+    postalCodes_.assign(std::move(stagedPostalCodes_));
+    attributeFlags_.assign(std::move(stagedAttributeFlags_));
+    postalDictionary_.assign(std::move(stagedPostalDictionary_));
+    std::vector<StagedAttributes>().swap(stagedSlotAttributes_);
+    postalCodeIds_.clear();
+}
+
+void
+GeoDb::Db::buildReverse()
+{
+    forEachRange([this](bool ipv6, IPv6Key from, IPv6Key to, uint32_t el) {
+        const auto& e = elements_[el];
+        auto family = ipv6 ? GeoReverseIndex::f_ipv6 : GeoReverseIndex::f_ipv4;
+        reverse_.add(GeoReverseIndex::l_country, e.countryId, family, from, to);
+        reverse_.add(GeoReverseIndex::l_state, e.stateId, family, from, to);
+        reverse_.add(GeoReverseIndex::l_city, e.cityId, family, from, to);
+    });
+    reverse_.build();
 }
 
+void
+GeoDb::Db::save(GeoImageWriter& writer) const
+{
+    writer.add(s_flags, &flags_, sizeof(flags_));
+    writer.add(s_elements, elements_);
+    writer.add(s_strings, strings_);
+    ipv4_.save(writer, s_ipv4);
+    if (ipv6Compressed_) {
+        ipv6HiPacked_.save(writer, s_ipv6_hi);
+    } else {
+        ipv6Hi_.save(writer, s_ipv6_hi);
+    }
+    ipv6_.save(writer, s_ipv6);
+    if (reverseIndex_) {
+        reverse_.save(writer, s_reverse);
+    }
+    if (attributes_) {
+        for (uint32_t part = 0; part < p_count; part++) {
+            writer.add(s_attributes + part, slotAttributes_[part]);
+        }
+        writer.add(s_attributes + 0x10, latitudes_);
+        writer.add(s_attributes + 0x11, longitudes_);
+        writer.add(s_attributes + 0x12, accuracyRadiuses_);
+        writer.add(s_attributes + 0x13, postalCodes_);
+        writer.add(s_attributes + 0x14, attributeFlags_);
+        writer.add(s_attributes + 0x15, postalDictionary_);
+    }
+    if (spatialIndex_) {
+        spatial_.save(writer, s_spatial);
+    }
+}
+
+bool
+GeoDb::Db::attach(std::shared_ptr<const GeoImage> image)
+{
+    GeoArray<uint32_t> flags;
+    if (!image->attach(s_flags, flags) || flags.size() != 1) {
+        return false;
+    }
+    flags_ = flags[0];
+    ipv6Compressed_ = (flags_ & f_ipv6_compressed) != 0;
+    reverseIndex_ = (flags_ & f_reverse_index) != 0;
+    attributes_ = (flags_ & f_attributes) != 0;
+    spatialIndex_ = (flags_ & f_spatial_index) != 0;
+    if (!image->attach(s_elements, elements_) || !image->attach(s_strings, strings_)
+            || !ipv4_.attach(*image, s_ipv4) || !ipv6_.attach(*image, s_ipv6)) {
+        return false;
+    }
+    if (!(ipv6Compressed_ ? ipv6HiPacked_.attach(*image, s_ipv6_hi) : ipv6Hi_.attach(*image, s_ipv6_hi))) {
+        return false;
+    }
+    if (reverseIndex_ && !reverse_.attach(*image, s_reverse)) {
+        return false;
+    }
+    if (attributes_) {
+        for (uint32_t part = 0; part < p_count; part++) {
+            if (!image->attach(s_attributes + part, slotAttributes_[part])) {
+                return false;
+            }
+        }
+        if (!image->attach(s_attributes + 0x10, latitudes_) || !image->attach(s_attributes + 0x11, longitudes_)
+                || !image->attach(s_attributes + 0x12, accuracyRadiuses_) || !image->attach(s_attributes + 0x13, postalCodes_)
+                || !image->attach(s_attributes + 0x14, attributeFlags_) || !image->attach(s_attributes + 0x15, postalDictionary_)) {
+            return false;
+        }
+    }
+    if (spatialIndex_ && !spatial_.attach(*image, s_spatial)) {
+        return false;
+    }
+    image_ = std::move(image);
+    return true;
+}
+
+void
+GeoDb::Db::loadMmdb(const std::string& file)
+{
+    mmdb_ = std::make_shared<GeoMmdb>(file);
+}
+
+GeoDb::Element
+GeoDb::Db::findMmdb(IPv4 ip) const
+{
+    return mmdb_->find(ip);
+}
+
+GeoDb::Element
+GeoDb::Db::findMmdb(IPv6 ip) const
+{
+    return mmdb_->find(ip);
+}
+
+void
+GeoDb::initialLoad()
+{
+    auto begin = Utils::nowMicros();
+    try {
+        auto db = loadDb();
+        if (!db) {
+            throw GeoDbException("can't load db");
+        }
+        setDb(db);
+        recordReload(begin);
+    } catch (const std::exception& e) {
+        /*  keep serving the fallback, a later file update may still load  */
+        logError("async geodb load failed: %s", e.what());
+        readyPromise_.set_exception(std::current_exception());
+        return;
+    }
+    markReady();
+    logInfo("geodb ready in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
+}
+
+void
+GeoDb::markReady()
+{
+    if (ready_.load(std::memory_order_acquire)) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(readyLock_);
+    if (readyFuture_.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        /*  the failed init keeps its exception for those who waited on it  */
+        std::promise<void> loaded;
+        loaded.set_value();
+        readyFuture_ = loaded.get_future().share();
+    } else {
+        readyPromise_.set_value();
+    }
+    ready_.store(true, std::memory_order_release);
+}
+
+uint64_t
+GeoDb::checkForUpdate(uint64_t scheduled)
+{
+    auto timeout = static_cast<uint64_t>(checkForUpdateTimeout_ * 1000000.0);
+    if (watchState_ == w_initial) {
+        if (!ready_.load()) {
+            initialLoad();
+        }
+        dbLastModified_ = FileUtils::lastModified(geodbFile_);
+        watchState_ = w_none;
+        return Utils::nowMicros() + timeout;
+    }
+    /*  another process published a newer image  */
+    bool reload = shm_ && snapshot_ && watchState_ == w_none && shm_->generation() != shmGeneration_;
+    time_t modified = FileUtils::lastModified(geodbFile_);
+    if (watchState_ == w_none) {
+        if (modified > dbLastModified_) {
+            watchState_ = w_started;
+            dbLastModified_ = modified;
+        }
+    } else {
+        if (modified == dbLastModified_) {
+            reload = true;
+            watchState_ = w_none;
+        }
+        dbLastModified_ = modified;
+    }
+    /*  one switch per pass at most, an image already served is not switched to again  */
+    if (reload) {
+        auto begin = Utils::nowMicros();
+        try {
+            auto db = loadDb();
+            if (db != nullptr) {
+                bool served = db->generation() && snapshot_ && db->generation() == snapshot_->db().generation();
+                if (!served) {
+                    setDb(db);
+                    recordReload(begin);
+                }
+                markReady();
+            }
+        } catch (const std::exception& e) {
+            /*  the watcher thread serves every instance, this one keeps its current snapshot  */
+            logError("geodb reload of %s failed: %s", geodbFile_.c_str(), e.what());
+        }
+    }
+    reclaim();
+    /*  keep the cadence  */
+    auto now = Utils::nowMicros();
+    while (scheduled <= now) {
+        scheduled += timeout;
+    }
+    return scheduled;
+}
@@ -2,20 +2,33 @@
 
 #include <arpa/inet.h>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <future>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <unordered_map>
 #include <set>
 #include <unordered_set>
 #include <thread>
+#include <vector>
 
 #include "rapidjson/document.h"
 #include "rapidjson/internal/dtoa.h"
 #include "cstring.h"
+#include "geo_epoch.h"
+#include "geo_image.h"
+#include "geo_range_index.h"
+#include "geo_reverse_index.h"
+#include "geo_spatial_index.h"
+#include "geo_stats.h"
 
 namespace ggAdNet {
 
+class GeoMmdb;
+class GeoShm;
+
 class GeoDbException: public std::runtime_error
 {
 public:
@@ -68,11 +81,17 @@ public:
         CString countryKey;
         CString stateKey;
         CString cityName;
+        unsigned int asn;           // autonomous system number, 0 if unknown
+        CString asnOrg;
 
-        Element() : countryId(0), stateId(0), cityId(0) {}
+        Element() : countryId(0), stateId(0), cityId(0), asn(0) {}
 
         Element(unsigned int countryId, unsigned int stateId, unsigned int cityId, const std::string& countryKey, const std::string& stateKey, const std::string& cityName)
-            : countryId(countryId), stateId(stateId), cityId(cityId), countryKey(countryKey), stateKey(stateKey), cityName(cityName) {}
+            : countryId(countryId), stateId(stateId), cityId(cityId), countryKey(countryKey), stateKey(stateKey), cityName(cityName), asn(0) {}
+
+        Element(unsigned int countryId, unsigned int stateId, unsigned int cityId, const std::string& countryKey, const std::string& stateKey, const std::string& cityName,
+                unsigned int asn, const std::string& asnOrg)
+            : countryId(countryId), stateId(stateId), cityId(cityId), countryKey(countryKey), stateKey(stateKey), cityName(cityName), asn(asn), asnOrg(asnOrg) {}
 
         void clear() {
             countryId = 0;
@@ -81,12 +100,28 @@ public:
             countryKey.clear();
             stateKey.clear();
             cityName.clear();
+            asn = 0;
+            asnOrg.clear();
         }
     };
 
+    class Handle;
+
+    /*  the process wide instance the static api below forwards to  */
     static void init(const rapidjson::Document& config);
     static void stop();
 
+    /*  one more instance with its own config, file, snapshots and stats, e.g. to compare
+        data versions, all instances share one watcher thread; closed with the last reference  */
+    static std::shared_ptr<Handle> open(const rapidjson::Document& config);
+
+    /*  false while an async init is loading, lookups get the fallback db or empty elements till then  */
+    static bool isReady();
+
+    /*  completes once the initial load is done, holds its exception if it failed; once a later
+        reload succeeds a completed one is returned, as isReady() turns true  */
+    static std::shared_future<void> whenReady();
+
     static bool checkIpv4(const char *p) {
         struct in_addr in{};
         return inet_pton(AF_INET, p, &in) == 1;
@@ -143,154 +178,641 @@ public:
     static void net4ToRange(const std::string& net, IPv4& from, IPv4& to);
     static void net6ToRange(const std::string& net, IPv6& from, IPv6& to);
 
-    static Element getIpv4(IPv4 ip) {
-        assert(instance_ != nullptr);
-        return instance_->db_ ? instance_->db_->find(ip) : instance_->empty_;
+    /*  lookup routes, ipv6 addresses embedding an ipv4 one go through the ipv4 index  */
+    enum Route {
+        r_ipv4,
+        r_ipv4_mapped,      // ::ffff:0:0/96
+        r_6to4,             // 2002::/16
+        r_teredo,           // 2001::/32
+        r_ipv6,
+        r_count
+    };
+
+    static Route embeddedIpv4(const IPv6& ip, IPv4& v4) {
+        if (ip.hi == 0 && (ip.lo >> 32) == 0xffff) {
+            v4 = static_cast<IPv4>(ip.lo);
+            return r_ipv4_mapped;
+        }
+        if ((ip.hi >> 48) == 0x2002) {
+            v4 = static_cast<IPv4>(ip.hi >> 16);
+            return r_6to4;
+        }
+        if ((ip.hi >> 32) == 0x20010000) {
+            /*  teredo client address is stored inverted  */
+            v4 = static_cast<IPv4>(~ip.lo);
+            return r_teredo;
+        }
+        return r_ipv6;
     }
+
+    static uint64_t routeCount(Route route);
+
+    /*  lookup counters and latencies, reload metrics  */
+    struct Stats {
+        GeoStats::Totals lookups;
+        bool ready{false};
+        uint64_t reloads{0};
+        double lastReloadSeconds{0.0};
+        uint64_t lastReloadTime{0};     // micros
+        int64_t fileModified{0};
+        uint64_t generation{0};
+        size_t ipv4Ranges{0};
+        size_t ipv6Ranges{0};
+        size_t memory{0};
+        size_t previousMemory{0};       // with geodb.shadow previous only, else the previous one is freed
+        /*  shadow verification, geodb.shadow  */
+        uint64_t shadowChecked{0};
+        uint64_t shadowDivergences{0};
+        uint64_t shadowSkipped{0};      // the snapshot changed before the check, has no previous one or its file changed
+        uint64_t shadowDropped{0};      // the queue was full
+    };
+
+    static Stats stats();
+    /*  same in prometheus text exposition format  */
+    static std::string statsPrometheus();
+
+    static Element getIpv4(IPv4 ip);
     static Element getIpv4(const char *p, int size) {
-        assert(instance_ != nullptr);
-        return instance_->db_ ? instance_->db_->find(GeoDb::ipv4FromString(p, size)) : instance_->empty_;
+        return GeoDb::getIpv4(GeoDb::ipv4FromString(p, size));
     }
     static Element getIpv4(const std::string& ipStr) {
-        assert(instance_ != nullptr);
-        return instance_->db_ ? instance_->db_->find(GeoDb::ipv4FromString(ipStr)) : instance_->empty_;
+        return GeoDb::getIpv4(GeoDb::ipv4FromString(ipStr));
     }
     static Element getIpv4(const CString& ipStr) {
-        assert(instance_ != nullptr);
-        return instance_->db_ ? instance_->db_->find(GeoDb::ipv4FromString(ipStr.data, ipStr.size)) : instance_->empty_;
+        return GeoDb::getIpv4(GeoDb::ipv4FromString(ipStr.data, ipStr.size));
     }
+    static Element getIpv6(const IPv6& ip);
     static Element getIpv6(const char *p, int size) {
-        assert(instance_ != nullptr);
-        return instance_->db_ ? instance_->db_->find(GeoDb::ipv6FromString(p, size)) : instance_->empty_;
+        return GeoDb::getIpv6(GeoDb::ipv6FromString(p, size));
     }
     static Element getIpv6(const std::string& ipStr) {
-        assert(instance_ != nullptr);
-        return instance_->db_ ? instance_->db_->find(GeoDb::ipv6FromString(ipStr)) : instance_->empty_;
+        return GeoDb::getIpv6(GeoDb::ipv6FromString(ipStr));
     }
     static Element getIpv6(const CString& ipStr) {
-        assert(instance_ != nullptr);
-        return instance_->db_ ? instance_->db_->find(GeoDb::ipv6FromString(ipStr.data, ipStr.size)) : instance_->empty_;
-    }
-    static Element getIp(const CString& s) {
-        assert(instance_ != nullptr);
-        if (GeoDb::checkIpv4(s)) {
-            return GeoDb::getIpv4(s);
-        }
-        if (GeoDb::checkIpv6(s)) {
-            return GeoDb::getIpv6(s);
-        }
-        return instance_->empty_;
+        return GeoDb::getIpv6(GeoDb::ipv6FromString(ipStr.data, ipStr.size));
     }
+    static Element getIp(const CString& s);
+
+    /*  resolves n address strings against one snapshot, like getIp() each  */
+    static void getIps(const CString *ips, size_t n, Element *out);
+
+    /*  reverse lookups, they need geodb.reverse_index  */
+    enum Location {
+        l_country,
+        l_state,
+        l_city
+    };
+
+    struct Coverage {
+        size_t ipv4Ranges{0};           // coalesced
+        uint64_t ipv4Addresses{0};
+        size_t ipv6Ranges{0};
+        double ipv6Addresses{0.0};
+    };
+
+    /*  minimal cidr cover of the location's ipv4 or ipv6 ranges, in address order  */
+    static std::vector<std::string> networks(Location location, unsigned int id, bool ipv6);
+    static Coverage coverage(Location location, unsigned int id);
+
+    /*  countries, states and cities an address may be in to match, ids 0 are ignored  */
+    struct TargetSet {
+        std::vector<unsigned int> countries;
+        std::vector<unsigned int> states;
+        std::vector<unsigned int> cities;
+    };
+
+    class Targeting;
+
+    /*  compiles a target set against the current snapshot, flatten trades memory for one load less per test  */
+    static std::shared_ptr<const Targeting> compile(const TargetSet& set, bool flatten = false);
+
+    /*  extended attributes of the range holding an address, kept apart from Element  */
+    enum AttributeFlags {
+        a_anonymous_proxy = 1,
+        a_satellite_provider = 2,
+        a_located = 4               // latitude and longitude are known
+    };
+
+    static constexpr double coordinateScale = 10000.0;      // stored as degrees * scale
+
+    struct Attributes {
+        bool found{false};          // false as well when geodb.attributes is off
+        double latitude{0.0};
+        double longitude{0.0};
+        unsigned int accuracyRadius{0};     // km
+        CString postalCode;
+        unsigned int flags{0};
+    };
+
+    static Attributes getAttributes(IPv4 ip);
+    static Attributes getAttributes(const IPv6& ip);
+    static Attributes getAttributes(const CString& ip);
+
+    /*  spatial queries over city coordinates, they need geodb.spatial_index  */
+    struct City {
+        unsigned int cityId{0};     // 0 if none
+        double distance{0.0};       // km
+    };
+
+    static City nearestCity(double latitude, double longitude);
+    /*  nearest first  */
+    static std::vector<City> citiesWithin(double latitude, double longitude, double km);
+    /*  precomputed nearest cities, nearest first  */
+    static std::vector<unsigned int> cityNeighbors(unsigned int cityId);
+    static bool cityLocation(unsigned int cityId, double& latitude, double& longitude);
+    /*  by the coordinates of the address range when known (geodb.attributes), else of its city  */
+    static bool withinRadius(IPv4 ip, unsigned int cityId, double km);
+    static bool withinRadius(const IPv6& ip, unsigned int cityId, double km);
+    static bool withinRadius(const CString& ip, unsigned int cityId, double km);
 
 #ifndef UNIT_TESTS
 private:
 #endif
 
+    typedef unsigned __int128 IPv6Key;
+
+    static IPv6Key ipv6Key(const IPv6& ip) {
+        return static_cast<IPv6Key>(ip.hi) << 64 | ip.lo;
+    }
+
     struct Db {
 
-        struct IPv4Data {
-            IPv4 from;
-            IPv4 to;
-            Element el;
+        template <typename Key>
+        using Index = RangeIndex<Key, EytzingerLayout>;
+
+        /*  image section ids, indexes take a few consecutive ids each  */
+        enum Section : uint32_t {
+            s_flags = 0x100,
+            s_elements = 0x200,
+            s_strings = 0x300,
+            s_ipv4 = 0x400,
+            s_ipv6_hi = 0x500,
+            s_ipv6 = 0x600,
+            s_reverse = 0x700,
+            s_attributes = 0x800,
+            s_spatial = 0x900
+        };
+
+        enum Flags : uint32_t {
+            f_ipv6_compressed = 1,
+            f_reverse_index = 2,
+            f_attributes = 4,
+            f_spatial_index = 8
+        };
+
+        /*  what a built db holds besides the range indexes, an attached one takes it from the image  */
+        struct Options {
+            bool ipv6Compressed{false};
+            bool reverseIndex{false};
+            bool attributes{false};
+            bool spatialIndex{false};
         };
 
-        struct IPv6Data {
-            IPv6 from;
-            IPv6 to;
-            Element el;
+        /*  indexes a range slot may belong to  */
+        enum Part {
+            p_ipv4,
+            p_ipv6_hi,
+            p_ipv6,
+            p_count
         };
 
+        static constexpr uint32_t npos = Index<IPv4>::npos;
+        static constexpr size_t noSlot = Index<IPv4>::noSlot;
+
+        Db() : Db(Options()) {}
+        explicit Db(const Options& options)
+            : ipv6Compressed_(options.ipv6Compressed), reverseIndex_(options.reverseIndex), attributes_(options.attributes),
+              spatialIndex_(options.spatialIndex) {}
+
         [[nodiscard]] Element find(IPv4 ip) const {
-            auto it = ipv4_.lower_bound(ip);
-            if (it != ipv4_.end()) {
-                auto el = it->second;
-                if (el.from <= ip) {
-                    return el.el;
-                }
+            if (mmdb_) {
+                return findMmdb(ip);
             }
-            return empty_;
+            return element(elementId(ip));
         }
 
         [[nodiscard]] Element find(IPv6 ip) const {
-            auto it = ipv6_.lower_bound(ip);
-            if (it != ipv6_.end()) {
-                auto el = it->second;
-                if (el.from <= ip) {
-                    return el.el;
-                }
+            if (mmdb_) {
+                return findMmdb(ip);
             }
-            return empty_;
+            return element(elementId(ip));
         }
 
-        void addRange(IPv4 from, IPv4 to, unsigned int countryId, unsigned int stateId, unsigned int cityId,
-                const std::string& countryKey, const std::string& stateKey, const std::string& cityName) {
-            auto findCo = countryKeys_.find(countryKey);
-            Element el;
-            if (findCo != countryKeys_.end()) {
-                el.countryKey = *findCo;
-            } else {
-                auto p = countryKeys_.insert(countryKey);
-                el.countryKey = *p.first;
+        /*  id of the element of the range holding ip, npos if none, not for mmdb  */
+        [[nodiscard]] uint32_t elementId(IPv4 ip) const {
+            return ipv4_.find(ip);
+        }
+
+        [[nodiscard]] uint32_t elementId(const IPv6& ip) const {
+            /*  ranges are disjoint, a /64 aligned hit excludes longer prefixes  */
+            uint32_t el = ipv6Compressed_ ? ipv6HiPacked_.find(ip.hi) : ipv6Hi_.find(ip.hi);
+            return el != npos ? el : ipv6_.find(GeoDb::ipv6Key(ip));
+        }
+
+        /*  slot of the range holding ip in its index part, noSlot if none  */
+        [[nodiscard]] size_t slot(IPv4 ip, Part& part) const {
+            part = p_ipv4;
+            return ipv4_.findSlot(ip);
+        }
+
+        [[nodiscard]] size_t slot(const IPv6& ip, Part& part) const {
+            part = p_ipv6_hi;
+            size_t i = ipv6Compressed_ ? ipv6HiPacked_.findSlot(ip.hi) : ipv6Hi_.findSlot(ip.hi);
+            if (i == noSlot) {
+                part = p_ipv6;
+                i = ipv6_.findSlot(GeoDb::ipv6Key(ip));
             }
-            auto findSt = stateKeys_.find(stateKey);
-            if (findSt != stateKeys_.end()) {
-                el.stateKey = *findSt;
-            } else {
-                auto p = stateKeys_.insert(stateKey);
-                el.stateKey = *p.first;
+            return i;
+        }
+
+        [[nodiscard]] size_t slots(Part part) const {
+            if (part == p_ipv4) {
+                return ipv4_.slots();
+            }
+            if (part == p_ipv6) {
+                return ipv6_.slots();
+            }
+            return ipv6Compressed_ ? ipv6HiPacked_.slots() : ipv6Hi_.slots();
+        }
+
+        [[nodiscard]] uint32_t slotElement(Part part, size_t i) const {
+            if (part == p_ipv4) {
+                return ipv4_.slotValue(i);
+            }
+            if (part == p_ipv6) {
+                return ipv6_.slotValue(i);
             }
-            auto findCi = cityNames_.find(cityName);
-            if (findCi != cityNames_.end()) {
-                el.cityName = *findCi;
+            return ipv6Compressed_ ? ipv6HiPacked_.slotValue(i) : ipv6Hi_.slotValue(i);
+        }
+
+        [[nodiscard]] size_t elementCount() const { return elements_.size(); }
+        void locations(uint32_t el, unsigned int& countryId, unsigned int& stateId, unsigned int& cityId) const {
+            const auto& e = elements_[el];
+            countryId = e.countryId;
+            stateId = e.stateId;
+            cityId = e.cityId;
+        }
+        [[nodiscard]] bool mmdb() const { return mmdb_ != nullptr; }
+
+        /*  empty for npos  */
+        [[nodiscard]] Element element(uint32_t el) const {
+            if (el == npos) {
+                return empty_;
+            }
+            const auto& e = elements_[el];
+            Element r;
+            r.countryId = e.countryId;
+            r.stateId = e.stateId;
+            r.cityId = e.cityId;
+            r.countryKey.assign(strings_.data() + e.countryKey.offset, static_cast<int>(e.countryKey.size));
+            r.stateKey.assign(strings_.data() + e.stateKey.offset, static_cast<int>(e.stateKey.size));
+            r.cityName.assign(strings_.data() + e.cityName.offset, static_cast<int>(e.cityName.size));
+            r.asn = e.asn;
+            r.asnOrg.assign(strings_.data() + e.asnOrg.offset, static_cast<int>(e.asnOrg.size));
+            return r;
+        }
+
+        /*  fn(ipv6, from, to, element) for every range, not for mmdb  */
+        template <typename Fn>
+        void forEachRange(Fn fn) const {
+            ipv4_.forEach([&fn](IPv4 from, IPv4 to, uint32_t el) {
+                fn(false, static_cast<IPv6Key>(from), static_cast<IPv6Key>(to), el);
+            });
+            auto hi = [&fn](uint64_t from, uint64_t to, uint32_t el) {
+                fn(true, static_cast<IPv6Key>(from) << 64, static_cast<IPv6Key>(to) << 64 | 0xffffffffffffffffULL, el);
+            };
+            if (ipv6Compressed_) {
+                ipv6HiPacked_.forEach(hi);
             } else {
-                auto p = cityNames_.insert(cityName);
-                el.cityName = *p.first;
+                ipv6Hi_.forEach(hi);
+            }
+            ipv6_.forEach([&fn](IPv6Key from, IPv6Key to, uint32_t el) {
+                fn(true, from, to, el);
+            });
+        }
+
+        [[nodiscard]] Attributes attributes(IPv4 ip) const {
+            if (!attributes_ || mmdb_) {
+                return {};
+            }
+            Part part;
+            return attributes(part, slot(ip, part));
+        }
+
+        [[nodiscard]] Attributes attributes(const IPv6& ip) const {
+            if (!attributes_ || mmdb_) {
+                return {};
+            }
+            Part part;
+            return attributes(part, slot(ip, part));
+        }
+
+        /*  null when not built  */
+        [[nodiscard]] const GeoSpatialIndex *spatial() const { return spatialIndex_ ? &spatial_ : nullptr; }
+
+        /*  coordinates of the range holding ip, else of its city  */
+        template <typename Ip>
+        bool locate(const Ip& ip, double& latitude, double& longitude) const {
+            if (mmdb_) {
+                return false;
+            }
+            Attributes a = attributes(ip);
+            if (a.flags & a_located) {
+                latitude = a.latitude;
+                longitude = a.longitude;
+                return true;
+            }
+            uint32_t el = elementId(ip);
+            if (el == npos || !spatialIndex_) {
+                return false;
             }
-            el.countryId = countryId;
-            el.stateId = stateId;
-            el.cityId = cityId;
-            ipv4_[to] = {from, to, el};
+            unsigned int countryId;
+            unsigned int stateId;
+            unsigned int cityId;
+            locations(el, countryId, stateId, cityId);
+            return cityId && spatial_.location(cityId, latitude, longitude);
+        }
+
+        /*  attributes ids count from 1 in the order added, 0 means none  */
+        void addRange(IPv4 from, IPv4 to, unsigned int countryId, unsigned int stateId, unsigned int cityId,
+                const std::string& countryKey, const std::string& stateKey, const std::string& cityName, uint32_t attributes = 0,
+                unsigned int asn = 0, const std::string& asnOrg = std::string()) {
+            ipv4_.add(from, to, elementId(countryId, stateId, cityId, countryKey, stateKey, cityName, asn, asnOrg));
+            stageAttributes(p_ipv4, to, attributes);
         }
 
         void addRange(IPv6 from, IPv6 to, unsigned int countryId, unsigned int stateId, unsigned int cityId,
-                const std::string& countryKey, const std::string& stateKey, const std::string& cityName) {
-            auto findCo = countryKeys_.find(countryKey);
-            Element el;
-            if (findCo != countryKeys_.end()) {
-                el.countryKey = *findCo;
+                const std::string& countryKey, const std::string& stateKey, const std::string& cityName, uint32_t attributes = 0,
+                unsigned int asn = 0, const std::string& asnOrg = std::string()) {
+            uint32_t el = elementId(countryId, stateId, cityId, countryKey, stateKey, cityName, asn, asnOrg);
+            if (from.lo == 0 && to.lo == 0xffffffffffffffffULL) {
+                if (ipv6Compressed_) {
+                    ipv6HiPacked_.add(from.hi, to.hi, el);
+                } else {
+                    ipv6Hi_.add(from.hi, to.hi, el);
+                }
+                stageAttributes(p_ipv6_hi, to.hi, attributes);
             } else {
-                auto p = countryKeys_.insert(countryKey);
-                el.countryKey = *p.first;
+                ipv6_.add(GeoDb::ipv6Key(from), GeoDb::ipv6Key(to), el);
+                stageAttributes(p_ipv6, GeoDb::ipv6Key(to), attributes);
             }
-            auto findSt = stateKeys_.find(stateKey);
-            if (findSt != stateKeys_.end()) {
-                el.stateKey = *findSt;
-            } else {
-                auto p = stateKeys_.insert(stateKey);
-                el.stateKey = *p.first;
+        }
+
+        /*  ignored unless the db loads attributes  */
+        void addAttributes(int32_t latitude, int32_t longitude, unsigned int accuracyRadius, const std::string& postalCode,
+                unsigned int flags);
+
+        /*  ignored unless the db has a spatial index  */
+        void addCity(unsigned int cityId, double latitude, double longitude, std::vector<uint32_t> neighbors) {
+            if (spatialIndex_) {
+                spatial_.add(cityId, latitude, longitude, std::move(neighbors));
             }
-            auto findCi = cityNames_.find(cityName);
-            if (findCi != cityNames_.end()) {
-                el.cityName = *findCi;
-            } else {
-                auto p = cityNames_.insert(cityName);
-                el.cityName = *p.first;
+        }
+
+        /*  must be called once all ranges are added  */
+        void build();
+        void loadMmdb(const std::string& file);
+
+        /*  a built db as image sections, the db must outlive writer.write()  */
+        void save(GeoImageWriter& writer) const;
+        /*  serve from an image, false if it misses a section  */
+        bool attach(std::shared_ptr<const GeoImage> image);
+
+        [[nodiscard]] bool attached() const { return image_ != nullptr; }
+
+        /*  geodb file the ranges were read from, as it was then  */
+        struct Source {
+            std::string file;
+            int64_t modified{0};
+            uint64_t size{0};
+        };
+
+        void setSource(Source source) { source_ = std::move(source); }
+        [[nodiscard]] const Source& source() const { return source_; }
+        [[nodiscard]] uint64_t generation() const { return image_ ? image_->header().generation : 0; }
+        [[nodiscard]] size_t ipv4Size() const { return ipv4_.size(); }
+        [[nodiscard]] size_t ipv6HiSize() const { return ipv6Compressed_ ? ipv6HiPacked_.size() : ipv6Hi_.size(); }
+        [[nodiscard]] size_t ipv6LongSize() const { return ipv6_.size(); }
+        [[nodiscard]] size_t ipv6Memory() const {
+            return (ipv6Compressed_ ? ipv6HiPacked_.memory() : ipv6Hi_.memory()) + ipv6_.memory();
+        }
+        [[nodiscard]] size_t memory() const {
+            return ipv4_.memory() + ipv6Memory() + elements_.memory() + strings_.memory() + reverse_.memory()
+                + attributesMemory() + spatial_.memory();
+        }
+        [[nodiscard]] size_t attributesMemory() const {
+            size_t memory = latitudes_.memory() + longitudes_.memory() + accuracyRadiuses_.memory()
+                + postalCodes_.memory() + attributeFlags_.memory() + postalDictionary_.memory();
+            for (const auto& slots : slotAttributes_) {
+                memory += slots.memory();
             }
-            el.countryId = countryId;
-            el.stateId = stateId;
-            el.cityId = cityId;
-            ipv6_[to] = {from, to, el};
+            return memory;
         }
+        /*  null when not built  */
+        [[nodiscard]] const GeoReverseIndex *reverse() const { return reverseIndex_ ? &reverse_ : nullptr; }
 
     private:
+
+        /*  offset into the string pool, strings are zero terminated there  */
+        struct StringRef {
+            uint32_t offset;
+            uint32_t size;
+        };
+
+        /*  element as laid out in an image, asn rides along so one search yields both  */
+        struct PackedElement {
+            uint32_t countryId;
+            uint32_t stateId;
+            uint32_t cityId;
+            uint32_t asn;
+            StringRef countryKey;
+            StringRef stateKey;
+            StringRef cityName;
+            StringRef asnOrg;
+        };
+
+        [[nodiscard]] Element findMmdb(IPv4 ip) const;
+        [[nodiscard]] Element findMmdb(IPv6 ip) const;
+
+        /*  range to attributes by index slot  */
+        struct StagedAttributes {
+            Part part;
+            IPv6Key to;
+            uint32_t id;
+        };
+
+        void stageAttributes(Part part, IPv6Key to, uint32_t id) {
+            if (attributes_ && id) {
+                stagedSlotAttributes_.push_back({part, to, id});
+            }
+        }
+
+        [[nodiscard]] Attributes attributes(Part part, size_t i) const {
+            Attributes r;
+            if (i == noSlot || i >= slotAttributes_[part].size() || slotAttributes_[part][i] == 0) {
+                return r;
+            }
+            uint32_t id = slotAttributes_[part][i];
+            r.found = true;
+            r.flags = attributeFlags_[id];
+            if (r.flags & a_located) {
+                r.latitude = latitudes_[id] / coordinateScale;
+                r.longitude = longitudes_[id] / coordinateScale;
+            }
+            r.accuracyRadius = accuracyRadiuses_[id];
+            const auto& postalCode = postalDictionary_[postalCodes_[id]];
+            r.postalCode.assign(strings_.data() + postalCode.offset, static_cast<int>(postalCode.size));
+            return r;
+        }
+
+        void stageNoAttributes();
+        void buildAttributes();
+
+        StringRef intern(const std::string& s);
+        uint32_t elementId(unsigned int countryId, unsigned int stateId, unsigned int cityId,
+                const std::string& countryKey, const std::string& stateKey, const std::string& cityName,
+                unsigned int asn, const std::string& asnOrg);
+        void buildReverse();
+
         Element empty_;
-        std::map<IPv4, IPv4Data> ipv4_;
-        std::map<IPv6, IPv6Data> ipv6_;
-        std::unordered_set<std::string> stateKeys_;
-        std::unordered_set<std::string> cityNames_;
-        std::set<std::string> countryKeys_;
+        std::shared_ptr<GeoMmdb> mmdb_;     // set when served straight from an mmdb file
+        std::shared_ptr<const GeoImage> image_;     // set when served from an image
+        Source source_;
+        Index<IPv4> ipv4_;
+        bool ipv6Compressed_;
+        uint32_t flags_{0};
+        Index<uint64_t> ipv6Hi_;            // ipv6 ranges aligned on /64 or shorter, upper 64 bits
+        CompressedRangeIndex ipv6HiPacked_; // same when ipv6Compressed_
+        Index<IPv6Key> ipv6_;               // the rest of ipv6 ranges
+        bool reverseIndex_;
+        GeoReverseIndex reverse_;
+        /*  extended attributes, columns by attributes id, entry 0 is none  */
+        bool attributes_;
+        GeoArray<uint32_t> slotAttributes_[p_count];    // attributes id by index slot
+        GeoArray<int32_t> latitudes_;
+        GeoArray<int32_t> longitudes_;
+        GeoArray<uint16_t> accuracyRadiuses_;
+        GeoArray<uint32_t> postalCodes_;                // into postalDictionary_
+        GeoArray<uint8_t> attributeFlags_;
+        GeoArray<StringRef> postalDictionary_;          // into strings_, entry 0 is empty
+        bool spatialIndex_;
+        GeoSpatialIndex spatial_;
+        /*  distinct elements referenced by index, their strings in one pool  */
+        GeoArray<PackedElement> elements_;
+        GeoArray<char> strings_;
+        /*  build state  */
+        std::vector<PackedElement> stagedElements_;
+        std::vector<char> stagedStrings_;
+        std::unordered_map<std::string, uint32_t> elementIds_;
+        std::unordered_map<std::string, StringRef> stringRefs_;
+        std::vector<StagedAttributes> stagedSlotAttributes_;
+        std::vector<int32_t> stagedLatitudes_;
+        std::vector<int32_t> stagedLongitudes_;
+        std::vector<uint16_t> stagedAccuracyRadiuses_;
+        std::vector<uint32_t> stagedPostalCodes_;
+        std::vector<uint8_t> stagedAttributeFlags_;
+        std::vector<StringRef> stagedPostalDictionary_;
+        std::unordered_map<std::string, uint32_t> postalCodeIds_;
     };
 
+    /*  numa node of the calling thread, refreshed every so many calls  */
+    static int localNode();
+
+    /*  a db and, with numa replication, a copy of it per numa node  */
+    struct Snapshot {
+        std::vector<std::shared_ptr<Db>> replicas;  // by node, a single db when not replicated
+        uint64_t seq{0};                            // counts snapshots of an instance from 1
+
+        [[nodiscard]] const Db& db() const { return *replicas[0]; }
+
+        [[nodiscard]] size_t memory() const {
+            size_t memory = 0;
+            for (size_t i = 0; i < replicas.size(); i++) {
+                if (i == 0 || replicas[i] != replicas[0]) {
+                    memory += replicas[i]->memory();
+                }
+            }
+            return memory;
+        }
+
+        [[nodiscard]] const Db& local() const {
+            if (replicas.size() == 1) {
+                return *replicas[0];
+            }
+            auto node = static_cast<size_t>(GeoDb::localNode());
+            return *replicas[node < replicas.size() ? node : 0];
+        }
+    };
+
+    /*  r_count when s is no address  */
+    static Route parseIp(const CString& s, IPv4& v4, IPv6& ip);
+
+    template <typename Ip>
+    static bool withinRadius(const Db *db, const Ip& ip, unsigned int cityId, double km);
+
+    /*  callers hold a GeoEpochs::Guard on epochs_ while they use the db  */
+    [[nodiscard]] const Db *localDb() const {
+        const Snapshot *snapshot = current_.load(std::memory_order_acquire);
+        return snapshot ? &snapshot->local() : nullptr;
+    }
+
+    /*  key is the address searched, an ipv4 one for routes embedding it  */
+    template <typename Find>
+    Element lookup(GeoStats::Counter counter, GeoStats::Histogram histogram, bool ipv6, IPv6Key key, Find find) {
+        GeoEpochs::Guard guard(epochs_);
+        return lookup(stats_.shard(), current_.load(std::memory_order_acquire), counter, histogram, ipv6, key, find);
+    }
+
+    /*  same against a snapshot loaded by the caller under a guard, a batch resolves all its addresses against one  */
+    template <typename Find>
+    Element lookup(GeoStats::Shard& shard, const Snapshot *snapshot, GeoStats::Counter counter, GeoStats::Histogram histogram,
+            bool ipv6, IPv6Key key, Find find) {
+        shard.add(counter);
+        if (!snapshot) {
+            shard.add(GeoStats::c_miss);
+            return empty_;
+        }
+        const Db& db = snapshot->local();
+        Element el;
+        if (shard.sample()) {
+            auto begin = std::chrono::steady_clock::now();
+            el = find(db);
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+            shard.record(histogram, static_cast<uint64_t>(ns));
+        } else {
+            el = find(db);
+        }
+        if (el.countryId == 0 && el.countryKey.empty()) {
+            shard.add(GeoStats::c_miss);
+        }
+        /*  calls is already counted by sample(), so these are never the timed ones  */
+        if (shadow_ && (shard.calls & shadowMask_) == 0) {
+            shadowPush(*snapshot, ipv6, key, el);
+        }
+        return el;
+    }
+
+    void shadowPush(const Snapshot& snapshot, bool ipv6, IPv6Key key, const Element& el);
+
+    enum class Format {
+        PROTOBUF,
+        MMDB
+    };
+
+    enum class HugePages {
+        NONE,
+        TRANSPARENT,
+        EXPLICIT
+    };
+
+    /*  what sampled lookups are checked against  */
+    enum class ShadowMode {
+        NONE,
+        REFERENCE,                  // a std::map search over the ranges of the file the snapshot was built from
+        PREVIOUS                    // the previous snapshot, to measure a data release
+    };
+
+    class Shadow;
 
     explicit GeoDb(const rapidjson::Document& config);
     GeoDb(const GeoDb&);
@@ -298,25 +820,419 @@ private:
     GeoDb& operator=(const GeoDb&);
     ~GeoDb();
     void initConfig(const rapidjson::Document& config);
-    [[nodiscard]] std::shared_ptr<Db> loadDb() const;
-    void watcherThreadLoop();
+    [[nodiscard]] std::shared_ptr<Db> loadDb();
+    [[nodiscard]] std::shared_ptr<Db> buildDb(const std::string& file) const;
+    [[nodiscard]] std::shared_ptr<Db> loadSharedDb();
+    [[nodiscard]] std::shared_ptr<Snapshot> makeSnapshot(std::shared_ptr<Db> db) const;
+    [[nodiscard]] std::shared_ptr<const GeoImage> placeImage(const GeoImageWriter& writer, uint64_t generation, int node) const;
+    void setDb(std::shared_ptr<Db> db);
+    /*  frees retired snapshots no lookup can still read  */
+    void reclaim();
+    void initialLoad();
+    /*  the first load done, completes whenReady() before isReady() turns true  */
+    void markReady();
+    void recordReload(uint64_t begin);
+    /*  run by the watcher thread when scheduled, returns the time of the next check  */
+    uint64_t checkForUpdate(uint64_t scheduled);
+
+    class Watcher;
 
     const std::string defaultGeodbFile_ = "geodb.dat";
     const double defaultCheckForUpdateTimeout_ = 5.0;
+    const double defaultShadowSampleRate_ = 0.001;
+    static constexpr size_t hugePageSize_ = 2 * 1024 * 1024;
+    static constexpr int hugeTlb2Mb_ = 21 << 26;      // MAP_HUGE_2MB
 
     /*  config  */
     std::string geodbFile_;
+    Format format_{Format::PROTOBUF};
+    bool ipv6Compressed_{false};
+    bool reverseIndex_{false};
+    bool attributes_{false};
+    bool spatialIndex_{false};
+    std::string shmName_;
+    bool numaReplicas_{false};
+    HugePages hugePages_{HugePages::NONE};
+    bool prefault_{false};
+    bool mlock_{false};
     double checkForUpdateTimeout_{defaultCheckForUpdateTimeout_};
     bool dontLoadDb_{false};
+    bool asyncInit_{false};
+    std::string fallbackFile_;
+    ShadowMode shadowMode_{ShadowMode::NONE};
+    double shadowSampleRate_{defaultShadowSampleRate_};
+    /*  watch state, owned by the watcher thread  */
+    enum WatchState {
+        w_initial,
+        w_none,
+        w_started                   // file changed, loaded once it stays the same for a check
+    };
+    WatchState watchState_{w_initial};
+    time_t dbLastModified_{0};
     /**/
-    std::mutex watcherLock_;
-    std::condition_variable watcherCond_;
-    std::atomic<bool> doShutdown_;
-    std::unique_ptr<std::thread> watcherThread_;
     Element empty_;
+    GeoStats stats_;
+    std::mutex statsLock_;
+    Stats reloadStats_;
+    std::atomic<bool> ready_{false};
+    std::promise<void> readyPromise_;
+    std::mutex readyLock_;                  // readyFuture_ is replaced by a reload after a failed init
+    std::shared_future<void> readyFuture_;
+    /**/
+    std::unique_ptr<GeoShm> shm_;
     /**/
-    static GeoDb *instance_;
-    std::shared_ptr<Db> db_;
+    static std::shared_ptr<Handle> instance_;
+    /*  lookups read db through current_ under an epochs_ guard and hold no reference, a
+        snapshot switched out is retired and freed once no guard entered before the switch is
+        left and a check interval has passed, so element strings outlive the lookup  */
+    struct Retired {
+        std::shared_ptr<Snapshot> snapshot;
+        uint64_t epoch;
+        uint64_t time;                      // micros
+    };
+
+    std::atomic<const Snapshot *> current_{nullptr};
+    GeoEpochs epochs_;
+    std::mutex snapshotLock_;               // for readers taking snapshot_ outside the watcher thread
+    std::shared_ptr<Snapshot> snapshot_;
+    std::shared_ptr<Snapshot> prevSnapshot_;  // kept for geodb.shadow previous only
+    uint64_t snapshotSeq_{0};               // under snapshotLock_
+    std::vector<Retired> retired_;          // owned by the thread switching snapshots
+    uint64_t shmGeneration_{0};             // published generation seen by the last load
+    /**/
+    uint64_t shadowMask_{0};                // lookups are sampled when calls & mask is 0
+    std::unique_ptr<Shadow> shadow_;
 };
 
+/*
+ *  An open geodb, see GeoDb::open(). Lookups are the ones of the static api, served from
+ *  this instance's snapshots and counted in its stats.
+ */
+class GeoDb::Handle : public std::enable_shared_from_this<GeoDb::Handle>
+{
+public:
+
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+    ~Handle() { delete geodb_; }
+
+    [[nodiscard]] bool isReady() const {
+        return geodb_->ready_.load(std::memory_order_acquire);
+    }
+
+    [[nodiscard]] std::shared_future<void> whenReady() const {
+        std::lock_guard<std::mutex> guard(geodb_->readyLock_);
+        return geodb_->readyFuture_;
+    }
+
+    [[nodiscard]] uint64_t routeCount(Route route) const {
+        return geodb_->stats_.totals().counters[route];
+    }
+
+    [[nodiscard]] Stats stats() const;
+    [[nodiscard]] std::string statsPrometheus() const;
+
+    Element getIpv4(IPv4 ip) const {
+        return geodb_->lookup(GeoStats::c_ipv4, GeoStats::h_ipv4, false, ip, [ip](const Db& db) {
+            return db.find(ip);
+        });
+    }
+    Element getIpv4(const char *p, int size) const {
+        return getIpv4(GeoDb::ipv4FromString(p, size));
+    }
+    Element getIpv4(const std::string& ipStr) const {
+        return getIpv4(GeoDb::ipv4FromString(ipStr));
+    }
+    Element getIpv4(const CString& ipStr) const {
+        return getIpv4(GeoDb::ipv4FromString(ipStr.data, ipStr.size));
+    }
+    Element getIpv6(const IPv6& ip) const {
+        IPv4 v4 = 0;
+        Route route = GeoDb::embeddedIpv4(ip, v4);
+        return geodb_->lookup(static_cast<GeoStats::Counter>(route), GeoStats::h_ipv6, route == r_ipv6,
+                route == r_ipv6 ? GeoDb::ipv6Key(ip) : v4, [&ip, v4, route](const Db& db) {
+            return route == r_ipv6 ? db.find(ip) : db.find(v4);
+        });
+    }
+    Element getIpv6(const char *p, int size) const {
+        return getIpv6(GeoDb::ipv6FromString(p, size));
+    }
+    Element getIpv6(const std::string& ipStr) const {
+        return getIpv6(GeoDb::ipv6FromString(ipStr));
+    }
+    Element getIpv6(const CString& ipStr) const {
+        return getIpv6(GeoDb::ipv6FromString(ipStr.data, ipStr.size));
+    }
+    Element getIp(const CString& s) const {
+        if (GeoDb::checkIpv4(s)) {
+            return getIpv4(s);
+        }
+        if (GeoDb::checkIpv6(s)) {
+            return getIpv6(s);
+        }
+        geodb_->stats_.shard().add(GeoStats::c_invalid);
+        return geodb_->empty_;
+    }
+    void getIps(const CString *ips, size_t n, Element *out) const;
+
+    [[nodiscard]] std::vector<std::string> networks(Location location, unsigned int id, bool ipv6) const;
+    [[nodiscard]] Coverage coverage(Location location, unsigned int id) const;
+    [[nodiscard]] std::shared_ptr<const Targeting> compile(const TargetSet& set, bool flatten = false) const;
+
+    [[nodiscard]] Attributes getAttributes(IPv4 ip) const;
+    [[nodiscard]] Attributes getAttributes(const IPv6& ip) const;
+    [[nodiscard]] Attributes getAttributes(const CString& ip) const;
+
+    [[nodiscard]] City nearestCity(double latitude, double longitude) const;
+    [[nodiscard]] std::vector<City> citiesWithin(double latitude, double longitude, double km) const;
+    [[nodiscard]] std::vector<unsigned int> cityNeighbors(unsigned int cityId) const;
+    bool cityLocation(unsigned int cityId, double& latitude, double& longitude) const;
+    [[nodiscard]] bool withinRadius(IPv4 ip, unsigned int cityId, double km) const;
+    [[nodiscard]] bool withinRadius(const IPv6& ip, unsigned int cityId, double km) const;
+    [[nodiscard]] bool withinRadius(const CString& ip, unsigned int cityId, double km) const;
+
+private:
+
+    friend class GeoDb;
+
+    explicit Handle(GeoDb *geodb) : geodb_(geodb) {}
+
+    GeoDb *const geodb_;
+};
+
+/*
+ *  Target set membership: a bit per element id of the snapshot it was compiled against,
+ *  or, flattened, a bit per range slot of every index part. Tests take an index search
+ *  and a bit test, no Element is built. The snapshot is kept alive, compile again once
+ *  stale() to follow reloads.
+ */
+class GeoDb::Targeting
+{
+public:
+
+    [[nodiscard]] bool contains(IPv4 ip) const {
+        const Db& db = snapshot_->local();
+        if (flat_) {
+            Db::Part part;
+            size_t i = db.slot(ip, part);
+            return i != Db::noSlot && test(slots_[part], i);
+        }
+        uint32_t el = db.elementId(ip);
+        return el != Db::npos && test(elements_, el);
+    }
+
+    [[nodiscard]] bool contains(const IPv6& ip) const {
+        IPv4 v4 = 0;
+        if (GeoDb::embeddedIpv4(ip, v4) != r_ipv6) {
+            return contains(v4);
+        }
+        const Db& db = snapshot_->local();
+        if (flat_) {
+            Db::Part part;
+            size_t i = db.slot(ip, part);
+            return i != Db::noSlot && test(slots_[part], i);
+        }
+        uint32_t el = db.elementId(ip);
+        return el != Db::npos && test(elements_, el);
+    }
+
+    [[nodiscard]] bool contains(const CString& s) const {
+        IPv4 v4 = 0;
+        IPv6 ip;
+        Route route = GeoDb::parseIp(s, v4, ip);
+        return route != r_count && (route == r_ipv6 ? contains(ip) : contains(v4));
+    }
+
+    /*  out[i] for ips[i], invalid addresses are no member  */
+    void contains(const CString *ips, size_t n, bool *out) const {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = contains(ips[i]);
+        }
+    }
+
+    /*  a newer snapshot is current or the instance is closed  */
+    [[nodiscard]] bool stale() const {
+        auto handle = handle_.lock();
+        return !handle || handle->geodb_->current_.load(std::memory_order_acquire) != snapshot_.get();
+    }
+
+    [[nodiscard]] size_t memory() const {
+        size_t memory = elements_.size() * sizeof(uint64_t);
+        for (const auto& slots : slots_) {
+            memory += slots.size() * sizeof(uint64_t);
+        }
+        return memory;
+    }
+
+private:
+
+    friend class GeoDb;
+
+    static bool test(const std::vector<uint64_t>& bits, size_t i) {
+        return (bits[i >> 6] >> (i & 63)) & 1;
+    }
+
+    std::weak_ptr<const Handle> handle_;
+    std::shared_ptr<const Snapshot> snapshot_;
+    bool flat_{false};
+    std::vector<uint64_t> elements_;
+    std::vector<uint64_t> slots_[Db::p_count];
+};
+
+/*  the static api, forwards to the instance made by init()  */
+
+inline bool
+GeoDb::isReady()
+{
+    assert(instance_ != nullptr);
+    return instance_->isReady();
+}
+
+inline std::shared_future<void>
+GeoDb::whenReady()
+{
+    assert(instance_ != nullptr);
+    return instance_->whenReady();
+}
+
+inline uint64_t
+GeoDb::routeCount(Route route)
+{
+    assert(instance_ != nullptr);
+    return instance_->routeCount(route);
+}
+
+inline GeoDb::Element
+GeoDb::getIpv4(IPv4 ip)
+{
+    assert(instance_ != nullptr);
+    return instance_->getIpv4(ip);
+}
+
+inline GeoDb::Element
+GeoDb::getIpv6(const IPv6& ip)
+{
+    assert(instance_ != nullptr);
+    return instance_->getIpv6(ip);
+}
+
+inline GeoDb::Element
+GeoDb::getIp(const CString& s)
+{
+    assert(instance_ != nullptr);
+    return instance_->getIp(s);
+}
+
+inline void
+GeoDb::getIps(const CString *ips, size_t n, Element *out)
+{
+    assert(instance_ != nullptr);
+    instance_->getIps(ips, n, out);
+}
+
+inline GeoDb::Stats
+GeoDb::stats()
+{
+    assert(instance_ != nullptr);
+    return instance_->stats();
+}
+
+inline std::string
+GeoDb::statsPrometheus()
+{
+    assert(instance_ != nullptr);
+    return instance_->statsPrometheus();
+}
+
+inline std::vector<std::string>
+GeoDb::networks(Location location, unsigned int id, bool ipv6)
+{
+    assert(instance_ != nullptr);
+    return instance_->networks(location, id, ipv6);
+}
+
+inline GeoDb::Coverage
+GeoDb::coverage(Location location, unsigned int id)
+{
+    assert(instance_ != nullptr);
+    return instance_->coverage(location, id);
+}
+
+inline std::shared_ptr<const GeoDb::Targeting>
+GeoDb::compile(const TargetSet& set, bool flatten)
+{
+    assert(instance_ != nullptr);
+    return instance_->compile(set, flatten);
+}
+
+inline GeoDb::Attributes
+GeoDb::getAttributes(IPv4 ip)
+{
+    assert(instance_ != nullptr);
+    return instance_->getAttributes(ip);
+}
+
+inline GeoDb::Attributes
+GeoDb::getAttributes(const IPv6& ip)
+{
+    assert(instance_ != nullptr);
+    return instance_->getAttributes(ip);
+}
+
+inline GeoDb::Attributes
+GeoDb::getAttributes(const CString& ip)
+{
+    assert(instance_ != nullptr);
+    return instance_->getAttributes(ip);
+}
+
+inline GeoDb::City
+GeoDb::nearestCity(double latitude, double longitude)
+{
+    assert(instance_ != nullptr);
+    return instance_->nearestCity(latitude, longitude);
+}
+
+inline std::vector<GeoDb::City>
+GeoDb::citiesWithin(double latitude, double longitude, double km)
+{
+    assert(instance_ != nullptr);
+    return instance_->citiesWithin(latitude, longitude, km);
+}
+
+inline std::vector<unsigned int>
+GeoDb::cityNeighbors(unsigned int cityId)
+{
+    assert(instance_ != nullptr);
+    return instance_->cityNeighbors(cityId);
+}
+
+inline bool
+GeoDb::cityLocation(unsigned int cityId, double& latitude, double& longitude)
+{
+    assert(instance_ != nullptr);
+    return instance_->cityLocation(cityId, latitude, longitude);
+}
+
+inline bool
+GeoDb::withinRadius(IPv4 ip, unsigned int cityId, double km)
+{
+    assert(instance_ != nullptr);
+    return instance_->withinRadius(ip, cityId, km);
+}
+
+inline bool
+GeoDb::withinRadius(const IPv6& ip, unsigned int cityId, double km)
+{
+    assert(instance_ != nullptr);
+    return instance_->withinRadius(ip, cityId, km);
+}
+
+inline bool
+GeoDb::withinRadius(const CString& ip, unsigned int cityId, double km)
+{
+    assert(instance_ != nullptr);
+    return instance_->withinRadius(ip, cityId, km);
+}
+
 } // end of ggAdNet namespace
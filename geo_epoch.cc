@@ -0,0 +1,75 @@
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "geo_epoch.h"
+
+using namespace ggAdNet;
+
+namespace {
+
+std::atomic<uint64_t> lastEpochsId{0};
+
+bool
+registerMembarrier()
+{
+    static const bool registered = [] {
+        long commands = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+        return commands > 0 && (commands & MEMBARRIER_CMD_PRIVATE_EXPEDITED) != 0
+            && syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+    }();
+    return registered;
+}
+
+}
+
+GeoEpochs::GeoEpochs()
+    : id_(lastEpochsId.fetch_add(1) + 1),
+      membarrier_(registerMembarrier())
+{
+}
+
+GeoEpochs::Slot&
+GeoEpochs::registerThread()
+{
+    /*  ids are never reused, slots of instances gone are never looked up again  */
+    thread_local std::unordered_map<uint64_t, Slot *> owned;
+    auto it = owned.find(id_);
+    Slot *slot;
+    if (it != owned.end()) {
+        slot = it->second;
+    } else {
+        std::lock_guard<std::mutex> guard(lock_);
+        slots_.push_back(std::make_unique<Slot>());
+        slot = slots_.back().get();
+        owned.emplace(id_, slot);
+    }
+    lastOwner_ = id_;
+    lastSlot_ = slot;
+    return *slot;
+}
+
+uint64_t
+GeoEpochs::advance()
+{
+    return epoch_.fetch_add(1, std::memory_order_acq_rel) + 1;
+}
+
+bool
+GeoEpochs::quiescent(uint64_t epoch) const
+{
+    /*  readers' slot stores become visible before their loads of what was unlinked  */
+    if (membarrier_) {
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    } else {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    for (const auto& slot : slots_) {
+        uint64_t active = slot->active.load(std::memory_order_acquire);
+        if (active != 0 && active < epoch) {
+            return false;
+        }
+    }
+    return true;
+}
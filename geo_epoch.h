@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace ggAdNet {
+
+/*
+ *  Epoch based reclamation for data readers hold no reference to. A reader marks its
+ *  thread's slot with the epoch it entered in while inside a Guard; the writer unlinks,
+ *  advances the epoch and frees what it unlinked once quiescent() holds for the returned
+ *  epoch. Entering is a plain store: with membarrier(2) the writer orders it against the
+ *  reader's loads from its side, readers only fence where that is not available.
+ */
+class GeoEpochs
+{
+public:
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> active{0};            // epoch entered in, 0 outside any guard
+        uint64_t depth{0};                          // nested guards of the owning thread
+    };
+
+    class Guard
+    {
+    public:
+
+        explicit Guard(GeoEpochs& epochs) : slot_(epochs.slot()) {
+            if (slot_.depth++ == 0) {
+                slot_.active.store(epochs.epoch_.load(std::memory_order_acquire), std::memory_order_relaxed);
+                epochs.readerFence();
+            }
+        }
+
+        ~Guard() {
+            if (--slot_.depth == 0) {
+                slot_.active.store(0, std::memory_order_release);
+            }
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+    private:
+
+        Slot& slot_;
+    };
+
+    GeoEpochs();
+    GeoEpochs(const GeoEpochs&) = delete;
+    GeoEpochs& operator=(const GeoEpochs&) = delete;
+
+    /*  call after unlinking, returns the epoch to wait for before freeing what was unlinked  */
+    uint64_t advance();
+
+    /*  no reader is left that entered before epoch  */
+    [[nodiscard]] bool quiescent(uint64_t epoch) const;
+
+private:
+
+    Slot& slot() {
+        if (lastOwner_ == id_) {
+            return *lastSlot_;
+        }
+        return registerThread();
+    }
+
+    Slot& registerThread();
+
+    void readerFence() const {
+        if (membarrier_) {
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        } else {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    inline static thread_local uint64_t lastOwner_ = 0;
+    inline static thread_local Slot *lastSlot_ = nullptr;
+
+    uint64_t id_;
+    bool membarrier_{false};
+    std::atomic<uint64_t> epoch_{1};
+    mutable std::mutex lock_;
+    std::vector<std::unique_ptr<Slot>> slots_;
+};
+
+} // end of ggAdNet namespace
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+namespace ggAdNet {
+
+/*
+ *  Flat, position independent image of a geodb snapshot: a header, a section table and
+ *  64 byte aligned sections. Built once, it may be mapped read-only by other processes.
+ */
+struct GeoImageHeader {
+    static constexpr uint32_t currentVersion = 2;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t size;
+    uint64_t generation;
+    int64_t sourceModified;     // geodb file it was built from
+    uint64_t sourceSize;
+};
+
+struct GeoImageSection {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+};
+
+/*  array either owning its data or pointing into an image  */
+template <typename T>
+class GeoArray
+{
+public:
+
+    GeoArray() = default;
+    GeoArray(const GeoArray&) = delete;
+    GeoArray& operator=(const GeoArray&) = delete;
+    GeoArray(GeoArray&&) noexcept = default;
+    GeoArray& operator=(GeoArray&&) noexcept = default;
+
+    void assign(std::vector<T>&& v) {
+        own_ = std::move(v);
+        own_.shrink_to_fit();
+        data_ = own_.data();
+        size_ = own_.size();
+    }
+
+    void attach(const T *p, size_t size) {
+        std::vector<T>().swap(own_);
+        data_ = p;
+        size_ = size;
+    }
+
+    [[nodiscard]] const T *data() const { return data_; }
+    [[nodiscard]] size_t size() const { return size_; }
+    [[nodiscard]] bool empty() const { return size_ == 0; }
+    [[nodiscard]] size_t memory() const { return size_ * sizeof(T); }
+    const T& operator[](size_t i) const { return data_[i]; }
+
+private:
+    std::vector<T> own_;
+    const T *data_{nullptr};
+    size_t size_{0};
+};
+
+class GeoImageWriter
+{
+public:
+
+    static constexpr size_t alignment = 64;
+
+    /*  data is referenced, it must outlive write()  */
+    void add(uint32_t id, const void *p, size_t size) {
+        sections_.push_back({id, p, size});
+    }
+
+    template <typename T>
+    void add(uint32_t id, const GeoArray<T>& a) {
+        add(id, a.data(), a.memory());
+    }
+
+    [[nodiscard]] size_t size() const {
+        size_t size = headerSize();
+        for (const auto& s : sections_) {
+            size = align(size) + s.size;
+        }
+        return align(size);
+    }
+
+    void write(char *dest, uint64_t generation, int64_t sourceModified, uint64_t sourceSize) const {
+        GeoImageHeader header{};
+        memcpy(header.magic, "GEODBIMG", sizeof(header.magic));
+        header.version = GeoImageHeader::currentVersion;
+        header.sectionCount = static_cast<uint32_t>(sections_.size());
+        header.size = size();
+        header.generation = generation;
+        header.sourceModified = sourceModified;
+        header.sourceSize = sourceSize;
+        memcpy(dest, &header, sizeof(header));
+        auto *table = reinterpret_cast<GeoImageSection *>(dest + sizeof(header));
+        size_t offset = headerSize();
+        for (size_t i = 0; i < sections_.size(); i++) {
+            const auto& s = sections_[i];
+            offset = align(offset);
+            GeoImageSection section{s.id, 0, offset, s.size};
+            memcpy(table + i, &section, sizeof(section));
+            if (s.size) {
+                memcpy(dest + offset, s.p, s.size);
+            }
+            offset += s.size;
+        }
+    }
+
+private:
+
+    struct Section {
+        uint32_t id;
+        const void *p;
+        size_t size;
+    };
+
+    static size_t align(size_t n) {
+        return (n + alignment - 1) & ~(alignment - 1);
+    }
+
+    [[nodiscard]] size_t headerSize() const {
+        return sizeof(GeoImageHeader) + sections_.size() * sizeof(GeoImageSection);
+    }
+
+    std::vector<Section> sections_;
+};
+
+/*  mapped image, release() unmaps it when the last user is gone  */
+class GeoImage
+{
+public:
+
+    GeoImage(const char *p, size_t size, std::function<void()> release)
+        : p_(p), size_(size), release_(std::move(release)) {}
+    GeoImage(const GeoImage&) = delete;
+    GeoImage& operator=(const GeoImage&) = delete;
+
+    ~GeoImage() {
+        if (release_) {
+            release_();
+        }
+    }
+
+    [[nodiscard]] bool valid() const {
+        if (size_ < sizeof(GeoImageHeader)) {
+            return false;
+        }
+        const auto& h = header();
+        if (memcmp(h.magic, "GEODBIMG", sizeof(h.magic)) != 0 || h.version != GeoImageHeader::currentVersion
+                || h.size > size_ || sizeof(GeoImageHeader) + h.sectionCount * sizeof(GeoImageSection) > h.size) {
+            return false;
+        }
+        for (uint32_t i = 0; i < h.sectionCount; i++) {
+            const auto& s = table()[i];
+            if (s.offset > h.size || s.size > h.size - s.offset) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    [[nodiscard]] const GeoImageHeader& header() const {
+        return *reinterpret_cast<const GeoImageHeader *>(p_);
+    }
+
+    template <typename T>
+    bool attach(uint32_t id, GeoArray<T>& a) const {
+        const auto& h = header();
+        for (uint32_t i = 0; i < h.sectionCount; i++) {
+            const auto& s = table()[i];
+            if (s.id == id) {
+                if (s.size % sizeof(T) != 0) {
+                    return false;
+                }
+                a.attach(reinterpret_cast<const T *>(p_ + s.offset), s.size / sizeof(T));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    [[nodiscard]] const char *data() const { return p_; }
+    [[nodiscard]] size_t size() const { return size_; }
+
+private:
+
+    [[nodiscard]] const GeoImageSection *table() const {
+        return reinterpret_cast<const GeoImageSection *>(p_ + sizeof(GeoImageHeader));
+    }
+
+    const char *p_;
+    size_t size_;
+    std::function<void()> release_;
+};
+
+} // end of ggAdNet namespace
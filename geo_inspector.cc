@@ -0,0 +1,464 @@
+#include "geo_inspector.h"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <unordered_set>
+
+#include "base/exceptions.h"
+#include "base/file_utils.h"
+#include "base/log.h"
+#include "base/utils.h"
+
+using namespace ggAdNet;
+using namespace ggAdNet::Tools;
+
+namespace {
+
+typedef GeoReverseIndex::Key Key;
+
+const int32_t maxLatitude = 900000;     // degrees * 10000
+const int32_t maxLongitude = 1800000;
+const uint32_t flagLocated = 4;
+
+std::string
+address(Key key, unsigned int bits)
+{
+    char buf[INET6_ADDRSTRLEN];
+    if (bits == 32) {
+        uint32_t v4 = htonl(static_cast<uint32_t>(key));
+        inet_ntop(AF_INET, &v4, buf, sizeof(buf));
+    } else {
+        unsigned char v6[16];
+        for (int i = 0; i < 16; i++) {
+            v6[i] = static_cast<unsigned char>(key >> (120 - 8 * i));
+        }
+        inet_ntop(AF_INET6, v6, buf, sizeof(buf));
+    }
+    return buf;
+}
+
+/*  levels of the implicit search tree over n ranges  */
+unsigned int
+depth(size_t n)
+{
+    return n ? static_cast<unsigned int>(64 - __builtin_clzll(n)) : 0;
+}
+
+std::string
+jsonString(const std::string& s)
+{
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + "\"";
+}
+
+}
+
+GeoInspector::GeoInspector(std::string file)
+    : file_(std::move(file))
+{
+    config_ = Utils::loadJsonFile(configFile_);
+    initConfig(config_);
+    Log::init(config_);
+}
+
+GeoInspector::~GeoInspector()
+{
+    Log::clean();
+}
+
+void
+GeoInspector::initConfig(const rapidjson::Document& config)
+{
+    const auto& inspector = Utils::configSection(config, "inspector");
+    int maxReported = Utils::configInt(inspector, "max_reported", defaultMaxReported_);
+    int maxMemory = Utils::configInt(inspector, "max_memory_mb", 0);
+    int probes = Utils::configInt(inspector, "probes", defaultProbes_);
+    if (maxReported < 0 || maxMemory < 0 || probes < 0) {
+        throw ConfigException("inspector.max_reported, inspector.max_memory_mb and inspector.probes can't be negative");
+    }
+    maxReported_ = static_cast<size_t>(maxReported);
+    maxMemory_ = static_cast<size_t>(maxMemory) * 1024 * 1024;
+    probes_ = static_cast<size_t>(probes);
+    /*  the layout hosts run, as in their geodb section  */
+    if (config.HasMember("geodb")) {
+        const auto& geodb = config["geodb"];
+        auto flag = [&geodb](const char *name, bool& value) {
+            if (geodb.HasMember(name)) {
+                if (!geodb[name].IsBool()) {
+                    throw ConfigException(std::string("geodb.") + name + " must be a boolean");
+                }
+                value = geodb[name].GetBool();
+            }
+        };
+        flag("ipv6_compressed", configured_.ipv6Compressed);
+        flag("reverse_index", configured_.reverseIndex);
+        flag("attributes", configured_.attributes);
+        flag("spatial_index", configured_.spatialIndex);
+    }
+}
+
+bool
+GeoInspector::run()
+{
+    violations_.clear();
+    std::vector<Range> ipv4;
+    std::vector<Range> ipv6;
+    {
+        auto begin = Utils::nowMicros();
+        FileUtils::Mmap mmap(file_);
+        if (mmap.open() != FileUtils::Mmap::ReturnCode::SUCCESS || !mmap.ptr()) {
+            logError("can't mmap file %s", file_.c_str());
+            throw GeoInspectorException("can't mmap geodb file");
+        }
+        protobuf::Geo geo;
+        if (!geo.ParseFromArray(mmap.ptr(), static_cast<int>(mmap.size()))) {
+            logError("can't parse geodb file %s", file_.c_str());
+            throw GeoInspectorException("can't parse geodb file");
+        }
+        /*  a loading host holds the parsed message and the db being built at once  */
+        logInfo("%s: %zu bytes, parsed in %f sec into %zu bytes", file_.c_str(), mmap.size(),
+            (double) (Utils::nowMicros() - begin) / 1000000.0, static_cast<size_t>(geo.SpaceUsedLong()));
+        logInfo("countries: %d, states: %d, cities: %d, locales: %d, names: %d", geo.countries_size(), geo.states_size(),
+            geo.cities_size(), geo.locales_size(), geo.names_size());
+        logInfo("attributes: %d, postal codes: %d, city locations: %d, autonomous systems: %d", geo.attributes_size(),
+            geo.postal_codes_size(), geo.city_locations_size(), geo.asns_size());
+        ipv4.reserve(static_cast<size_t>(geo.ipsv4_size()));
+        for (const auto& e : geo.ipsv4()) {
+            ipv4.push_back({e.from(), e.to()});
+        }
+        ipv6.reserve(static_cast<size_t>(geo.ipsv6_size()));
+        size_t aligned = 0;
+        for (const auto& e : geo.ipsv6()) {
+            ipv6.push_back({static_cast<Key>(e.from_hi()) << 64 | e.from_lo(), static_cast<Key>(e.to_hi()) << 64 | e.to_lo()});
+            if (e.from_lo() == 0 && e.to_lo() == 0xffffffffffffffffULL) {
+                aligned++;
+            }
+        }
+        /*  as the db splits them, a miss in the /64 aligned index goes on to the longer one  */
+        logInfo("ipv4 ranges: %zu, ipv6 ranges: %zu /64 aligned, %zu longer", ipv4.size(), aligned, ipv6.size() - aligned);
+        logInfo("search depth: ipv4 %u levels, ipv6 %u levels then %u more", depth(ipv4.size()), depth(aligned),
+            depth(ipv6.size() - aligned));
+        checkRanges("ipv4", ipv4, 32);
+        checkRanges("ipv6", ipv6, 128);
+        checkIds(geo);
+        reportPrefixes("ipv4", ipv4, 32);
+        reportPrefixes("ipv6", ipv6, 128);
+        reportStrings(geo);
+    }
+    makeProbes(ipv4, ipv6);
+    std::vector<Range>().swap(ipv4);
+    std::vector<Range>().swap(ipv6);
+    /*  the plain layout, then what each option adds to it  */
+    static const Layout layouts[] = {
+        {"ranges", false, false, false, false},
+        {"ipv6 compressed", true, false, false, false},
+        {"reverse index", false, true, false, false},
+        {"attributes", false, false, true, false},
+        {"spatial index", false, false, false, true}
+    };
+    size_t base = 0;
+    for (const auto& layout : layouts) {
+        size_t memory = project(layout);
+        if (&layout == layouts) {
+            base = memory;
+        } else if (memory && base) {
+            logInfo("%s: %+lld bytes against ranges", layout.name, (long long) memory - (long long) base);
+        }
+    }
+    size_t memory = project(configured_);
+    if (maxMemory_ && memory > maxMemory_) {
+        if (violation("memory")) {
+            logError("configured layout takes %zu bytes, over inspector.max_memory_mb %zu", memory, maxMemory_ / 1024 / 1024);
+        }
+    }
+    size_t total = 0;
+    for (const auto& it : violations_) {
+        logError("%zu violations: %s", it.second, it.first.c_str());
+        total += it.second;
+    }
+    if (total) {
+        logError("%s is not fit to deploy, %zu violations", file_.c_str(), total);
+        return false;
+    }
+    logInfo("%s passed", file_.c_str());
+    return true;
+}
+
+bool
+GeoInspector::violation(const char *kind)
+{
+    return ++violations_[kind] <= maxReported_;
+}
+
+void
+GeoInspector::checkRanges(const char *family, const std::vector<Range>& ranges, unsigned int bits)
+{
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (ranges[i].from > ranges[i].to) {
+            if (violation("inverted range")) {
+                logError("%s range %zu ends at %s before its start %s", family, i, address(ranges[i].to, bits).c_str(),
+                    address(ranges[i].from, bits).c_str());
+            }
+        } else if (i > 0 && ranges[i].from < ranges[i - 1].from) {
+            if (violation("unsorted range")) {
+                logError("%s range %zu starts at %s before the previous one", family, i, address(ranges[i].from, bits).c_str());
+            }
+        }
+    }
+    /*  the index keeps the range ending first, lookups in the rest of an overlap miss  */
+    std::vector<size_t> order;
+    order.reserve(ranges.size());
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (ranges[i].from <= ranges[i].to) {
+            order.push_back(i);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&ranges](size_t a, size_t b) {
+        return ranges[a].from != ranges[b].from ? ranges[a].from < ranges[b].from : ranges[a].to < ranges[b].to;
+    });
+    size_t last = 0;                    // the one reaching farthest so far
+    for (size_t k = 0; k < order.size(); k++) {
+        size_t i = order[k];
+        if (k > 0 && ranges[i].from <= ranges[last].to) {
+            if (violation("overlapping ranges")) {
+                logError("%s ranges %zu and %zu overlap at %s", family, last, i, address(ranges[i].from, bits).c_str());
+            }
+        }
+        if (k == 0 || ranges[i].to > ranges[last].to) {
+            last = i;
+        }
+    }
+}
+
+void
+GeoInspector::checkIds(const protobuf::Geo& geo)
+{
+    auto table = [this, &geo](const char *name, const auto& items, std::unordered_set<uint32_t>& ids) {
+        for (const auto& item : items) {
+            if (!ids.insert(item.id()).second && violation("duplicate id")) {
+                logError("%s id %u is duplicated", name, item.id());
+            }
+            if (geo.locales_size() && item.names_size() != geo.locales_size() && violation("names per locale")) {
+                logError("%s id %u has %d names for %d locales", name, item.id(), item.names_size(), geo.locales_size());
+            }
+            for (uint32_t n : item.names()) {
+                if (static_cast<int>(n) >= geo.names_size() && violation("name index")) {
+                    logError("%s id %u names string %u of %d", name, item.id(), n, geo.names_size());
+                }
+            }
+        }
+    };
+    std::unordered_set<uint32_t> countries;
+    std::unordered_set<uint32_t> states;
+    std::unordered_set<uint32_t> cities;
+    table("country", geo.countries(), countries);
+    table("state", geo.states(), states);
+    table("city", geo.cities(), cities);
+    /*  tables are left out by db.geodb_store_names false, nothing to resolve ids against then  */
+    auto known = [](const std::unordered_set<uint32_t>& ids, uint32_t id) {
+        return id == 0 || ids.empty() || ids.count(id);
+    };
+    auto range = [&](const char *family, int i, const auto& e) {
+        if (!known(countries, e.country_id()) && violation("unknown country id")) {
+            logError("%s range %d has unknown country id %u", family, i, e.country_id());
+        }
+        if (!known(states, e.state_id()) && violation("unknown state id")) {
+            logError("%s range %d has unknown state id %u", family, i, e.state_id());
+        }
+        if (!known(cities, e.city_id()) && violation("unknown city id")) {
+            logError("%s range %d has unknown city id %u", family, i, e.city_id());
+        }
+        if (static_cast<int>(e.attributes()) > geo.attributes_size() && violation("attributes index")) {
+            logError("%s range %d has attributes %u of %d", family, i, e.attributes(), geo.attributes_size());
+        }
+        if (static_cast<int>(e.asn()) > geo.asns_size() && violation("asn index")) {
+            logError("%s range %d has autonomous system %u of %d", family, i, e.asn(), geo.asns_size());
+        }
+    };
+    for (int i = 0; i < geo.ipsv4_size(); i++) {
+        range("ipv4", i, geo.ipsv4(i));
+    }
+    for (int i = 0; i < geo.ipsv6_size(); i++) {
+        range("ipv6", i, geo.ipsv6(i));
+    }
+    for (int i = 0; i < geo.attributes_size(); i++) {
+        const auto& a = geo.attributes(i);
+        if (static_cast<int>(a.postal_code()) > geo.postal_codes_size() && violation("postal code index")) {
+            logError("attributes %d have postal code %u of %d", i + 1, a.postal_code(), geo.postal_codes_size());
+        }
+        if ((a.flags() & flagLocated) && (std::abs(a.latitude()) > maxLatitude || std::abs(a.longitude()) > maxLongitude)
+                && violation("coordinates")) {
+            logError("attributes %d are at %d, %d", i + 1, a.latitude(), a.longitude());
+        }
+    }
+    std::unordered_set<uint32_t> located;
+    for (const auto& c : geo.city_locations()) {
+        if (!located.insert(c.city_id()).second && violation("duplicate city location")) {
+            logError("city id %u is located twice", c.city_id());
+        }
+        if ((c.city_id() == 0 || !known(cities, c.city_id())) && violation("unknown city id")) {
+            logError("city location has unknown city id %u", c.city_id());
+        }
+        if ((std::abs(c.latitude()) > maxLatitude || std::abs(c.longitude()) > maxLongitude) && violation("coordinates")) {
+            logError("city id %u is at %d, %d", c.city_id(), c.latitude(), c.longitude());
+        }
+    }
+    for (const auto& c : geo.city_locations()) {
+        for (uint32_t neighbor : c.neighbors()) {
+            if (!located.count(neighbor) && violation("unknown neighbor")) {
+                logError("city id %u has neighbor %u with no location", c.city_id(), neighbor);
+            }
+        }
+    }
+}
+
+void
+GeoInspector::reportPrefixes(const char *family, const std::vector<Range>& ranges, unsigned int bits) const
+{
+    std::vector<size_t> lengths(bits + 1);
+    std::vector<GeoReverseIndex::Cidr> cidrs;
+    size_t exact = 0;
+    double addresses = 0.0;             // ipv6 in /64s
+    for (const auto& r : ranges) {
+        if (r.from > r.to) {
+            continue;
+        }
+        cidrs.clear();
+        GeoReverseIndex::cover(r, bits, cidrs);
+        for (const auto& cidr : cidrs) {
+            lengths[cidr.length]++;
+        }
+        exact += cidrs.size() == 1;
+        Key span = r.to - r.from;
+        addresses += bits == 32 ? (double) span + 1.0 : ((double) span + 1.0) / 18446744073709551616.0;
+    }
+    std::string distribution;
+    for (unsigned int length = 0; length <= bits; length++) {
+        if (lengths[length]) {
+            distribution += " /" + std::to_string(length) + ": " + std::to_string(lengths[length]);
+        }
+    }
+    logInfo("%s: %zu of %zu ranges are single prefixes, %.0f %s covered", family, exact, ranges.size(), addresses,
+        bits == 32 ? "addresses" : "/64s");
+    logInfo("%s prefixes covering the ranges by length:%s", family, distribution.empty() ? " none" : distribution.c_str());
+}
+
+void
+GeoInspector::reportStrings(const protobuf::Geo& geo) const
+{
+    /*  what the db keeps: distinct elements, their strings and postal codes in one pool  */
+    std::unordered_set<std::string> strings;
+    std::unordered_set<std::string> elements;
+    size_t poolBytes = 0;
+    size_t rangeBytes = 0;
+    auto intern = [&strings, &poolBytes](const std::string& s) {
+        if (strings.insert(s).second) {
+            poolBytes += s.size() + 1;
+        }
+    };
+    static const protobuf::Geo::Asn noAsn;
+    auto element = [&](const auto& e) {
+        const auto& a = e.asn() && static_cast<int>(e.asn()) <= geo.asns_size() ? geo.asns(static_cast<int>(e.asn() - 1)) : noAsn;
+        uint32_t ids[4] = {e.country_id(), e.state_id(), e.city_id(), a.number()};
+        std::string key(reinterpret_cast<const char *>(ids), sizeof(ids));
+        for (const std::string *s : {&e.country_key(), &e.state_key(), &e.city_name(), &a.organization()}) {
+            key += *s;
+            key += '\0';
+            intern(*s);
+            rangeBytes += s->size();
+        }
+        elements.insert(key);
+    };
+    for (const auto& e : geo.ipsv4()) {
+        element(e);
+    }
+    for (const auto& e : geo.ipsv6()) {
+        element(e);
+    }
+    for (const auto& postalCode : geo.postal_codes()) {
+        intern(postalCode);
+    }
+    size_t nameBytes = 0;
+    for (const auto& name : geo.names()) {
+        nameBytes += name.size();
+    }
+    logInfo("%zu distinct elements, string pool: %zu distinct strings in %zu bytes, %zu bytes spelled out by ranges",
+        elements.size(), strings.size(), poolBytes, rangeBytes);
+    logInfo("names: %d strings in %zu bytes", geo.names_size(), nameBytes);
+}
+
+void
+GeoInspector::makeProbes(const std::vector<Range>& ipv4, const std::vector<Range>& ipv6)
+{
+    /*  uniform over ranges, then over the addresses of the range, the same set for every layout  */
+    std::mt19937_64 random(1);
+    auto probe = [&random](const std::vector<Range>& ranges) {
+        const Range& r = ranges[random() % ranges.size()];
+        if (r.from > r.to) {
+            return r.from;
+        }
+        Key span = r.to - r.from;
+        Key x = static_cast<Key>(random()) << 64 | random();
+        return r.from + (span == ~static_cast<Key>(0) ? x : x % (span + 1));
+    };
+    ipv4Probes_.clear();
+    ipv6Probes_.clear();
+    for (size_t i = 0; i < probes_ && !ipv4.empty(); i++) {
+        ipv4Probes_.push_back(static_cast<GeoDb::IPv4>(probe(ipv4)));
+    }
+    for (size_t i = 0; i < probes_ && !ipv6.empty(); i++) {
+        Key key = probe(ipv6);
+        ipv6Probes_.emplace_back(static_cast<uint64_t>(key >> 64), static_cast<uint64_t>(key));
+    }
+}
+
+size_t
+GeoInspector::project(const Layout& layout)
+{
+    std::string json = "{\"geodb\": {\"file\": " + jsonString(file_) + ", \"format\": \"protobuf\""
+        + ", \"ipv6_compressed\": " + (layout.ipv6Compressed ? "true" : "false")
+        + ", \"reverse_index\": " + (layout.reverseIndex ? "true" : "false")
+        + ", \"attributes\": " + (layout.attributes ? "true" : "false")
+        + ", \"spatial_index\": " + (layout.spatialIndex ? "true" : "false") + "}}";
+    rapidjson::Document config;
+    if (config.Parse(json.c_str()).HasParseError()) {
+        throw GeoInspectorException("bad layout config");
+    }
+    try {
+        auto begin = Utils::nowMicros();
+        auto geodb = GeoDb::open(config);
+        double seconds = (double) (Utils::nowMicros() - begin) / 1000000.0;
+        size_t memory = geodb->stats().memory;
+        /*  found ids are summed so the lookups can't be dropped  */
+        uint64_t sum = 0;
+        begin = Utils::nowMicros();
+        for (auto ip : ipv4Probes_) {
+            sum += geodb->getIpv4(ip).countryId;
+        }
+        auto ipv4Micros = Utils::nowMicros() - begin;
+        begin = Utils::nowMicros();
+        for (const auto& ip : ipv6Probes_) {
+            sum += geodb->getIpv6(ip).countryId;
+        }
+        auto ipv6Micros = Utils::nowMicros() - begin;
+        logInfo("%s layout: %zu bytes, loaded in %f sec, %.1f ns per ipv4 lookup, %.1f ns per ipv6 lookup (%llu)",
+            layout.name, memory, seconds,
+            ipv4Probes_.empty() ? 0.0 : (double) ipv4Micros * 1000.0 / (double) ipv4Probes_.size(),
+            ipv6Probes_.empty() ? 0.0 : (double) ipv6Micros * 1000.0 / (double) ipv6Probes_.size(), (unsigned long long) sum);
+        return memory;
+    } catch (const std::exception& e) {
+        if (violation("load")) {
+            logError("can't load %s with the %s layout: %s", file_.c_str(), layout.name, e.what());
+        }
+        return 0;
+    }
+}
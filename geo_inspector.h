@@ -0,0 +1,81 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "rapidjson/document.h"
+
+#include "base/geo_db.h"
+#include "base/geo_reverse_index.h"
+#include "protobuf/geo.pb.h"
+
+namespace ggAdNet {
+namespace Tools {
+
+class GeoInspectorException: public std::runtime_error
+{
+public:
+    explicit GeoInspectorException(const std::string& what) : std::runtime_error(what) {};
+    explicit GeoInspectorException(const char *what) : std::runtime_error(what) {};
+};
+
+/*
+ *  Deploy gate for a protobuf geodb file: reports record counts, the prefix length
+ *  distribution, address coverage and the string pool, validates that ranges are sorted,
+ *  well formed and disjoint and that ids and indexes resolve, then loads the file with
+ *  every index layout through GeoDb::open() to report the memory it takes and the time
+ *  a lookup takes. run() is false on any violation, the configured layout over
+ *  inspector.max_memory_mb included.
+ */
+class GeoInspector
+{
+public:
+
+    explicit GeoInspector(std::string file);
+    ~GeoInspector();
+    [[nodiscard]] bool run();
+
+private:
+
+    typedef GeoReverseIndex::Key Key;
+    typedef GeoReverseIndex::Range Range;
+
+    struct Layout {
+        const char *name;
+        bool ipv6Compressed;
+        bool reverseIndex;
+        bool attributes;
+        bool spatialIndex;
+    };
+
+    void initConfig(const rapidjson::Document& config);
+    /*  counts a violation, true while it is still to be logged  */
+    bool violation(const char *kind);
+    void checkRanges(const char *family, const std::vector<Range>& ranges, unsigned int bits);
+    void checkIds(const protobuf::Geo& geo);
+    void reportPrefixes(const char *family, const std::vector<Range>& ranges, unsigned int bits) const;
+    void reportStrings(const protobuf::Geo& geo) const;
+    void makeProbes(const std::vector<Range>& ipv4, const std::vector<Range>& ipv6);
+    /*  memory of the db built with layout, 0 if it can't be loaded  */
+    size_t project(const Layout& layout);
+
+    const std::string configFile_ = "geo_inspector.conf";
+    const int defaultMaxReported_ = 10;
+    const int defaultProbes_ = 1000000;
+
+    std::string file_;
+    /*  config  */
+    rapidjson::Document config_;
+    size_t maxReported_{0};             // violations logged per kind
+    size_t maxMemory_{0};               // bytes, 0 for no limit
+    size_t probes_{0};                  // lookups timed per family and layout
+    Layout configured_{"configured", false, false, false, false};
+    /**/
+    std::map<std::string, size_t> violations_;
+    std::vector<GeoDb::IPv4> ipv4Probes_;
+    std::vector<GeoDb::IPv6> ipv6Probes_;
+};
+
+} // end of Tools namespace
+} // end of ggAdNet namespace
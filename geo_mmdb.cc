@@ -0,0 +1,676 @@
+#include "geo_mmdb.h"
+
+#include <cstring>
+#include <ctime>
+
+#include <unistd.h>
+
+#include "cstring.h"
+#include "file_utils.h"
+#include "iso2Toiso3.h"
+#include "utils.h"
+
+using namespace ggAdNet;
+
+namespace {
+
+const uint8_t metadataMarker[] = "\xab\xcd\xefMaxMind.com";
+const size_t metadataMarkerSize = sizeof(metadataMarker) - 1;
+const size_t metadataMaxSize = 128 * 1024;
+const size_t dataSeparatorSize = 16;
+const int maxPointerDepth = 2;
+
+}
+
+GeoMmdb::GeoMmdb(const std::string& file)
+    : file_(file), tree_(nullptr), data_(nullptr), dataEnd_(nullptr), nodeCount_(0),
+    recordSize_(0), nodeSize_(0), ipVersion_(0), ipv4Start_(0)
+{
+    mmap_ = std::make_unique<FileUtils::Mmap>(file_);
+    if (mmap_->open() != FileUtils::Mmap::ReturnCode::SUCCESS) {
+        logError("can't mmap file %s", file_.c_str());
+        throw GeoDbException("can't mmap file");
+    }
+    const auto *p = reinterpret_cast<const uint8_t *>(mmap_->ptr());
+    if (!p) {
+        logError("file %s is empty", file_.c_str());
+        throw GeoDbException("mmdb file is empty");
+    }
+    const uint8_t *end = p + mmap_->size();
+    /*  metadata follows the last marker within the tail of the file  */
+    const uint8_t *from = mmap_->size() > metadataMaxSize ? end - metadataMaxSize : p;
+    const uint8_t *metadata = nullptr;
+    for (const uint8_t *m = end - metadataMarkerSize; m >= from; m--) {
+        if (memcmp(m, metadataMarker, metadataMarkerSize) == 0) {
+            metadata = m + metadataMarkerSize;
+            break;
+        }
+    }
+    if (!metadata) {
+        logError("no mmdb metadata in file %s", file_.c_str());
+        throw GeoDbException("bad mmdb file");
+    }
+    readMetadata(metadata, end);
+    /**/
+    size_t treeSize = static_cast<size_t>(nodeCount_) * nodeSize_;
+    if (treeSize + dataSeparatorSize > static_cast<size_t>(metadata - metadataMarkerSize - p)) {
+        logError("mmdb search tree exceeds file %s", file_.c_str());
+        throw GeoDbException("bad mmdb file");
+    }
+    tree_ = p;
+    data_ = p + treeSize + dataSeparatorSize;
+    dataEnd_ = metadata - metadataMarkerSize;
+    /*  ipv4 addresses live under ::/96  */
+    ipv4Start_ = 0;
+    if (ipVersion_ == 6) {
+        for (int i = 0; i < 96 && ipv4Start_ < nodeCount_; i++) {
+            ipv4Start_ = record(ipv4Start_, 0);
+        }
+    }
+    logInfo("mmdb %s: %u nodes, record size %u, ip version %u", file_.c_str(), nodeCount_, recordSize_, ipVersion_);
+}
+
+void
+GeoMmdb::readMetadata(const uint8_t *p, const uint8_t *end)
+{
+    Value map;
+    if (!decode(p, p, end, map) || map.type != t_map) {
+        logError("bad mmdb metadata in file %s", file_.c_str());
+        throw GeoDbException("bad mmdb file");
+    }
+    Value v;
+    if (!mapGet(map, "node_count", p, end, v)) {
+        throw GeoDbException("no node_count in mmdb metadata");
+    }
+    nodeCount_ = static_cast<uint32_t>(toUint(v));
+    if (!mapGet(map, "record_size", p, end, v)) {
+        throw GeoDbException("no record_size in mmdb metadata");
+    }
+    recordSize_ = static_cast<unsigned int>(toUint(v));
+    if (recordSize_ != 24 && recordSize_ != 28 && recordSize_ != 32) {
+        logError("unsupported mmdb record size %u in file %s", recordSize_, file_.c_str());
+        throw GeoDbException("unsupported mmdb record size");
+    }
+    nodeSize_ = recordSize_ / 4;
+    if (!mapGet(map, "ip_version", p, end, v)) {
+        throw GeoDbException("no ip_version in mmdb metadata");
+    }
+    ipVersion_ = static_cast<unsigned int>(toUint(v));
+    if (ipVersion_ != 4 && ipVersion_ != 6) {
+        logError("unsupported mmdb ip version %u in file %s", ipVersion_, file_.c_str());
+        throw GeoDbException("unsupported mmdb ip version");
+    }
+}
+
+const uint8_t *
+GeoMmdb::decode(const uint8_t *p, const uint8_t *base, const uint8_t *end, Value& v, int depth) const
+{
+    if (p >= end) {
+        return nullptr;
+    }
+    uint8_t ctrl = *p++;
+    unsigned int type = ctrl >> 5;
+    if (type == t_pointer) {
+        unsigned int ss = (ctrl >> 3) & 0x3;
+        if (p + ss + 1 > end || depth >= maxPointerDepth) {
+            return nullptr;
+        }
+        uint32_t off;
+        uint32_t vvv = ctrl & 0x7;
+        switch (ss) {
+            case 0:
+                off = vvv << 8 | p[0];
+                break;
+            case 1:
+                off = (vvv << 16 | (uint32_t) p[0] << 8 | p[1]) + 2048;
+                break;
+            case 2:
+                off = (vvv << 24 | (uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | p[2]) + 526336;
+                break;
+            default:
+                off = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+                break;
+        }
+        if (off >= static_cast<size_t>(end - base) || !decode(base + off, base, end, v, depth + 1)) {
+            return nullptr;
+        }
+        v.pointer = true;
+        return p + ss + 1;
+    }
+    if (type == t_extended) {
+        if (p >= end) {
+            return nullptr;
+        }
+        type = 7 + *p++;
+    }
+    uint32_t size = ctrl & 0x1f;
+    if (size >= 29) {
+        unsigned int n = size - 28;
+        if (p + n > end) {
+            return nullptr;
+        }
+        switch (n) {
+            case 1:
+                size = 29 + p[0];
+                break;
+            case 2:
+                size = 285 + ((uint32_t) p[0] << 8 | p[1]);
+                break;
+            default:
+                size = 65821 + ((uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | p[2]);
+                break;
+        }
+        p += n;
+    }
+    v.type = type;
+    v.size = size;
+    v.p = p;
+    v.pointer = false;
+    switch (type) {
+        case t_map:
+        case t_array:
+            return p;
+        case t_boolean:
+            /*  value is the size itself  */
+            return p;
+        default:
+            if (p + size > end) {
+                return nullptr;
+            }
+            return p + size;
+    }
+}
+
+const uint8_t *
+GeoMmdb::skip(const uint8_t *p, const uint8_t *base, const uint8_t *end) const
+{
+    Value v;
+    p = decode(p, base, end, v);
+    if (!p || v.pointer) {
+        return p;
+    }
+    if (v.type == t_map) {
+        for (uint32_t i = 0; p && i < v.size * 2; i++) {
+            p = skip(p, base, end);
+        }
+    } else if (v.type == t_array) {
+        for (uint32_t i = 0; p && i < v.size; i++) {
+            p = skip(p, base, end);
+        }
+    }
+    return p;
+}
+
+bool
+GeoMmdb::mapGet(const Value& map, const char *key, const uint8_t *base, const uint8_t *end, Value& v) const
+{
+    if (map.type != t_map) {
+        return false;
+    }
+    size_t keySize = strlen(key);
+    const uint8_t *p = map.p;
+    for (uint32_t i = 0; i < map.size; i++) {
+        Value k;
+        p = decode(p, base, end, k);
+        if (!p || k.type != t_string) {
+            return false;
+        }
+        if (k.size == keySize && memcmp(k.p, key, keySize) == 0) {
+            return decode(p, base, end, v) != nullptr;
+        }
+        p = skip(p, base, end);
+        if (!p) {
+            return false;
+        }
+    }
+    return false;
+}
+
+uint64_t
+GeoMmdb::toUint(const Value& v) const
+{
+    switch (v.type) {
+        case t_uint16:
+        case t_uint32:
+        case t_uint64:
+        case t_uint128:
+        case t_int32:
+            {
+                uint64_t r = 0;
+                /*  uint128 values above 64 bits are not used for anything we map  */
+                for (uint32_t i = v.size > 8 ? v.size - 8 : 0; i < v.size; i++) {
+                    r = (r << 8) | v.p[i];
+                }
+                return r;
+            }
+        case t_boolean:
+            return v.size;
+        default:
+            return 0;
+    }
+}
+
+GeoDb::Element
+GeoMmdb::element(uint32_t node) const
+{
+    GeoDb::Element el;
+    if (node <= nodeCount_) {
+        /*  node == nodeCount_ means no data  */
+        return el;
+    }
+    size_t off = node - nodeCount_ - dataSeparatorSize;
+    if (off >= static_cast<size_t>(dataEnd_ - data_)) {
+        return el;
+    }
+    Value record;
+    if (!decode(data_ + off, data_, dataEnd_, record) || record.type != t_map) {
+        return el;
+    }
+    Value v;
+    /*  same keys in GeoParser output and vendor asn databases  */
+    if (mapGet(record, "autonomous_system_number", data_, dataEnd_, v)) {
+        el.asn = static_cast<unsigned int>(toUint(v));
+    }
+    if (mapGet(record, "autonomous_system_organization", data_, dataEnd_, v) && v.type == t_string) {
+        el.asnOrg.assign(reinterpret_cast<const char *>(v.p), static_cast<int>(v.size));
+    }
+    if (mapGet(record, "country_id", data_, dataEnd_, v)) {
+        /*  written by GeoParser  */
+        el.countryId = static_cast<unsigned int>(toUint(v));
+        if (mapGet(record, "state_id", data_, dataEnd_, v)) {
+            el.stateId = static_cast<unsigned int>(toUint(v));
+        }
+        if (mapGet(record, "city_id", data_, dataEnd_, v)) {
+            el.cityId = static_cast<unsigned int>(toUint(v));
+        }
+        if (mapGet(record, "country_key", data_, dataEnd_, v) && v.type == t_string) {
+            el.countryKey.assign(reinterpret_cast<const char *>(v.p), static_cast<int>(v.size));
+        }
+        if (mapGet(record, "state_key", data_, dataEnd_, v) && v.type == t_string) {
+            el.stateKey.assign(reinterpret_cast<const char *>(v.p), static_cast<int>(v.size));
+        }
+        if (mapGet(record, "city_name", data_, dataEnd_, v) && v.type == t_string) {
+            el.cityName.assign(reinterpret_cast<const char *>(v.p), static_cast<int>(v.size));
+        }
+        return el;
+    }
+    /*  vendor layout, no ids  */
+    Value m;
+    if ((mapGet(record, "country", data_, dataEnd_, m) || mapGet(record, "registered_country", data_, dataEnd_, m))
+            && mapGet(m, "iso_code", data_, dataEnd_, v) && v.type == t_string) {
+        auto it = codeTransf.find(std::string(reinterpret_cast<const char *>(v.p), v.size));
+        if (it != codeTransf.end()) {
+            el.countryKey.assign(it->second.data(), static_cast<int>(it->second.size()));
+        }
+    }
+    if (mapGet(record, "subdivisions", data_, dataEnd_, m) && m.type == t_array && m.size > 0) {
+        Value sub;
+        if (decode(m.p, data_, dataEnd_, sub) && mapGet(sub, "iso_code", data_, dataEnd_, v) && v.type == t_string) {
+            el.stateKey.assign(reinterpret_cast<const char *>(v.p), static_cast<int>(v.size));
+        }
+    }
+    Value names;
+    if (mapGet(record, "city", data_, dataEnd_, m) && mapGet(m, "names", data_, dataEnd_, names)
+            && mapGet(names, "en", data_, dataEnd_, v) && v.type == t_string) {
+        el.cityName.assign(reinterpret_cast<const char *>(v.p), static_cast<int>(v.size));
+    }
+    return el;
+}
+
+GeoDb::Element
+GeoMmdb::find(GeoDb::IPv4 ip) const
+{
+    uint32_t node = ipv4Start_;
+    for (int i = 31; i >= 0 && node < nodeCount_; i--) {
+        node = record(node, (ip >> i) & 1);
+    }
+    return element(node);
+}
+
+GeoDb::Element
+GeoMmdb::find(const GeoDb::IPv6& ip) const
+{
+    if (ipVersion_ == 4) {
+        return {};
+    }
+    uint32_t node = 0;
+    for (int i = 63; i >= 0 && node < nodeCount_; i--) {
+        node = record(node, (ip.hi >> i) & 1);
+    }
+    for (int i = 63; i >= 0 && node < nodeCount_; i--) {
+        node = record(node, (ip.lo >> i) & 1);
+    }
+    return element(node);
+}
+
+GeoMmdbWriter::GeoMmdbWriter(std::string databaseType, std::string description)
+    : databaseType_(std::move(databaseType)), description_(std::move(description)), recordSize_(0)
+{
+    nodes_.push_back({{empty_, empty_}});
+}
+
+void
+GeoMmdbWriter::insert(GeoDb::IPv4 from, GeoDb::IPv4 to, const GeoDb::Element& el)
+{
+    insertRange(from, to, addRecord(el));
+}
+
+void
+GeoMmdbWriter::insert(const GeoDb::IPv6& from, const GeoDb::IPv6& to, const GeoDb::Element& el)
+{
+    insertRange((Ip) from.hi << 64 | from.lo, (Ip) to.hi << 64 | to.lo, addRecord(el));
+}
+
+void
+GeoMmdbWriter::insertRange(Ip from, Ip to, uint32_t record)
+{
+    /*  split into the largest aligned networks  */
+    while (from <= to) {
+        unsigned int k = 0;
+        while (k < 128 && !((from >> k) & 1)) {
+            k++;
+        }
+        while (k > 0 && (k == 128 || from + (((Ip) 1 << k) - 1) > to)) {
+            if (k == 128 && from == 0 && to == ~(Ip) 0) {
+                break;
+            }
+            k--;
+        }
+        insertNetwork(from, 128 - k, dataRef_ | record);
+        if (k == 128) {
+            break;
+        }
+        Ip next = from + ((Ip) 1 << k);
+        if (next == 0) {
+            break;
+        }
+        from = next;
+    }
+}
+
+uint32_t
+GeoMmdbWriter::path(Ip net, unsigned int prefix)
+{
+    /*  node owning the last bit of the prefix, created on the way  */
+    uint32_t node = 0;
+    for (unsigned int i = 0; i + 1 < prefix; i++) {
+        unsigned int bit = (net >> (127 - i)) & 1;
+        uint32_t child = nodes_[node].child[bit];
+        if (child == empty_ || (child & dataRef_)) {
+            /*  split a shorter network covering this one  */
+            auto n = static_cast<uint32_t>(nodes_.size());
+            nodes_.push_back({{child, child}});
+            nodes_[node].child[bit] = n;
+            child = n;
+        }
+        node = child;
+    }
+    return node;
+}
+
+void
+GeoMmdbWriter::insertNetwork(Ip net, unsigned int prefix, uint32_t value)
+{
+    if (prefix == 0) {
+        nodes_[0].child[0] = nodes_[0].child[1] = value;
+        return;
+    }
+    uint32_t node = path(net, prefix);
+    nodes_[node].child[(net >> (128 - prefix)) & 1] = value;
+}
+
+uint32_t
+GeoMmdbWriter::addRecord(const GeoDb::Element& el)
+{
+    std::string key = std::to_string(el.countryId) + ':' + std::to_string(el.stateId) + ':' + std::to_string(el.cityId);
+    key.push_back('\0');
+    key.append(el.countryKey.data, el.countryKey.size);
+    key.push_back('\0');
+    key.append(el.stateKey.data, el.stateKey.size);
+    key.push_back('\0');
+    key.append(el.cityName.data, el.cityName.size);
+    if (el.asn) {
+        key.push_back('\0');
+        key.append(std::to_string(el.asn));
+        key.push_back('\0');
+        key.append(el.asnOrg.data, el.asnOrg.size);
+    }
+    auto it = records_.find(key);
+    if (it != records_.end()) {
+        return it->second;
+    }
+    auto id = static_cast<uint32_t>(recordOffsets_.size());
+    recordOffsets_.push_back(static_cast<uint32_t>(data_.size()));
+    writeControl(data_, GeoMmdb::t_map, el.asn ? 8 : 6);
+    writeDataString("country_id", 10);
+    writeUint(data_, GeoMmdb::t_uint32, el.countryId);
+    writeDataString("state_id", 8);
+    writeUint(data_, GeoMmdb::t_uint32, el.stateId);
+    writeDataString("city_id", 7);
+    writeUint(data_, GeoMmdb::t_uint32, el.cityId);
+    writeDataString("country_key", 11);
+    writeDataString(el.countryKey.data, el.countryKey.size);
+    writeDataString("state_key", 9);
+    writeDataString(el.stateKey.data, el.stateKey.size);
+    writeDataString("city_name", 9);
+    writeDataString(el.cityName.data, el.cityName.size);
+    if (el.asn) {
+        writeDataString("autonomous_system_number", 24);
+        writeUint(data_, GeoMmdb::t_uint32, el.asn);
+        writeDataString("autonomous_system_organization", 30);
+        writeDataString(el.asnOrg.data, el.asnOrg.size);
+    }
+    records_.emplace(std::move(key), id);
+    return id;
+}
+
+void
+GeoMmdbWriter::writeControl(std::string& out, unsigned int type, uint32_t size)
+{
+    uint8_t ctrl = type <= 7 ? static_cast<uint8_t>(type << 5) : 0;
+    uint8_t extra[3];
+    unsigned int n = 0;
+    if (size < 29) {
+        ctrl |= size;
+    } else if (size < 285) {
+        ctrl |= 29;
+        extra[n++] = static_cast<uint8_t>(size - 29);
+    } else if (size < 65821) {
+        ctrl |= 30;
+        size -= 285;
+        extra[n++] = static_cast<uint8_t>(size >> 8);
+        extra[n++] = static_cast<uint8_t>(size);
+    } else {
+        ctrl |= 31;
+        size -= 65821;
+        extra[n++] = static_cast<uint8_t>(size >> 16);
+        extra[n++] = static_cast<uint8_t>(size >> 8);
+        extra[n++] = static_cast<uint8_t>(size);
+    }
+    out.push_back(static_cast<char>(ctrl));
+    if (type > 7) {
+        out.push_back(static_cast<char>(type - 7));
+    }
+    out.append(reinterpret_cast<const char *>(extra), n);
+}
+
+void
+GeoMmdbWriter::writeUint(std::string& out, unsigned int type, uint64_t v)
+{
+    unsigned int n = 0;
+    while (n < 8 && (v >> (n * 8)) != 0) {
+        n++;
+    }
+    writeControl(out, type, n);
+    while (n > 0) {
+        n--;
+        out.push_back(static_cast<char>(v >> (n * 8)));
+    }
+}
+
+void
+GeoMmdbWriter::writeString(std::string& out, const char *p, size_t size)
+{
+    writeControl(out, GeoMmdb::t_string, static_cast<uint32_t>(size));
+    out.append(p, size);
+}
+
+void
+GeoMmdbWriter::writePointer(std::string& out, uint32_t offset)
+{
+    if (offset < 2048) {
+        out.push_back(static_cast<char>(0x20 | (offset >> 8)));
+        out.push_back(static_cast<char>(offset));
+    } else if (offset < 526336) {
+        offset -= 2048;
+        out.push_back(static_cast<char>(0x28 | (offset >> 16)));
+        out.push_back(static_cast<char>(offset >> 8));
+        out.push_back(static_cast<char>(offset));
+    } else if (offset < 134744064) {
+        offset -= 526336;
+        out.push_back(static_cast<char>(0x30 | (offset >> 24)));
+        out.push_back(static_cast<char>(offset >> 16));
+        out.push_back(static_cast<char>(offset >> 8));
+        out.push_back(static_cast<char>(offset));
+    } else {
+        out.push_back(static_cast<char>(0x38));
+        out.push_back(static_cast<char>(offset >> 24));
+        out.push_back(static_cast<char>(offset >> 16));
+        out.push_back(static_cast<char>(offset >> 8));
+        out.push_back(static_cast<char>(offset));
+    }
+}
+
+void
+GeoMmdbWriter::writeDataString(const char *p, size_t size)
+{
+    /*  repeated strings longer than a pointer are stored once  */
+    if (size < 3) {
+        writeString(data_, p, size);
+        return;
+    }
+    std::string s(p, size);
+    auto it = strings_.find(s);
+    if (it != strings_.end()) {
+        writePointer(data_, it->second);
+        return;
+    }
+    strings_.emplace(std::move(s), static_cast<uint32_t>(data_.size()));
+    writeString(data_, p, size);
+}
+
+std::string
+GeoMmdbWriter::metadata() const
+{
+    std::string m;
+    writeControl(m, GeoMmdb::t_map, 9);
+    writeString(m, "binary_format_major_version", 27);
+    writeUint(m, GeoMmdb::t_uint16, 2);
+    writeString(m, "binary_format_minor_version", 27);
+    writeUint(m, GeoMmdb::t_uint16, 0);
+    writeString(m, "build_epoch", 11);
+    writeUint(m, GeoMmdb::t_uint64, static_cast<uint64_t>(time(nullptr)));
+    writeString(m, "database_type", 13);
+    writeString(m, databaseType_.data(), databaseType_.size());
+    writeString(m, "description", 11);
+    writeControl(m, GeoMmdb::t_map, 1);
+    writeString(m, "en", 2);
+    writeString(m, description_.data(), description_.size());
+    writeString(m, "ip_version", 10);
+    writeUint(m, GeoMmdb::t_uint16, 6);
+    writeString(m, "languages", 9);
+    writeControl(m, GeoMmdb::t_array, 1);
+    writeString(m, "en", 2);
+    writeString(m, "node_count", 10);
+    writeUint(m, GeoMmdb::t_uint32, nodes_.size());
+    writeString(m, "record_size", 11);
+    writeUint(m, GeoMmdb::t_uint16, recordSize_);
+    return m;
+}
+
+bool
+GeoMmdbWriter::save(const std::string& file)
+{
+    /*  ipv4 aliases point to the ::/96 node  */
+    uint32_t ipv4Root = path(0, 97);
+    insertNetwork((Ip) 0xffff << 32, 96, ipv4Root);
+    insertNetwork((Ip) 0x2002 << 112, 16, ipv4Root);
+    /*  pick the smallest record size  */
+    auto nodeCount = static_cast<uint64_t>(nodes_.size());
+    uint64_t maxValue = nodeCount + 16 + data_.size();
+    recordSize_ = maxValue < (1ULL << 24) ? 24 : maxValue < (1ULL << 28) ? 28 : 32;
+    if (maxValue >= (1ULL << 32)) {
+        logError("mmdb %s is too large", file.c_str());
+        return false;
+    }
+    auto value = [this, nodeCount](uint32_t child) -> uint32_t {
+        if (child == empty_) {
+            return static_cast<uint32_t>(nodeCount);
+        }
+        if (child & dataRef_) {
+            return static_cast<uint32_t>(nodeCount + 16 + recordOffsets_[child & ~dataRef_]);
+        }
+        return child;
+    };
+    std::string tree;
+    tree.reserve(nodes_.size() * recordSize_ / 4);
+    for (const auto& node : nodes_) {
+        uint32_t l = value(node.child[0]);
+        uint32_t r = value(node.child[1]);
+        switch (recordSize_) {
+            case 24:
+                tree.push_back(static_cast<char>(l >> 16));
+                tree.push_back(static_cast<char>(l >> 8));
+                tree.push_back(static_cast<char>(l));
+                tree.push_back(static_cast<char>(r >> 16));
+                tree.push_back(static_cast<char>(r >> 8));
+                tree.push_back(static_cast<char>(r));
+                break;
+            case 28:
+                tree.push_back(static_cast<char>(l >> 16));
+                tree.push_back(static_cast<char>(l >> 8));
+                tree.push_back(static_cast<char>(l));
+                tree.push_back(static_cast<char>(((l >> 20) & 0xf0) | ((r >> 24) & 0x0f)));
+                tree.push_back(static_cast<char>(r >> 16));
+                tree.push_back(static_cast<char>(r >> 8));
+                tree.push_back(static_cast<char>(r));
+                break;
+            default:
+                for (int i = 24; i >= 0; i -= 8) {
+                    tree.push_back(static_cast<char>(l >> i));
+                }
+                for (int i = 24; i >= 0; i -= 8) {
+                    tree.push_back(static_cast<char>(r >> i));
+                }
+                break;
+        }
+    }
+    /*  write aside and rename  */
+    std::string tmp = file + ".tmp";
+    FILE *fd = fopen(tmp.c_str(), "wb");
+    if (!fd) {
+        logError("can't fopen %s for writing", tmp.c_str());
+        return false;
+    }
+    std::string separator(dataSeparatorSize, '\0');
+    std::string meta = metadata();
+    bool ok = fwrite(tree.data(), 1, tree.size(), fd) == tree.size()
+        && fwrite(separator.data(), 1, separator.size(), fd) == separator.size()
+        && fwrite(data_.data(), 1, data_.size(), fd) == data_.size()
+        && fwrite(metadataMarker, 1, metadataMarkerSize, fd) == metadataMarkerSize
+        && fwrite(meta.data(), 1, meta.size(), fd) == meta.size();
+    if (fclose(fd) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        logError("can't write %s, error: %s (%d)", tmp.c_str(), strerror(errno), errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    if (rename(tmp.c_str(), file.c_str()) != 0) {
+        logError("can't rename %s to %s, error: %s (%d)", tmp.c_str(), file.c_str(), strerror(errno), errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
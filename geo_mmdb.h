@@ -0,0 +1,154 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "file_utils.h"
+#include "geo_db.h"
+
+namespace ggAdNet {
+
+/*
+ *  MaxMind DB (mmdb) reader, lookups traverse the binary search tree of the mmapped
+ *  file in place and decode only the fields mapped onto GeoDb::Element.
+ *  Files written by GeoParser carry our ids and keys at the top level of each record,
+ *  vendor files (GeoLite2-City.mmdb) are mapped by iso codes and english city names.
+ */
+class GeoMmdb
+{
+public:
+
+    explicit GeoMmdb(const std::string& file);
+    GeoMmdb(const GeoMmdb&) = delete;
+    GeoMmdb& operator=(const GeoMmdb&) = delete;
+
+    [[nodiscard]] GeoDb::Element find(GeoDb::IPv4 ip) const;
+    [[nodiscard]] GeoDb::Element find(const GeoDb::IPv6& ip) const;
+
+    [[nodiscard]] uint32_t nodeCount() const { return nodeCount_; }
+    [[nodiscard]] unsigned int ipVersion() const { return ipVersion_; }
+
+    enum Type {
+        t_extended = 0,
+        t_pointer = 1,
+        t_string = 2,
+        t_double = 3,
+        t_bytes = 4,
+        t_uint16 = 5,
+        t_uint32 = 6,
+        t_map = 7,
+        t_int32 = 8,
+        t_uint64 = 9,
+        t_uint128 = 10,
+        t_array = 11,
+        t_container = 12,
+        t_end = 13,
+        t_boolean = 14,
+        t_float = 15
+    };
+
+private:
+
+    struct Value {
+        unsigned int type;
+        uint32_t size;
+        const uint8_t *p;       // payload, first entry for maps and arrays
+        bool pointer;
+
+        Value() : type(0), size(0), p(nullptr), pointer(false) {}
+    };
+
+    [[nodiscard]] uint32_t record(uint32_t node, unsigned int bit) const {
+        const uint8_t *p = tree_ + static_cast<size_t>(node) * nodeSize_;
+        switch (recordSize_) {
+            case 24:
+                p += bit * 3;
+                return (uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | p[2];
+            case 28:
+                if (bit) {
+                    return ((uint32_t) (p[3] & 0x0f) << 24) | (uint32_t) p[4] << 16 | (uint32_t) p[5] << 8 | p[6];
+                }
+                return ((uint32_t) (p[3] & 0xf0) << 20) | (uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | p[2];
+            default:
+                p += bit * 4;
+                return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+        }
+    }
+
+    [[nodiscard]] const uint8_t *decode(const uint8_t *p, const uint8_t *base, const uint8_t *end, Value& v, int depth = 0) const;
+    [[nodiscard]] const uint8_t *skip(const uint8_t *p, const uint8_t *base, const uint8_t *end) const;
+    [[nodiscard]] bool mapGet(const Value& map, const char *key, const uint8_t *base, const uint8_t *end, Value& v) const;
+    [[nodiscard]] uint64_t toUint(const Value& v) const;
+    void readMetadata(const uint8_t *p, const uint8_t *end);
+    [[nodiscard]] GeoDb::Element element(uint32_t node) const;
+
+    std::string file_;
+    std::unique_ptr<FileUtils::Mmap> mmap_;
+    const uint8_t *tree_;
+    const uint8_t *data_;
+    const uint8_t *dataEnd_;
+    uint32_t nodeCount_;
+    unsigned int recordSize_;
+    unsigned int nodeSize_;
+    unsigned int ipVersion_;
+    uint32_t ipv4Start_;        // node of ::/96 in ipv6 trees
+};
+
+/*
+ *  MaxMind DB writer, ranges are split into networks of an ipv6 search tree with ipv4
+ *  under ::/96 (aliased from ::ffff:0:0/96 and 2002::/16), equal records are stored once.
+ *  Each record is a map of country_id, state_id, city_id, country_key, state_key, city_name
+ *  and, for ranges with a known autonomous system, autonomous_system_number and
+ *  autonomous_system_organization.
+ */
+class GeoMmdbWriter
+{
+public:
+
+    GeoMmdbWriter(std::string databaseType, std::string description);
+
+    void insert(GeoDb::IPv4 from, GeoDb::IPv4 to, const GeoDb::Element& el);
+    void insert(const GeoDb::IPv6& from, const GeoDb::IPv6& to, const GeoDb::Element& el);
+    bool save(const std::string& file);
+
+    [[nodiscard]] size_t nodeCount() const { return nodes_.size(); }
+    [[nodiscard]] size_t recordCount() const { return records_.size(); }
+    [[nodiscard]] size_t dataSize() const { return data_.size(); }
+
+private:
+
+    typedef unsigned __int128 Ip;
+
+    struct Node {
+        uint32_t child[2];
+    };
+
+    /*  child values while building, node indexes are below dataRef_  */
+    static const uint32_t empty_ = 0;
+    static const uint32_t dataRef_ = 0x80000000;
+
+    void insertRange(Ip from, Ip to, uint32_t record);
+    void insertNetwork(Ip net, unsigned int prefix, uint32_t value);
+    uint32_t path(Ip net, unsigned int prefix);
+    uint32_t addRecord(const GeoDb::Element& el);
+
+    static void writeControl(std::string& out, unsigned int type, uint32_t size);
+    static void writeUint(std::string& out, unsigned int type, uint64_t v);
+    static void writeString(std::string& out, const char *p, size_t size);
+    static void writePointer(std::string& out, uint32_t offset);
+    void writeDataString(const char *p, size_t size);
+    std::string metadata() const;
+
+    std::string databaseType_;
+    std::string description_;
+    unsigned int recordSize_;
+    std::vector<Node> nodes_;
+    std::string data_;
+    std::vector<uint32_t> recordOffsets_;
+    std::unordered_map<std::string, uint32_t> records_;
+    std::unordered_map<std::string, uint32_t> strings_;
+};
+
+} // end of ggAdNet namespace
@@ -7,10 +7,20 @@
 #include <cppconn/statement.h>
 #include <cppconn/prepared_statement.h>
 
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <thread>
+
+#include <unistd.h>
 
 #include "base/exceptions.h"
 #include "base/file_utils.h"
 #include "base/geo_db.h"
+#include "base/geo_mmdb.h"
+#include "base/geo_spatial_index.h"
 #include "base/log.h"
 #include "base/utils.h"
 #include "base/iso2Toiso3.h"
@@ -19,7 +29,7 @@ using namespace ggAdNet;
 using namespace ggAdNet::Tools;
 using namespace rapidjson;
 
-GeoParser::GeoParser() : countryId_(0), stateId_(0), cityId_(0)
+GeoParser::GeoParser() : dbPort_(0), dbBatchSize_(defaultDbBatchSize_), nameLocale_(0), nameEnLocale_(0), geoDbStoreNames_(false), geoDbStoreAttributes_(false), geoDbStoreCityLocations_(false), geoDbStoreAsn_(false), geoDbCityNeighbors_(0), countryId_(0), stateId_(0), cityId_(0)
 {
     auto config = Utils::loadJsonFile(configFile_);
     initConfig(config);
@@ -40,12 +50,8 @@ GeoParser::run()
     logInfo("loaded from db in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
     /**/
     begin = Utils::nowMicros();
-    loadLocations(maxmindLocationsEnFile_, true);
-    logInfo("en locations loaded in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
-    /**/
-    begin = Utils::nowMicros();
-    loadLocations(maxmindLocationsRuFile_);
-    logInfo("ru locations loaded in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
+    loadLocations();
+    logInfo("%zu locales loaded in %f sec", locales_.size(), (double) (Utils::nowMicros() - begin) / 1000000.0);
     /**/
     begin = Utils::nowMicros();
     loadIPv4Blocks();
@@ -55,19 +61,35 @@ GeoParser::run()
     loadIPv6Blocks();
     logInfo("ipv6 loaded in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
     /**/
+    if (geoDbStoreAsn_) {
+        begin = Utils::nowMicros();
+        joinAsn();
+        logInfo("asn joined in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
+    }
+    /**/
     begin = Utils::nowMicros();
     saveGeoDb();
     logInfo("geodb saved in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
     /**/
     begin = Utils::nowMicros();
+    saveMmdb();
+    logInfo("mmdb saved in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
+    /**/
+    begin = Utils::nowMicros();
     saveToDb();
-    logInfo("saved to db in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);    
+    logInfo("saved to db in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
+    /**/
+    begin = Utils::nowMicros();
+    saveSnapshot();
+    logInfo("snapshot saved in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
 }
 
 void
 GeoParser::initConfig(const rapidjson::Document& config)
 {
     geoDbFile_ = defaultGeoDbFile_;
+    locales_.clear();
+    std::string nameLocale = defaultMaxmindNameLocale_;
     /*  db  */
     const auto& db = Utils::configSection(config, "db");
     dbHost_ = Utils::configString(db, "host", "localhost");
@@ -75,6 +97,11 @@ GeoParser::initConfig(const rapidjson::Document& config)
     dbUser_ = Utils::configMandatoryString(db, "user");
     dbPassword_ = Utils::configMandatoryString(db, "password");
     dbDb_ = Utils::configMandatoryString(db, "db");
+    int batchSize = Utils::configInt(db, "batch_size", static_cast<int>(defaultDbBatchSize_));
+    if (batchSize <= 0) {
+        throw ConfigException("db.batch_size must be positive");
+    }
+    dbBatchSize_ = static_cast<size_t>(batchSize);
     /*  maxmind  */
     if (config.HasMember("maxmind")) {
         if (!config["maxmind"].IsObject()) {
@@ -84,106 +111,341 @@ GeoParser::initConfig(const rapidjson::Document& config)
         maxmindPath_ = Utils::configString(mm, "path", defaultMaxmindPath_);
         maxmindIpv4File_ = Utils::configString(mm, "ipv4_file", defaultMaxmindIpv4File_);
         maxmindIpv6File_ = Utils::configString(mm, "ipv6_file", defaultMaxmindIpv6File_);
-        maxmindLocationsRuFile_ = Utils::configString(mm, "locations_ru_file", defaultMaxmindLocationsRuFile_);
-        maxmindLocationsEnFile_ = Utils::configString(mm, "locations_en_file", defaultMaxmindLocationsEnFile_);
+        maxmindAsnIpv4File_ = Utils::configString(mm, "asn_ipv4_file", defaultMaxmindAsnIpv4File_);
+        maxmindAsnIpv6File_ = Utils::configString(mm, "asn_ipv6_file", defaultMaxmindAsnIpv6File_);
+        std::vector<std::string> locales;
+        if (mm.HasMember("locales")) {
+            const auto& l = mm["locales"];
+            if (!l.IsArray() || l.Size() == 0) {
+                throw ConfigException("maxmind.locales must be a non empty array");
+            }
+            for (SizeType i = 0; i < l.Size(); i++) {
+                if (!l[i].IsString()) {
+                    throw ConfigException("maxmind.locales must be an array of strings");
+                }
+                locales.emplace_back(l[i].GetString());
+            }
+        } else {
+            locales = defaultMaxmindLocales_;
+        }
+        for (const auto& locale : locales) {
+            /*  locations_<locale>_file overrides the default file name  */
+            std::string key = "locations_" + locale + "_file";
+            locales_.push_back({locale, Utils::configString(mm, key.c_str(), defaultMaxmindLocationsFilePrefix_ + locale + ".csv")});
+        }
+        nameLocale = Utils::configString(mm, "name_locale", defaultMaxmindNameLocale_);
     } else {
         maxmindPath_ = defaultMaxmindPath_;
         maxmindIpv4File_ = defaultMaxmindIpv4File_;
         maxmindIpv6File_ = defaultMaxmindIpv6File_;
-        maxmindLocationsRuFile_ = defaultMaxmindLocationsRuFile_;
-        maxmindLocationsEnFile_ = defaultMaxmindLocationsEnFile_;
+        maxmindAsnIpv4File_ = defaultMaxmindAsnIpv4File_;
+        maxmindAsnIpv6File_ = defaultMaxmindAsnIpv6File_;
+        for (const auto& locale : defaultMaxmindLocales_) {
+            locales_.push_back({locale, defaultMaxmindLocationsFilePrefix_ + locale + ".csv"});
+        }
+    }
+    /*  resolve db name columns to locale indexes  */
+    nameLocale_ = nameEnLocale_ = locales_.size();
+    for (size_t i = 0; i < locales_.size(); i++) {
+        if (locales_[i].locale == nameLocale) {
+            nameLocale_ = i;
+        }
+        if (locales_[i].locale == enLocale_) {
+            nameEnLocale_ = i;
+        }
+    }
+    if (nameLocale_ == locales_.size()) {
+        throw ConfigException("maxmind.name_locale must be one of maxmind.locales");
+    }
+    if (nameEnLocale_ == locales_.size()) {
+        throw ConfigException("maxmind.locales must contain " + enLocale_);
     }
     /**/
     geoDbFile_ = Utils::configString(db, "geodb_file", defaultGeoDbFile_);
+    snapshotFile_ = Utils::configString(db, "snapshot_file", defaultSnapshotFile_);
+    mmdbFile_ = Utils::configString(db, "mmdb_file", "");
+    geoDbStoreNames_ = false;
+    if (db.HasMember("geodb_store_names")) {
+        if (!db["geodb_store_names"].IsBool()) {
+            throw ConfigException("db.geodb_store_names must be a boolean");
+        }
+        geoDbStoreNames_ = db["geodb_store_names"].GetBool();
+    }
+    geoDbStoreAttributes_ = false;
+    if (db.HasMember("geodb_store_attributes")) {
+        if (!db["geodb_store_attributes"].IsBool()) {
+            throw ConfigException("db.geodb_store_attributes must be a boolean");
+        }
+        geoDbStoreAttributes_ = db["geodb_store_attributes"].GetBool();
+    }
+    geoDbStoreCityLocations_ = false;
+    if (db.HasMember("geodb_store_city_locations")) {
+        if (!db["geodb_store_city_locations"].IsBool()) {
+            throw ConfigException("db.geodb_store_city_locations must be a boolean");
+        }
+        geoDbStoreCityLocations_ = db["geodb_store_city_locations"].GetBool();
+    }
+    geoDbStoreAsn_ = false;
+    if (db.HasMember("geodb_store_asn")) {
+        if (!db["geodb_store_asn"].IsBool()) {
+            throw ConfigException("db.geodb_store_asn must be a boolean");
+        }
+        geoDbStoreAsn_ = db["geodb_store_asn"].GetBool();
+    }
+    int cityNeighbors = Utils::configInt(db, "geodb_city_neighbors", defaultGeoDbCityNeighbors_);
+    if (cityNeighbors < 0) {
+        throw ConfigException("db.geodb_city_neighbors can't be negative");
+    }
+    geoDbCityNeighbors_ = static_cast<size_t>(cityNeighbors);
+}
+
+std::string
+GeoParser::dbToken(sql::Connection *conn) const
+{
+    /*  cheap server side summary of the dictionary tables  */
+    static const std::string query =
+        "select count(*), coalesce(max(id), 0), coalesce(sum(crc32(concat_ws(0x1f, id, country_id, `key`, name, name_en, weight))), 0) from states "
+        "union all "
+        "select count(*), coalesce(max(id), 0), coalesce(sum(crc32(concat_ws(0x1f, id, state_id, `key`, name, name_en, weight))), 0) from cities "
+        "union all "
+        "select count(*), coalesce(max(id), 0), coalesce(sum(crc32(concat_ws(0x1f, id, `key`, name, name_en, weight))), 0) from countries";
+    std::unique_ptr<sql::Statement> stmt(conn->createStatement());
+    std::unique_ptr<sql::ResultSet> res(stmt->executeQuery(query));
+    std::string token;
+    while (res->next()) {
+        token.append(std::to_string(res->getUInt64(1)));
+        token.push_back(':');
+        token.append(std::to_string(res->getUInt64(2)));
+        token.push_back(':');
+        token.append(std::to_string(res->getUInt64(3)));
+        token.push_back(';');
+    }
+    return token;
 }
 
 void
-GeoParser::loadFromDb()
+GeoParser::runOnConnections(const std::vector<DbJob>& jobs) const
 {
-    try {
-        /*  connect  */
-        sql::Driver *driver = get_driver_instance();
-        std::string connUri = "tcp://" + dbHost_ + ":" + std::to_string(dbPort_);
-        std::unique_ptr<sql::Connection> conn(driver->connect(connUri, dbUser_, dbPassword_));
-        conn->setSchema(dbDb_);
-        /*  load countries  */
-        int count = 0;
-        std::unique_ptr<sql::Statement> stmt(conn->createStatement());
-        std::unique_ptr<sql::ResultSet> res(stmt->executeQuery("select id, `key`, name, name_en, weight from countries"));
-        while (res->next()) {
-            Country country;
-            country.id = res->getUInt("id");
-            country.key = res->getString("key");
-            country.name = res->getString("name");
-            country.nameEn = res->getString("name_en");
-            country.weight = res->getUInt("weight");
-            countries_[country.key] = country;
-            if (country.id > countryId_) {
-                countryId_ = country.id;
+    sql::Driver *driver = get_driver_instance();
+    std::vector<std::exception_ptr> errors(jobs.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        threads.emplace_back([this, driver, &jobs, &errors, i] {
+            driver->threadInit();
+            try {
+                auto conn = connect(driver);
+                jobs[i].run(conn.get());
+            } catch (sql::SQLException &e) {
+                logError("db error: %s, code: %d, table: %s", e.what(), e.getErrorCode(), jobs[i].table);
+                errors[i] = std::make_exception_ptr(GeoParserException("db exception"));
+            } catch (...) {
+                errors[i] = std::current_exception();
             }
-            count++;
-        }
-        countryId_++;
-        logInfo("loaded %d countries from db", count);
-        /*  load states  */
-        count = 0;
-        res.reset(stmt->executeQuery("select id, country_id, `key`, name, name_en, weight from states"));
-        while (res->next()) {
-            State state;
-            state.id = res->getUInt("id");
-            state.countryId = res->getUInt("country_id");
-            state.key = res->getString("key");
-            state.name = res->getString("name");
-            state.nameEn = res->getString("name_en");
-            state.weight = res->getUInt("weight");
-            states_[state.key] = state;
-            if (state.id > stateId_) {
-                stateId_ = state.id;
-            }
-            count++;
-        }
-        stateId_++;
-        logInfo("loaded %d states from db", count);
-        /*  load cities  */
-        count = 0;
-        res.reset(stmt->executeQuery("select id, state_id, `key`, name, name_en, weight from cities"));
-        while (res->next()) {
-            City city;
-            city.id = res->getUInt("id");
-            city.stateId = res->getUInt("state_id");
-            city.key = res->getString("key");
-            city.name = res->getString("name");
-            city.nameEn = res->getString("name_en");
-            city.weight = res->getUInt("weight");
-            cities_[city.key] = city;
-            if (city.id > cityId_) {
-                cityId_ = city.id;
-            }
-            count++;
+            driver->threadEnd();
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (const auto& e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
         }
-        cityId_++;
-        logInfo("loaded %d cities from db", count);
+    }
+}
+
+void
+GeoParser::loadFromDb()
+{
+    std::string token;
+    try {
+        auto conn = connect(get_driver_instance());
+        token = dbToken(conn.get());
     } catch (sql::SQLException &e) {
         logError("db error: %s, code: %d", e.what(), e.getErrorCode());
         throw GeoParserException("db exception");
     }
+    if (!loadSnapshot(token)) {
+        /*  stream tables in parallel  */
+        runOnConnections({
+            {"countries", [this](sql::Connection *conn) {
+                std::unique_ptr<sql::Statement> stmt(conn->createStatement());
+                std::unique_ptr<sql::ResultSet> res(stmt->executeQuery("select id, `key`, name, name_en, weight from countries"));
+                while (res->next()) {
+                    Country country;
+                    country.id = res->getUInt(1);
+                    country.key = res->getString(2);
+                    country.name = res->getString(3);
+                    country.nameEn = res->getString(4);
+                    country.weight = res->getUInt(5);
+                    countries_[country.key] = country;
+                }
+            }},
+            {"states", [this](sql::Connection *conn) {
+                std::unique_ptr<sql::Statement> stmt(conn->createStatement());
+                std::unique_ptr<sql::ResultSet> res(stmt->executeQuery("select id, country_id, `key`, name, name_en, weight from states"));
+                while (res->next()) {
+                    State state;
+                    state.id = res->getUInt(1);
+                    state.countryId = res->getUInt(2);
+                    state.key = res->getString(3);
+                    state.name = res->getString(4);
+                    state.nameEn = res->getString(5);
+                    state.weight = res->getUInt(6);
+                    states_[state.key] = state;
+                }
+            }},
+            {"cities", [this](sql::Connection *conn) {
+                std::unique_ptr<sql::Statement> stmt(conn->createStatement());
+                std::unique_ptr<sql::ResultSet> res(stmt->executeQuery("select id, state_id, `key`, name, name_en, weight from cities"));
+                while (res->next()) {
+                    City city;
+                    city.id = res->getUInt(1);
+                    city.stateId = res->getUInt(2);
+                    city.key = res->getString(3);
+                    city.name = res->getString(4);
+                    city.nameEn = res->getString(5);
+                    city.weight = res->getUInt(6);
+                    cities_[city.key] = city;
+                }
+            }},
+        });
+    }
+    /*  next ids  */
+    for (const auto& it : countries_) {
+        countryId_ = std::max(countryId_, it.second.id);
+    }
+    countryId_++;
+    for (const auto& it : states_) {
+        stateId_ = std::max(stateId_, it.second.id);
+    }
+    stateId_++;
+    for (const auto& it : cities_) {
+        cityId_ = std::max(cityId_, it.second.id);
+    }
+    cityId_++;
+    logInfo("loaded %zu countries, %zu states, %zu cities", countries_.size(), states_.size(), cities_.size());
+}
+
+bool
+GeoParser::loadSnapshot(const std::string& token)
+{
+    if (snapshotFile_.empty()) {
+        return false;
+    }
+    FileUtils::Mmap mmap(snapshotFile_);
+    if (mmap.open() != FileUtils::Mmap::ReturnCode::SUCCESS || !mmap.ptr()) {
+        logInfo("no dictionary snapshot %s", snapshotFile_.c_str());
+        return false;
+    }
+    protobuf::GeoDictionary dict;
+    if (!dict.ParseFromArray(mmap.ptr(), static_cast<int>(mmap.size()))) {
+        logWarn("can't parse dictionary snapshot %s", snapshotFile_.c_str());
+        return false;
+    }
+    if (dict.token() != token) {
+        logInfo("dictionary snapshot %s is outdated", snapshotFile_.c_str());
+        return false;
+    }
+    auto fill = [](GeoItem& item, const protobuf::GeoDictionary::Item& e) {
+        item.id = e.id();
+        item.key = e.key();
+        item.name = e.name();
+        item.nameEn = e.name_en();
+        item.weight = e.weight();
+    };
+    for (const auto& e : dict.countries()) {
+        Country country;
+        fill(country, e);
+        countries_[country.key] = country;
+    }
+    for (const auto& e : dict.states()) {
+        State state;
+        fill(state, e);
+        state.countryId = e.parent_id();
+        states_[state.key] = state;
+    }
+    for (const auto& e : dict.cities()) {
+        City city;
+        fill(city, e);
+        city.stateId = e.parent_id();
+        cities_[city.key] = city;
+    }
+    logInfo("loaded dictionary snapshot %s", snapshotFile_.c_str());
+    return true;
 }
 
 void
-GeoParser::loadLocations(const std::string& f, bool en)
+GeoParser::saveSnapshot()
 {
-    std::string file = maxmindPath_ + f;
-    FileUtils::Mmap mmap(file);
-    if (mmap.open() != FileUtils::Mmap::ReturnCode::SUCCESS) {
+    if (snapshotFile_.empty()) {
+        return;
+    }
+    protobuf::GeoDictionary dict;
+    try {
+        auto conn = connect(get_driver_instance());
+        dict.set_token(dbToken(conn.get()));
+    } catch (sql::SQLException &e) {
+        logError("db error: %s, code: %d", e.what(), e.getErrorCode());
+        throw GeoParserException("db exception");
+    }
+    auto fill = [](protobuf::GeoDictionary::Item *r, const GeoItem& item) {
+        r->set_id(item.id);
+        r->set_key(item.key);
+        r->set_name(item.name);
+        r->set_name_en(item.nameEn);
+        r->set_weight(item.weight);
+    };
+    for (const auto& it : countries_) {
+        fill(dict.add_countries(), it.second);
+    }
+    for (const auto& it : states_) {
+        auto r = dict.add_states();
+        fill(r, it.second);
+        r->set_parent_id(it.second.countryId);
+    }
+    for (const auto& it : cities_) {
+        auto r = dict.add_cities();
+        fill(r, it.second);
+        r->set_parent_id(it.second.stateId);
+    }
+    /*  write aside and rename, a partial snapshot must never be picked up  */
+    std::string s = dict.SerializeAsString();
+    std::string tmp = snapshotFile_ + ".tmp";
+    FILE *fd = fopen(tmp.c_str(), "wb");
+    if (!fd) {
+        logError("can't fopen %s for writing", tmp.c_str());
+        return;
+    }
+    size_t rc = fwrite(s.c_str(), 1, s.size(), fd);
+    if (rc != static_cast<size_t>(s.size())) {
+        logError("can't write, rc: %zu, error: %s (%d)", rc, strerror(errno), errno);
+        fclose(fd);
+        unlink(tmp.c_str());
+        return;
+    }
+    fclose(fd);
+    if (rename(tmp.c_str(), snapshotFile_.c_str()) != 0) {
+        logError("can't rename %s to %s, error: %s (%d)", tmp.c_str(), snapshotFile_.c_str(), strerror(errno), errno);
+        unlink(tmp.c_str());
+    }
+}
+
+void
+GeoParser::loadLocaleFile(LocaleFile& lf)
+{
+    std::string file = maxmindPath_ + lf.file;
+    lf.mmap = std::make_unique<FileUtils::Mmap>(file);
+    if (lf.mmap->open() != FileUtils::Mmap::ReturnCode::SUCCESS) {
         logError("can't mmap file %s", file.c_str());
         throw GeoParserException("can't mmap file");
     }
-    const char *p = mmap.ptr();
+    const char *p = lf.mmap->ptr();
     if (!p) {
         logError("file %s is empty", file.c_str());
         throw GeoParserException("names file is empty");
     }
-    const char *end = p + mmap.size();
+    const char *end = p + lf.mmap->size();
     /* check header  */
     static const std::vector<std::string> fields = {"geoname_id", "locale_code", "continent_code",
         "continent_name", "country_iso_code", "country_name", "subdivision_1_iso_code", "subdivision_1_name",
@@ -196,7 +458,7 @@ GeoParser::loadLocations(const std::string& f, bool en)
     }
     for (unsigned int i = 0; i < fields.size(); i++) {
         if (values[i] != fields[i]) {
-            logError("field #%u must be %s (%.*s got) in file %s%", i, fields[i].c_str(),
+            logError("field #%u must be %s (%.*s got) in file %s", i, fields[i].c_str(),
                 values[i].size, values[i].data, file.c_str());
             throw GeoParserException("bad file format");
         }
@@ -208,127 +470,167 @@ GeoParser::loadLocations(const std::string& f, bool en)
             logError("fields count %d != %d in line %d in file %s", values.size(), fields.size(), line, file.c_str());
             throw GeoParserException("bad file format");
         }
+        line++;
         if (values[4].size == 0) {
-            line++;
             continue;
         }
-        Location location;
-        unsigned int locationId = Utils::atoui(values[0]);
-        /*  process country  */
-        std::string key(values[4].data, values[4].size);
-        auto icountry = countries_.find(key);
-        if (icountry == countries_.end()) {
-            /*  new country, add it  */
-            Country country;
-            country.id = countryId_++;
-            country.key = key;
-            country.name.assign(values[5].data, values[5].size);
-            if (en) {
-                country.nameEn.assign(values[5].data, values[5].size);
+        LocaleRow row;
+        row.geonameId = Utils::atoui(values[0]);
+        row.countryKey = values[4];
+        row.countryName = values[5];
+        row.stateKey = values[6];
+        row.stateName = values[7];
+        row.cityName = values[10];
+        lf.index[row.geonameId] = lf.rows.size();
+        lf.rows.push_back(row);
+    }
+}
+
+void
+GeoParser::updateNames(GeoItem& item, const std::vector<CString>& names, const CString& fallback)
+{
+    item.names.resize(names.size());
+    for (size_t i = 0; i < names.size(); i++) {
+        const CString& s = names[i].empty() ? fallback : names[i];
+        item.names[i].assign(s.data, s.size);
+    }
+    /*  name falls back to the first locale having one  */
+    const CString *name = &names[nameLocale_];
+    for (size_t i = 0; name->empty() && i < names.size(); i++) {
+        name = &names[i];
+    }
+    if (name->empty()) {
+        name = &fallback;
+    }
+    if (!name->empty() && *name != item.name) {
+        item.name.assign(name->data, name->size);
+        item.store = true;
+    }
+    const CString *nameEn = names[nameEnLocale_].empty() ? &fallback : &names[nameEnLocale_];
+    if (!nameEn->empty() && *nameEn != item.nameEn) {
+        item.nameEn.assign(nameEn->data, nameEn->size);
+        item.store = true;
+    }
+}
+
+void
+GeoParser::loadLocations()
+{
+    /*  parse all locale files concurrently  */
+    std::vector<LocaleFile> files(locales_.size());
+    std::vector<std::exception_ptr> errors(locales_.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < locales_.size(); i++) {
+        files[i].file = locales_[i].file;
+        threads.emplace_back([this, &files, &errors, i] {
+            try {
+                loadLocaleFile(files[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
             }
-            country.weight = country.id;
-            country.store = true;
-            countries_[key] = country;
-            location.countryId = country.id;
-            location.countryKey.assign(values[4].data, values[4].size);
-        } else {
-            if (!values[5].empty()) {
-                if (values[5] != icountry->second.name) {
-                    icountry->second.name.assign(values[5].data, values[5].size);
-                    icountry->second.store = true;
-                }
-                if (en && values[5] != icountry->second.nameEn) {
-                    icountry->second.nameEn.assign(values[5].data, values[5].size);
-                    icountry->second.store = true;
-                }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (const auto& e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+    /*  merge into the shared location table over the union of geoname ids, the first
+        locale file having an id drives its structure  */
+    const CString none("");
+    std::vector<const LocaleRow *> rows(files.size());
+    std::vector<CString> names(files.size());
+    size_t later = 0;                   // ids missing from the first locale file
+    for (size_t f = 0; f < files.size(); f++) {
+        for (const auto& row : files[f].rows) {
+            bool seen = false;
+            for (size_t i = 0; i < files.size(); i++) {
+                auto it = files[i].index.find(row.geonameId);
+                rows[i] = it != files[i].index.end() ? &files[i].rows[it->second] : nullptr;
+                seen = seen || (i < f && rows[i]);
+            }
+            if (seen) {
+                continue;
+            }
+            later += f > 0;
+            Location location;
+            /*  process country  */
+            for (size_t i = 0; i < rows.size(); i++) {
+                names[i] = rows[i] ? rows[i]->countryName : none;
+            }
+            std::string key(row.countryKey.data, row.countryKey.size);
+            auto icountry = countries_.find(key);
+            if (icountry == countries_.end()) {
+                /*  new country, add it  */
+                Country country;
+                country.id = countryId_++;
+                country.key = key;
+                country.weight = country.id;
+                country.store = true;
+                icountry = countries_.emplace(key, country).first;
             }
+            updateNames(icountry->second, names, none);
             location.countryId = icountry->second.id;
-            location.countryKey.assign(values[4].data, values[4].size);
-        }
-        /*  process state  */
-        if (values[6].size != 0) {
-            key.push_back('.');
-            key.append(values[6].data, values[6].size);
-            auto istate = states_.find(key);
-            if (istate == states_.end()) {
-                /*  new state, add it  */
-                State state;
-                state.id = stateId_++;
-                state.countryId = location.countryId;
-                state.key = key;
-                if (values[7].size) {
-                    state.name.assign(values[7].data, values[7].size);
-                    if (en) {
-                        state.nameEn.assign(values[7].data, values[7].size);
-                    }
-                } else {
-                    state.name.assign(values[6].data, values[6].size);
-                    if (en) {
-                        state.name.assign(values[6].data, values[6].size);
-                    }
+            location.countryKey = key;
+            /*  process state  */
+            if (row.stateKey.size != 0) {
+                for (size_t i = 0; i < rows.size(); i++) {
+                    names[i] = rows[i] ? rows[i]->stateName : none;
                 }
-                state.weight = state.id;
-                state.store = true;
-                states_[key] = state;
-                location.stateId = state.id;
-                location.stateKey.assign(values[6].data, values[6].size);
-            } else {
-                if (!values[7].empty()) {
-                    if (values[7] != istate->second.name) {
-                        istate->second.name.assign(values[7].data, values[7].size);
-                        istate->second.store = true;
-                    }
-                    if (en && values[7] != istate->second.nameEn) {
-                        istate->second.nameEn.assign(values[7].data, values[7].size);
-                        istate->second.store = true;
-                    }
+                key.push_back('.');
+                key.append(row.stateKey.data, row.stateKey.size);
+                auto istate = states_.find(key);
+                bool isNew = istate == states_.end();
+                if (isNew) {
+                    /*  new state, add it  */
+                    State state;
+                    state.id = stateId_++;
+                    state.countryId = location.countryId;
+                    state.key = key;
+                    state.weight = state.id;
+                    state.store = true;
+                    istate = states_.emplace(key, state).first;
                 }
+                /*  unnamed new states are named by their code  */
+                updateNames(istate->second, names, isNew ? row.stateKey : none);
                 location.stateId = istate->second.id;
-                location.stateKey.assign(values[6].data, values[6].size);
-            }
-            /*  process city  */
-            if (values[10].size != 0) {
-                /*  use geoname_id as identifier in key  */
-                key.push_back('.');
-                key.append(values[0].data, values[0].size);
-                auto icity = cities_.find(key);
-                if (icity == cities_.end()) {
-                    /*  new city, add it  */
-                    City city;
-                    city.id = cityId_++;
-                    city.stateId = location.stateId;
-                    city.key = key;
-                    city.name.assign(values[10].data, values[10].size);
-                    if (en) {
-                        city.nameEn.assign(values[10].data, values[10].size);
-                        location.cityName.assign(city.nameEn, city.nameEn.size());
+                location.stateKey.assign(row.stateKey.data, row.stateKey.size);
+                /*  process city  */
+                if (row.cityName.size != 0) {
+                    for (size_t i = 0; i < rows.size(); i++) {
+                        names[i] = rows[i] ? rows[i]->cityName : none;
                     }
-                    city.weight = city.id;
-                    city.store = true;
-                    cities_[key] = city;
-                    location.cityId = city.id;
-                } else {
-                    if (!values[10].empty()) {
-                        if (values[10] != icity->second.name) {
-                            icity->second.name.assign(values[10].data, values[10].size);
-                            icity->second.store = true;
-                        }
-                        if (en && values[10] != icity->second.nameEn) {
-                            icity->second.nameEn.assign(values[10].data, values[10].size);
-                            icity->second.store = true;
-                            location.cityName.assign(icity->second.nameEn, icity->second.nameEn.size());
-                        }
+                    /*  use geoname_id as identifier in key  */
+                    key.push_back('.');
+                    key.append(std::to_string(row.geonameId));
+                    auto icity = cities_.find(key);
+                    if (icity == cities_.end()) {
+                        /*  new city, add it  */
+                        City city;
+                        city.id = cityId_++;
+                        city.stateId = location.stateId;
+                        city.key = key;
+                        city.weight = city.id;
+                        city.store = true;
+                        icity = cities_.emplace(key, city).first;
                     }
+                    updateNames(icity->second, names, none);
                     location.cityId = icity->second.id;
+                    location.cityName = icity->second.nameEn;
                 }
             }
+            if (location.stateId == 703883) {
+                /*  крымнаш  */
+                location.countryId = 2017370;
+            }
+            locations_[row.geonameId] = location;
         }
-        if (location.stateId == 703883) {
-            /*  крымнаш  */
-            location.countryId = 2017370;
-        }
-        locations_[locationId] = location;
-        line++;
+    }
+    if (later) {
+        logInfo("%zu locations are missing from %s, taken from other locale files", later, files[0].file.c_str());
     }
 }
 
@@ -405,6 +707,12 @@ GeoParser::loadIPv4Blocks()
         r->set_country_key(codeTransf.at(it->second.countryKey));
         r->set_state_key(it->second.stateKey);
         r->set_city_name(it->second.cityName);
+        if (geoDbStoreAttributes_) {
+            r->set_attributes(attributesId(values));
+        }
+        if (geoDbStoreCityLocations_) {
+            addCityPoint(it->second.cityId, values);
+        }
         line++;
     }
 }
@@ -484,22 +792,354 @@ GeoParser::loadIPv6Blocks()
         r->set_country_key(codeTransf.at(it->second.countryKey));
         r->set_state_key(it->second.stateKey);
         r->set_city_name(it->second.cityName);
+        if (geoDbStoreAttributes_) {
+            r->set_attributes(attributesId(values));
+        }
+        if (geoDbStoreCityLocations_) {
+            addCityPoint(it->second.cityId, values);
+        }
         line++;
     }
 }
 
+uint32_t
+GeoParser::attributesId(const std::vector<CString>& values)
+{
+    /*  is_anonymous_proxy, is_satellite_provider, postal_code, latitude, longitude, accuracy_radius  */
+    auto flag = [](const CString& v) {
+        return v.size == 1 && v.data[0] == '1';
+    };
+    protobuf::Geo::Attributes attributes;
+    uint32_t flags = 0;
+    if (flag(values[4])) {
+        flags |= GeoDb::a_anonymous_proxy;
+    }
+    if (flag(values[5])) {
+        flags |= GeoDb::a_satellite_provider;
+    }
+    if (values[7].size && values[8].size) {
+        flags |= GeoDb::a_located;
+        attributes.set_latitude(coordinate(values[7]));
+        attributes.set_longitude(coordinate(values[8]));
+    }
+    attributes.set_flags(flags);
+    attributes.set_accuracy_radius(Utils::atoui(values[9]));
+    if (values[6].size) {
+        std::string postalCode(values[6].data, values[6].size);
+        auto it = postalCodeIds_.find(postalCode);
+        if (it == postalCodeIds_.end()) {
+            geodb_.add_postal_codes(postalCode);
+            it = postalCodeIds_.emplace(postalCode, static_cast<uint32_t>(geodb_.postal_codes_size())).first;
+        }
+        attributes.set_postal_code(it->second);
+    }
+    if (flags == 0 && attributes.accuracy_radius() == 0 && attributes.postal_code() == 0) {
+        return 0;
+    }
+    /*  most ranges of a city share them  */
+    std::string key = attributes.SerializeAsString();
+    auto it = attributeIds_.find(key);
+    if (it != attributeIds_.end()) {
+        return it->second;
+    }
+    *geodb_.add_attributes() = attributes;
+    auto id = static_cast<uint32_t>(geodb_.attributes_size());
+    attributeIds_.emplace(std::move(key), id);
+    return id;
+}
+
+int32_t
+GeoParser::coordinate(const CString& value)
+{
+    std::string s(value.data, value.size);
+    return static_cast<int32_t>(std::lround(strtod(s.c_str(), nullptr) * GeoDb::coordinateScale));
+}
+
+void
+GeoParser::addCityPoint(unsigned int cityId, const std::vector<CString>& values)
+{
+    if (cityId == 0 || !values[7].size || !values[8].size) {
+        return;
+    }
+    /*  0 is an unknown radius  */
+    unsigned int accuracyRadius = Utils::atoui(values[9]);
+    if (accuracyRadius == 0) {
+        accuracyRadius = std::numeric_limits<unsigned int>::max();
+    }
+    auto it = cityPoints_.find(cityId);
+    if (it == cityPoints_.end() || accuracyRadius < it->second.accuracyRadius) {
+        cityPoints_[cityId] = {coordinate(values[7]), coordinate(values[8]), accuracyRadius};
+    }
+}
+
+void
+GeoParser::storeCityLocations()
+{
+    std::vector<unsigned int> ids;
+    ids.reserve(cityPoints_.size());
+    GeoSpatialIndex index;
+    for (const auto& it : cityPoints_) {
+        ids.push_back(it.first);
+        index.add(it.first, it.second.latitude / GeoDb::coordinateScale, it.second.longitude / GeoDb::coordinateScale);
+    }
+    index.build();
+    std::sort(ids.begin(), ids.end());
+    std::vector<GeoSpatialIndex::Hit> hits;
+    for (unsigned int id : ids) {
+        const auto& point = cityPoints_[id];
+        auto r = geodb_.add_city_locations();
+        r->set_city_id(id);
+        r->set_latitude(point.latitude);
+        r->set_longitude(point.longitude);
+        /*  the city itself comes first  */
+        index.nearest(point.latitude / GeoDb::coordinateScale, point.longitude / GeoDb::coordinateScale, geoDbCityNeighbors_ + 1, hits);
+        for (const auto& hit : hits) {
+            if (hit.id != id && static_cast<size_t>(r->neighbors_size()) < geoDbCityNeighbors_) {
+                r->add_neighbors(hit.id);
+            }
+        }
+    }
+    logInfo("%zu city locations stored", ids.size());
+}
+
+void
+GeoParser::loadAsnBlocks(const std::string& file, bool ipv6, std::vector<AsnRange>& ranges)
+{
+    FileUtils::Mmap mmap(file);
+    if (mmap.open() != FileUtils::Mmap::ReturnCode::SUCCESS) {
+        logError("can't mmap file %s", file.c_str());
+        throw GeoParserException("can't mmap file");
+    }
+    const char *p = mmap.ptr();
+    if (!p) {
+        logError("file %s is empty", file.c_str());
+        throw GeoParserException("asn file is empty");
+    }
+    const char *end = p + mmap.size();
+    /* check header  */
+    static const std::vector<std::string> fields = {"network", "autonomous_system_number", "autonomous_system_organization"};
+    std::vector<CString> values;
+    p = Utils::loadCSVLine(p, end, values);
+    if (values.size() != fields.size()) {
+        logError("bad file format %s", file.c_str());
+        throw GeoParserException("bad file format");
+    }
+    for (unsigned int i = 0; i < fields.size(); i++) {
+        if (values[i] != fields[i]) {
+            logError("field #%u must be %s (%.*s got) in file %s", i, fields[i].c_str(),
+                values[i].size, values[i].data, file.c_str());
+            throw GeoParserException("bad file format");
+        }
+    }
+    /*  load data  */
+    int line = 0;
+    while ((p = Utils::loadCSVLine(p, end, values)) != end) {
+        if (values.size() != fields.size()) {
+            logError("fields count %zu != %zu in line %d in file %s", values.size(), fields.size(), line, file.c_str());
+            throw GeoParserException("bad file format");
+        }
+        if (!memchr(values[0].data, '/', values[0].size) || !values[1].size) {
+            logWarn("bad network in line %d in file %s", line, file.c_str());
+            line++;
+            continue;
+        }
+        std::string network(values[0].data, values[0].size);
+        AsnRange range{};
+        if (ipv6) {
+            GeoDb::IPv6 ipFrom;
+            GeoDb::IPv6 ipTo;
+            GeoDb::net6ToRange(network, ipFrom, ipTo);
+            range.from = static_cast<unsigned __int128>(ipFrom.hi) << 64 | ipFrom.lo;
+            range.to = static_cast<unsigned __int128>(ipTo.hi) << 64 | ipTo.lo;
+        } else {
+            GeoDb::IPv4 ipFrom;
+            GeoDb::IPv4 ipTo;
+            GeoDb::net4ToRange(network, ipFrom, ipTo);
+            range.from = ipFrom;
+            range.to = ipTo;
+        }
+        range.asn = asnId(values[1], values[2]);
+        ranges.push_back(range);
+        line++;
+    }
+}
+
+uint32_t
+GeoParser::asnId(const CString& number, const CString& organization)
+{
+    std::string key(number.data, number.size);
+    key.push_back('\0');
+    key.append(organization.data, organization.size);
+    auto it = asnIds_.find(key);
+    if (it != asnIds_.end()) {
+        return it->second;
+    }
+    auto r = geodb_.add_asns();
+    r->set_number(Utils::atoui(number));
+    r->set_organization(organization.data, organization.size);
+    auto id = static_cast<uint32_t>(geodb_.asns_size());
+    asnIds_.emplace(std::move(key), id);
+    return id;
+}
+
+namespace {
+
+typedef unsigned __int128 Key;          // ipv4 addresses as is
+
+struct Span {
+    Key from;
+    Key to;
+    uint32_t value;
+};
+
+/*
+ *  Sweep two lists of ranges in address order and call emit(from, to, a, b) for every
+ *  piece covered by either of them, a and b are the covering ranges or null. Ranges of
+ *  a list must not overlap, pieces are cut at every boundary of both lists.
+ */
+template <typename Emit>
+void
+sweep(std::vector<Span>& a, std::vector<Span>& b, Emit emit)
+{
+    auto byFrom = [](const Span& x, const Span& y) {
+        return x.from < y.from;
+    };
+    std::sort(a.begin(), a.end(), byFrom);
+    std::sort(b.begin(), b.end(), byFrom);
+    const Key keyMax = ~static_cast<Key>(0);
+    size_t i = 0;
+    size_t j = 0;
+    Key pos = 0;
+    for (;;) {
+        while (i < a.size() && a[i].to < pos) {
+            i++;
+        }
+        while (j < b.size() && b[j].to < pos) {
+            j++;
+        }
+        if (i == a.size() && j == b.size()) {
+            break;
+        }
+        bool inA = i < a.size() && a[i].from <= pos;
+        bool inB = j < b.size() && b[j].from <= pos;
+        if (!inA && !inB) {
+            /*  a gap, skip to the next range  */
+            pos = std::min(i < a.size() ? a[i].from : keyMax, j < b.size() ? b[j].from : keyMax);
+            continue;
+        }
+        /*  the piece ends where a covering range ends or the next one starts  */
+        Key to = keyMax;
+        if (i < a.size()) {
+            to = std::min(to, inA ? a[i].to : a[i].from - 1);
+        }
+        if (j < b.size()) {
+            to = std::min(to, inB ? b[j].to : b[j].from - 1);
+        }
+        emit(pos, to, inA ? &a[i] : nullptr, inB ? &b[j] : nullptr);
+        if (to == keyMax) {
+            break;
+        }
+        pos = to + 1;
+    }
+}
+
+}
+
+void
+GeoParser::joinAsn()
+{
+    std::vector<AsnRange> asnRanges;
+    std::vector<Span> cities;
+    std::vector<Span> asns;
+    /*  ipv4  */
+    loadAsnBlocks(maxmindPath_ + maxmindAsnIpv4File_, false, asnRanges);
+    for (const auto& r : asnRanges) {
+        asns.push_back({r.from, r.to, r.asn});
+    }
+    for (int i = 0; i < geodb_.ipsv4_size(); i++) {
+        cities.push_back({geodb_.ipsv4(i).from(), geodb_.ipsv4(i).to(), static_cast<uint32_t>(i)});
+    }
+    google::protobuf::RepeatedPtrField<protobuf::Geo::IPv4Range> ipsv4;
+    sweep(cities, asns, [this, &ipsv4](Key from, Key to, const Span *city, const Span *asn) {
+        auto r = ipsv4.Add();
+        if (city) {
+            *r = geodb_.ipsv4(static_cast<int>(city->value));
+        }
+        r->set_from(static_cast<uint32_t>(from));
+        r->set_to(static_cast<uint32_t>(to));
+        r->set_asn(asn ? asn->value : 0);
+    });
+    logInfo("ipv4: %zu asn ranges, %d ranges joined to %d", asns.size(), geodb_.ipsv4_size(), ipsv4.size());
+    geodb_.mutable_ipsv4()->Swap(&ipsv4);
+    /*  ipv6  */
+    asnRanges.clear();
+    cities.clear();
+    asns.clear();
+    loadAsnBlocks(maxmindPath_ + maxmindAsnIpv6File_, true, asnRanges);
+    for (const auto& r : asnRanges) {
+        asns.push_back({r.from, r.to, r.asn});
+    }
+    for (int i = 0; i < geodb_.ipsv6_size(); i++) {
+        const auto& e = geodb_.ipsv6(i);
+        cities.push_back({static_cast<Key>(e.from_hi()) << 64 | e.from_lo(), static_cast<Key>(e.to_hi()) << 64 | e.to_lo(),
+            static_cast<uint32_t>(i)});
+    }
+    google::protobuf::RepeatedPtrField<protobuf::Geo::IPv6Range> ipsv6;
+    sweep(cities, asns, [this, &ipsv6](Key from, Key to, const Span *city, const Span *asn) {
+        auto r = ipsv6.Add();
+        if (city) {
+            *r = geodb_.ipsv6(static_cast<int>(city->value));
+        }
+        r->set_from_hi(static_cast<uint64_t>(from >> 64));
+        r->set_from_lo(static_cast<uint64_t>(from));
+        r->set_to_hi(static_cast<uint64_t>(to >> 64));
+        r->set_to_lo(static_cast<uint64_t>(to));
+        r->set_asn(asn ? asn->value : 0);
+    });
+    logInfo("ipv6: %zu asn ranges, %d ranges joined to %d", asns.size(), geodb_.ipsv6_size(), ipsv6.size());
+    geodb_.mutable_ipsv6()->Swap(&ipsv6);
+    logInfo("%d autonomous systems stored", geodb_.asns_size());
+}
+
 void
 GeoParser::saveGeoDb()
 {
-    if (0) {
+    if (geoDbStoreCityLocations_) {
+        storeCityLocations();
+    }
+    if (geoDbStoreNames_) {
+        /*  names go to a deduplicated string table, items reference it per locale  */
+        std::unordered_map<std::string, uint32_t> strings;
+        auto intern = [this, &strings](const std::string& s) {
+            auto it = strings.find(s);
+            if (it != strings.end()) {
+                return it->second;
+            }
+            auto id = static_cast<uint32_t>(geodb_.names_size());
+            geodb_.add_names(s);
+            strings.emplace(s, id);
+            return id;
+        };
+        for (const auto& locale : locales_) {
+            geodb_.add_locales(locale.locale);
+        }
+        auto storeNames = [this, &intern](protobuf::Geo::GeoName *r, const GeoItem& item) {
+            for (size_t i = 0; i < locales_.size(); i++) {
+                if (i < item.names.size() && !item.names[i].empty()) {
+                    r->add_names(intern(item.names[i]));
+                } else {
+                    /*  not in maxmind files, known from db only  */
+                    r->add_names(intern(i == nameEnLocale_ ? item.nameEn : item.name));
+                }
+            }
+        };
         /*  store countries  */
         for (const auto& it : countries_) {
             const auto& country = it.second;
             auto r = geodb_.add_countries();
             r->set_id(country.id);
             r->set_key(codeTransf.at(country.key));
-            r->set_name(country.name);
-            r->set_name_en(country.nameEn);
+            storeNames(r, country);
         }
         /*  store states  */
         for (const auto& it : states_) {
@@ -507,8 +1147,7 @@ GeoParser::saveGeoDb()
             auto r = geodb_.add_states();
             r->set_id(state.id);
             r->set_key(state.key);
-            r->set_name(state.name);
-            r->set_name_en(state.nameEn);
+            storeNames(r, state);
         }
         /*  store cities  */
         for (const auto& it : cities_) {
@@ -516,16 +1155,15 @@ GeoParser::saveGeoDb()
             auto r = geodb_.add_cities();
             r->set_id(city.id);
             r->set_key(city.key);
-            r->set_name(city.name);
-            r->set_name_en(city.nameEn);
+            storeNames(r, city);
         }
     }
     /*  serialize  */
     std::string s = geodb_.SerializeAsString();
     /*  store  */
-    FILE *fd = fopen(defaultGeoDbFile_.c_str(), "wb");
+    FILE *fd = fopen(geoDbFile_.c_str(), "wb");
     if (!fd) {
-        logError("can't fopen %s for writing", defaultGeoDbFile_.c_str());
+        logError("can't fopen %s for writing", geoDbFile_.c_str());
         return;
     }
     size_t rc = fwrite(s.c_str(), 1, s.size(), fd);
@@ -538,76 +1176,144 @@ GeoParser::saveGeoDb()
 }
 
 void
-GeoParser::saveToDb()
+GeoParser::saveMmdb()
 {
-    try {
-        /*  connect  */
-        sql::Driver *driver = get_driver_instance();
-        std::string connUri = "tcp://" + dbHost_ + ":" + std::to_string(dbPort_);
-        std::unique_ptr<sql::Connection> conn(driver->connect(connUri, dbUser_, dbPassword_));
-        conn->setSchema(dbDb_);
-        /*  save countries  */
-        int created = 0;
-        auto begin = Utils::nowMicros();
-        std::unique_ptr<sql::PreparedStatement> stmt(conn->prepareStatement(
-            "replace into countries(id, `key`, name, name_en, weight) values(?, ?, ?, ?, ?)"));
-        for (const auto& it : countries_) {
-            const auto& country = it.second;
-            if (!country.store) {
-                continue;
-            }
-            stmt->setUInt(1, country.id);
-            stmt->setString(2, country.key);
-            stmt->setString(3, country.name);
-            stmt->setString(4, country.nameEn);
-            stmt->setUInt(5, country.weight);
-            stmt->execute();
-            created++;
-        }
-        logInfo("created %d countries in %f sec", created, (double) (Utils::nowMicros() - begin) / 1000000.0);
-        /*  save states  */
-        created = 0;
-        begin = Utils::nowMicros();
-        stmt.reset(conn->prepareStatement(
-            "replace into states(id, country_id, `key`, name, name_en, weight) values(?, ?, ?, ?, ?, ?)"));
-        for (const auto& it : states_) {
-            const auto& state = it.second;
-            if (!state.store) {
-                continue;
-            }
-            stmt->setUInt(1, state.id);
-            stmt->setUInt(2, state.countryId);
-            stmt->setString(3, state.key);
-            stmt->setString(4, state.name);
-            stmt->setString(5, state.nameEn);
-            stmt->setUInt(6, state.weight);
-            stmt->execute();
-            created++;
-        }
-        logInfo("created %d states in %f sec", created, (double) (Utils::nowMicros() - begin) / 1000000.0);
-        /*  save cities  */
-        created = 0;
-        begin = Utils::nowMicros();
-        stmt.reset(conn->prepareStatement(
-            "replace into cities(id, state_id, `key`, name, name_en, weight) values(?, ?, ?, ?, ?, ?)"));
-        for (const auto& it : cities_) {
-            const auto& city = it.second;
-            if (!city.store) {
-                continue;
-            }
-            stmt->setUInt(1, city.id);
-            stmt->setUInt(2, city.stateId);
-            stmt->setString(3, city.key);
-            stmt->setString(4, city.name);
-            stmt->setString(5, city.nameEn);
-            stmt->setUInt(6, city.weight);
-            stmt->execute();
-            created++;
-        }
-        logInfo("created %d cities in %f sec", created, (double) (Utils::nowMicros() - begin) / 1000000.0);
-    } catch (sql::SQLException &e) {
-        logError("db error: %s, code: %d", e.what(), e.getErrorCode());
-        throw GeoParserException("db exception");
+    if (mmdbFile_.empty()) {
+        return;
+    }
+    GeoMmdbWriter writer("ggAdNet-Geo", "ggAdNet geo ids over MaxMind GeoLite2");
+    static const protobuf::Geo::Asn noAsn;
+    auto asn = [this](uint32_t id) -> const protobuf::Geo::Asn& {
+        return id ? geodb_.asns(static_cast<int>(id - 1)) : noAsn;
+    };
+    for (const auto& e : geodb_.ipsv4()) {
+        const auto& a = asn(e.asn());
+        writer.insert(e.from(), e.to(), GeoDb::Element(e.country_id(), e.state_id(), e.city_id(),
+            e.country_key(), e.state_key(), e.city_name(), a.number(), a.organization()));
+    }
+    for (const auto& e : geodb_.ipsv6()) {
+        const auto& a = asn(e.asn());
+        writer.insert(GeoDb::IPv6(e.from_hi(), e.from_lo()), GeoDb::IPv6(e.to_hi(), e.to_lo()),
+            GeoDb::Element(e.country_id(), e.state_id(), e.city_id(), e.country_key(), e.state_key(), e.city_name(),
+                a.number(), a.organization()));
     }
+    if (!writer.save(mmdbFile_)) {
+        logError("can't save mmdb %s", mmdbFile_.c_str());
+        return;
+    }
+    logInfo("mmdb %s: %zu nodes, %zu records, %zu bytes of data", mmdbFile_.c_str(), writer.nodeCount(),
+        writer.recordCount(), writer.dataSize());
+}
+
+std::unique_ptr<sql::Connection>
+GeoParser::connect(sql::Driver *driver) const
+{
+    std::string connUri = "tcp://" + dbHost_ + ":" + std::to_string(dbPort_);
+    std::unique_ptr<sql::Connection> conn(driver->connect(connUri, dbUser_, dbPassword_));
+    conn->setSchema(dbDb_);
+    return conn;
 }
 
+namespace {
+
+std::string
+replaceQuery(const std::string& table, const std::string& columns, unsigned int columnsCount, size_t rows)
+{
+    std::string row = "(";
+    for (unsigned int i = 0; i < columnsCount; i++) {
+        row.append(i ? ", ?" : "?");
+    }
+    row.push_back(')');
+    std::string query = "replace into " + table + "(" + columns + ") values ";
+    for (size_t i = 0; i < rows; i++) {
+        if (i) {
+            query.append(", ");
+        }
+        query.append(row);
+    }
+    return query;
+}
+
+/*  multi-row replace of changed items, within the caller's transaction, bind() sets one row and returns the next column  */
+template <typename T, typename Bind>
+int
+saveItems(sql::Connection *conn, const std::string& table, const std::string& columns, unsigned int columnsCount,
+    const std::map<std::string, T>& items, size_t batchSize, Bind bind)
+{
+    std::vector<const T *> rows;
+    for (const auto& it : items) {
+        if (it.second.store) {
+            rows.push_back(&it.second);
+        }
+    }
+    std::unique_ptr<sql::PreparedStatement> stmt;
+    size_t stmtRows = 0;
+    for (size_t i = 0; i < rows.size(); i += batchSize) {
+        size_t n = std::min(batchSize, rows.size() - i);
+        if (n != stmtRows) {
+            stmt.reset(conn->prepareStatement(replaceQuery(table, columns, columnsCount, n)));
+            stmtRows = n;
+        }
+        unsigned int column = 1;
+        for (size_t j = 0; j < n; j++) {
+            column = bind(stmt.get(), column, *rows[i + j]);
+        }
+        stmt->execute();
+    }
+    return static_cast<int>(rows.size());
+}
+
+}
+
+void
+GeoParser::saveToDb()
+{
+    auto timed = [](const char *table, const std::function<int()>& save) {
+        auto begin = Utils::nowMicros();
+        int created = save();
+        logInfo("created %d %s in %f sec", created, table, (double) (Utils::nowMicros() - begin) / 1000000.0);
+    };
+    /*  foreign keys stay checked, so parents go before children, all in one transaction:
+        a failure leaves the dictionary as it was, nothing is committed  */
+    runOnConnections({
+        {"dictionary", [this, &timed](sql::Connection *conn) {
+            conn->setAutoCommit(false);
+            timed("countries", [this, conn] {
+                return saveItems(conn, "countries", "id, `key`, name, name_en, weight", 5, countries_, dbBatchSize_,
+                    [](sql::PreparedStatement *stmt, unsigned int c, const Country& country) {
+                        stmt->setUInt(c++, country.id);
+                        stmt->setString(c++, country.key);
+                        stmt->setString(c++, country.name);
+                        stmt->setString(c++, country.nameEn);
+                        stmt->setUInt(c++, country.weight);
+                        return c;
+                    });
+            });
+            timed("states", [this, conn] {
+                return saveItems(conn, "states", "id, country_id, `key`, name, name_en, weight", 6, states_, dbBatchSize_,
+                    [](sql::PreparedStatement *stmt, unsigned int c, const State& state) {
+                        stmt->setUInt(c++, state.id);
+                        stmt->setUInt(c++, state.countryId);
+                        stmt->setString(c++, state.key);
+                        stmt->setString(c++, state.name);
+                        stmt->setString(c++, state.nameEn);
+                        stmt->setUInt(c++, state.weight);
+                        return c;
+                    });
+            });
+            timed("cities", [this, conn] {
+                return saveItems(conn, "cities", "id, state_id, `key`, name, name_en, weight", 6, cities_, dbBatchSize_,
+                    [](sql::PreparedStatement *stmt, unsigned int c, const City& city) {
+                        stmt->setUInt(c++, city.id);
+                        stmt->setUInt(c++, city.stateId);
+                        stmt->setString(c++, city.key);
+                        stmt->setString(c++, city.name);
+                        stmt->setString(c++, city.nameEn);
+                        stmt->setUInt(c++, city.weight);
+                        return c;
+                    });
+            });
+            conn->commit();
+        }},
+    });
+}
@@ -1,15 +1,23 @@
 #pragma once
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "rapidjson/document.h"
 
+#include "base/cstring.h"
 #include "base/file_utils.h"
 #include "protobuf/geo.pb.h"
 
+namespace sql {
+class Connection;
+class Driver;
+}
+
 namespace ggAdNet {
 namespace Tools {
 
@@ -35,6 +43,7 @@ private:
         std::string key;
         std::string name;
         std::string nameEn;
+        std::vector<std::string> names;     // per locale, in locales_ order
         unsigned int weight;
         bool store;
 
@@ -56,28 +65,91 @@ private:
         unsigned int countryId;
         unsigned int stateId;
         unsigned int cityId;
-        CString country_key;
-        CString state_key;
-        CString city_name;
+        std::string countryKey;
+        std::string stateKey;
+        std::string cityName;
+
+        Location() : countryId(0), stateId(0), cityId(0) {}
+    };
+
+    /*  the most accurate coordinates seen in blocks of a city  */
+    struct CityPoint {
+        int32_t latitude;
+        int32_t longitude;
+        unsigned int accuracyRadius;
+    };
+
+    /*  a range of an asn blocks file, ipv4 addresses as is, asn is an index in asns + 1  */
+    struct AsnRange {
+        unsigned __int128 from;
+        unsigned __int128 to;
+        uint32_t asn;
+    };
+
+    struct Locale {
+        std::string locale;
+        std::string file;
+    };
+
+    /*  one row of a locations file, points into the mmapped file  */
+    struct LocaleRow {
+        unsigned int geonameId;
+        CString countryKey;
+        CString countryName;
+        CString stateKey;
+        CString stateName;
+        CString cityName;
+    };
+
+    struct LocaleFile {
+        std::string file;
+        std::unique_ptr<FileUtils::Mmap> mmap;
+        std::vector<LocaleRow> rows;
+        std::unordered_map<unsigned int, size_t> index;
+    };
 
-        Location() : countryId(0), stateId(0), cityId(0), country_key(""), state_key(""), city_name("") {}
+    struct DbJob {
+        const char *table;
+        std::function<void(sql::Connection *)> run;
     };
 
     void initConfig(const rapidjson::Document& config);
+    [[nodiscard]] std::unique_ptr<sql::Connection> connect(sql::Driver *driver) const;
+    [[nodiscard]] std::string dbToken(sql::Connection *conn) const;
+    void runOnConnections(const std::vector<DbJob>& jobs) const;
     void loadFromDb();
-    void loadLocations(const std::string& file, bool en = false);
+    bool loadSnapshot(const std::string& token);
+    void saveSnapshot();
+    void loadLocations();
+    void loadLocaleFile(LocaleFile& lf);
+    void updateNames(GeoItem& item, const std::vector<CString>& names, const CString& fallback);
     void loadIPv4Blocks();
     void loadIPv6Blocks();
+    uint32_t attributesId(const std::vector<CString>& values);
+    void addCityPoint(unsigned int cityId, const std::vector<CString>& values);
+    void storeCityLocations();
+    void loadAsnBlocks(const std::string& file, bool ipv6, std::vector<AsnRange>& ranges);
+    uint32_t asnId(const CString& number, const CString& organization);
+    void joinAsn();
+    static int32_t coordinate(const CString& value);
     void saveGeoDb();
+    void saveMmdb();
     void saveToDb();
 
     const std::string configFile_ = "geo_parser.conf";
     const std::string defaultMaxmindPath_ = "./";
     const std::string defaultMaxmindIpv4File_ = "GeoLite2-City-Blocks-IPv4.csv";
     const std::string defaultMaxmindIpv6File_ = "GeoLite2-City-Blocks-IPv6.csv";
-    const std::string defaultMaxmindLocationsRuFile_ = "GeoLite2-City-Locations-ru.csv";
-    const std::string defaultMaxmindLocationsEnFile_ = "GeoLite2-City-Locations-en.csv";
+    const std::string defaultMaxmindAsnIpv4File_ = "GeoLite2-ASN-Blocks-IPv4.csv";
+    const std::string defaultMaxmindAsnIpv6File_ = "GeoLite2-ASN-Blocks-IPv6.csv";
+    const std::string defaultMaxmindLocationsFilePrefix_ = "GeoLite2-City-Locations-";
+    const std::vector<std::string> defaultMaxmindLocales_ = {"en", "ru"};
+    const std::string defaultMaxmindNameLocale_ = "ru";
+    const std::string enLocale_ = "en";
     const std::string defaultGeoDbFile_ = "geodb.dat";
+    const size_t defaultDbBatchSize_ = 1000;
+    const std::string defaultSnapshotFile_ = "geo_dict.dat";
+    const int defaultGeoDbCityNeighbors_ = 10;
 
     /*  db config  */
     std::string dbHost_;
@@ -85,14 +157,25 @@ private:
     std::string dbUser_;
     std::string dbPassword_;
     std::string dbDb_;
+    size_t dbBatchSize_;
+    std::string snapshotFile_;          // empty disables the local dictionary snapshot
+    std::string mmdbFile_;              // empty disables mmdb output
     /*  maxmind config  */
     std::string maxmindPath_;
     std::string maxmindIpv4File_;
     std::string maxmindIpv6File_;
-    std::string maxmindLocationsRuFile_;
-    std::string maxmindLocationsEnFile_;
+    std::string maxmindAsnIpv4File_;
+    std::string maxmindAsnIpv6File_;
+    std::vector<Locale> locales_;       // first one drives the locations structure
+    size_t nameLocale_;                 // stored as name in db
+    size_t nameEnLocale_;               // stored as name_en in db
     /**/
     std::string geoDbFile_;
+    bool geoDbStoreNames_;
+    bool geoDbStoreAttributes_;
+    bool geoDbStoreCityLocations_;
+    bool geoDbStoreAsn_;
+    size_t geoDbCityNeighbors_;         // nearest cities stored per city
     /**/
     unsigned int countryId_;
     unsigned int stateId_;
@@ -101,6 +184,10 @@ private:
     std::map<std::string, State> states_;
     std::map<std::string, City> cities_;
     std::unordered_map<unsigned int, Location> locations_;
+    std::unordered_map<std::string, uint32_t> attributeIds_;    // serialized attributes to id
+    std::unordered_map<std::string, uint32_t> postalCodeIds_;
+    std::unordered_map<unsigned int, CityPoint> cityPoints_;
+    std::unordered_map<std::string, uint32_t> asnIds_;          // number and organization to id
     protobuf::Geo geodb_;
 };
 
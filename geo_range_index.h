@@ -0,0 +1,428 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "geo_image.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace ggAdNet {
+
+/*
+ *  Layout policies of RangeIndex, they order the range ends (and along with them starts
+ *  and values) and find the first end not less than a key. npos means no such end.
+ */
+
+/*  plain sorted array, branch-free binary search  */
+struct SortedLayout {
+
+    static constexpr size_t npos = static_cast<size_t>(-1);
+    static constexpr size_t first = 0;
+
+    template <typename Key>
+    static void arrange(std::vector<Key>& /*to*/, std::vector<Key>& /*from*/, std::vector<uint32_t>& /*values*/) {
+    }
+
+    static size_t count(size_t slots) {
+        return slots;
+    }
+
+    template <typename Key>
+    static size_t lowerBound(const Key *to, size_t n, Key key) {
+        if (n == 0) {
+            return npos;
+        }
+        const Key *base = to;
+        while (n > 1) {
+            size_t half = n / 2;
+            base = base[half - 1] < key ? base + half : base;
+            n -= half;
+        }
+        return *base < key ? npos : static_cast<size_t>(base - to);
+    }
+};
+
+/*  implicit binary tree in breadth first order, 1-based, slot 0 unused  */
+struct EytzingerLayout {
+
+    static constexpr size_t npos = static_cast<size_t>(-1);
+    static constexpr size_t first = 1;
+
+    template <typename Key>
+    static void arrange(std::vector<Key>& to, std::vector<Key>& from, std::vector<uint32_t>& values) {
+        size_t n = to.size();
+        std::vector<Key> t(n + 1);
+        std::vector<Key> f(n + 1);
+        std::vector<uint32_t> v(n + 1);
+        size_t i = 0;
+        fill(to, from, values, t, f, v, i, 1);
+        to.swap(t);
+        from.swap(f);
+        values.swap(v);
+    }
+
+    static size_t count(size_t slots) {
+        return slots ? slots - 1 : 0;
+    }
+
+    template <typename Key>
+    static size_t lowerBound(const Key *to, size_t n, Key key) {
+        /*  to has n + 1 slots  */
+        size_t k = 1;
+        while (k <= n) {
+            /*  the 16 descendants four levels down, one cache line of them per prefetch,
+                the last one too as an owned array needs not be line aligned  */
+            const Key *next = to + k * 16;
+            for (size_t i = 0; i < 16; i += keysPerLine<Key>()) {
+                __builtin_prefetch(next + i);
+            }
+            __builtin_prefetch(next + 15);
+            k = 2 * k + (to[k] < key);
+        }
+        k >>= __builtin_ffsll(static_cast<long long>(~k));
+        return k == 0 ? npos : k;
+    }
+
+private:
+
+    template <typename Key>
+    static constexpr size_t keysPerLine() {
+        return sizeof(Key) < 64 ? 64 / sizeof(Key) : 1;
+    }
+
+    template <typename Key>
+    static void fill(const std::vector<Key>& to, const std::vector<Key>& from, const std::vector<uint32_t>& values,
+            std::vector<Key>& t, std::vector<Key>& f, std::vector<uint32_t>& v, size_t& i, size_t k) {
+        if (k <= to.size()) {
+            fill(to, from, values, t, f, v, i, 2 * k);
+            t[k] = to[i];
+            f[k] = from[i];
+            v[k] = values[i];
+            i++;
+            fill(to, from, values, t, f, v, i, 2 * k + 1);
+        }
+    }
+};
+
+/*
+ *  Static index of disjoint [from, to] key ranges mapped to 32-bit values, one template
+ *  for ipv4 (uint32_t), /64 aligned ipv6 (uint64_t) and full ipv6 (unsigned __int128) keys.
+ *  Ranges are added, then build() lays them out and find() may be called.
+ */
+template <typename Key, typename Layout = EytzingerLayout>
+class RangeIndex
+{
+public:
+
+    static constexpr uint32_t npos = 0xffffffff;
+    static constexpr size_t noSlot = Layout::npos;
+
+    struct Range {
+        Key from;
+        Key to;
+        uint32_t value;
+    };
+
+    void add(Key from, Key to, uint32_t value) {
+        staged_.push_back({from, to, value});
+    }
+
+    void build() {
+        /*  last added wins on equal range ends  */
+        std::stable_sort(staged_.begin(), staged_.end(), [](const Range& a, const Range& b) {
+            return a.to < b.to;
+        });
+        std::vector<Key> to;
+        std::vector<Key> from;
+        std::vector<uint32_t> values;
+        for (size_t i = 0; i < staged_.size(); i++) {
+            if (i + 1 < staged_.size() && staged_[i + 1].to == staged_[i].to) {
+                continue;
+            }
+            to.push_back(staged_[i].to);
+            from.push_back(staged_[i].from);
+            values.push_back(staged_[i].value);
+        }
+        size_ = to.size();
+        std::vector<Range>().swap(staged_);
+        Layout::arrange(to, from, values);
+        to_.assign(std::move(to));
+        from_.assign(std::move(from));
+        values_.assign(std::move(values));
+    }
+
+    /*  arrays go to sections id .. id + 2  */
+    void save(GeoImageWriter& writer, uint32_t id) const {
+        writer.add(id, to_);
+        writer.add(id + 1, from_);
+        writer.add(id + 2, values_);
+    }
+
+    bool attach(const GeoImage& image, uint32_t id) {
+        if (!image.attach(id, to_) || !image.attach(id + 1, from_) || !image.attach(id + 2, values_)
+                || from_.size() != to_.size() || values_.size() != to_.size()) {
+            return false;
+        }
+        size_ = Layout::count(to_.size());
+        return true;
+    }
+
+    [[nodiscard]] uint32_t find(Key key) const {
+        size_t i = findSlot(key);
+        return i != noSlot ? values_[i] : npos;
+    }
+
+    /*  position of the range holding key, slots may be unused positions of the layout  */
+    [[nodiscard]] size_t findSlot(Key key) const {
+        size_t i = Layout::lowerBound(to_.data(), size_, key);
+        return i != Layout::npos && from_[i] <= key ? i : noSlot;
+    }
+
+    [[nodiscard]] size_t slots() const { return to_.size(); }
+    [[nodiscard]] uint32_t slotValue(size_t i) const { return values_[i]; }
+
+    /*  built ranges, in no particular order  */
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (size_t i = Layout::first; i < Layout::first + size_; i++) {
+            fn(from_[i], to_[i], values_[i]);
+        }
+    }
+
+    [[nodiscard]] size_t size() const { return size_; }
+    [[nodiscard]] size_t memory() const {
+        return to_.memory() + from_.memory() + values_.memory();
+    }
+
+private:
+    std::vector<Range> staged_;
+    GeoArray<Key> to_;
+    GeoArray<Key> from_;
+    GeoArray<uint32_t> values_;
+    size_t size_{0};
+};
+
+/*
+ *  Frame of reference compressed index of disjoint uint64_t ranges. Sorted ranges are cut
+ *  into blocks of up to 16, every block keeps a base (its first range start) and a shift,
+ *  range starts and exclusive ends are stored as 32-bit (key - base) >> shift deltas.
+ *  A skip list of block last keys finds the block, a SIMD compare of its end deltas finds
+ *  the range. Ranges not representable that way (never seen for CIDR ranges) go to a
+ *  plain RangeIndex.
+ */
+class CompressedRangeIndex
+{
+public:
+
+    static constexpr uint32_t npos = 0xffffffff;
+    static constexpr size_t noSlot = static_cast<size_t>(-1);
+    static constexpr size_t blockSize = 16;
+
+    void add(uint64_t from, uint64_t to, uint32_t value) {
+        ranges_.push_back({from, to, value});
+    }
+
+    void build() {
+        std::stable_sort(ranges_.begin(), ranges_.end(), [](const Range& a, const Range& b) {
+            return a.to < b.to;
+        });
+        std::vector<Range> ranges;
+        for (size_t i = 0; i < ranges_.size(); i++) {
+            if (i + 1 < ranges_.size() && ranges_[i + 1].to == ranges_[i].to) {
+                continue;
+            }
+            ranges.push_back(ranges_[i]);
+        }
+        std::vector<Range>().swap(ranges_);
+        /*  greedy blocks  */
+        std::vector<uint64_t> bases;
+        std::vector<uint64_t> blockLast;
+        std::vector<uint32_t> offsets;
+        std::vector<uint8_t> shifts;
+        std::vector<uint8_t> counts;
+        std::vector<uint32_t> ends;
+        std::vector<uint32_t> froms;
+        std::vector<uint32_t> values;
+        size_t i = 0;
+        while (i < ranges.size()) {
+            uint64_t base = ranges[i].from;
+            unsigned int shift = 64;
+            size_t n = 0;
+            while (n < blockSize && i + n < ranges.size()) {
+                unsigned int s = std::min(shift, std::min(ctz(ranges[i + n].from - base), ctz(end(ranges[i + n]) - base)));
+                if (((end(ranges[i + n]) - base) >> s) > maxDelta_) {
+                    break;
+                }
+                shift = s;
+                n++;
+            }
+            if (n == 0) {
+                overflow_.add(ranges[i].from, ranges[i].to, ranges[i].value);
+                i++;
+                continue;
+            }
+            bases.push_back(base);
+            offsets.push_back(static_cast<uint32_t>(ends.size()));
+            shifts.push_back(static_cast<uint8_t>(shift));
+            counts.push_back(static_cast<uint8_t>(n));
+            blockLast.push_back(ranges[i + n - 1].to);
+            for (size_t j = 0; j < n; j++) {
+                const auto& r = ranges[i + j];
+                ends.push_back(static_cast<uint32_t>((end(r) - base) >> shift));
+                froms.push_back(static_cast<uint32_t>((r.from - base) >> shift));
+                values.push_back(r.value);
+            }
+            i += n;
+        }
+        /*  the last block is read as a whole 16 lanes  */
+        ends.resize(ends.size() + blockSize, npos);
+        size_ = ranges.size();
+        overflow_.build();
+        bases_.assign(std::move(bases));
+        blockLast_.assign(std::move(blockLast));
+        offsets_.assign(std::move(offsets));
+        shifts_.assign(std::move(shifts));
+        counts_.assign(std::move(counts));
+        ends_.assign(std::move(ends));
+        froms_.assign(std::move(froms));
+        values_.assign(std::move(values));
+    }
+
+    /*  arrays go to sections id .. id + 7, the overflow index to id + 8 .. id + 10  */
+    void save(GeoImageWriter& writer, uint32_t id) const {
+        writer.add(id, bases_);
+        writer.add(id + 1, blockLast_);
+        writer.add(id + 2, offsets_);
+        writer.add(id + 3, shifts_);
+        writer.add(id + 4, counts_);
+        writer.add(id + 5, ends_);
+        writer.add(id + 6, froms_);
+        writer.add(id + 7, values_);
+        overflow_.save(writer, id + 8);
+    }
+
+    bool attach(const GeoImage& image, uint32_t id) {
+        if (!image.attach(id, bases_) || !image.attach(id + 1, blockLast_) || !image.attach(id + 2, offsets_)
+                || !image.attach(id + 3, shifts_) || !image.attach(id + 4, counts_) || !image.attach(id + 5, ends_)
+                || !image.attach(id + 6, froms_) || !image.attach(id + 7, values_) || !overflow_.attach(image, id + 8)) {
+            return false;
+        }
+        size_t blocks = bases_.size();
+        if (blockLast_.size() != blocks || offsets_.size() != blocks || shifts_.size() != blocks || counts_.size() != blocks
+                || values_.size() != froms_.size() || ends_.size() != froms_.size() + blockSize) {
+            return false;
+        }
+        size_ = froms_.size() + overflow_.size();
+        return true;
+    }
+
+    [[nodiscard]] uint32_t find(uint64_t key) const {
+        size_t i = findSlot(key);
+        return i != noSlot ? slotValue(i) : npos;
+    }
+
+    /*  block ranges first, then the overflow index slots  */
+    [[nodiscard]] size_t findSlot(uint64_t key) const {
+        size_t b = SortedLayout::lowerBound(blockLast_.data(), blockLast_.size(), key);
+        if (b != SortedLayout::npos && key >= bases_[b]) {
+            /*  key <= block last, q is below the last end delta  */
+            auto q = static_cast<uint32_t>((key - bases_[b]) >> shifts_[b]);
+            size_t off = offsets_[b];
+            size_t i = off + countNotAbove(ends_.data() + off, q, counts_[b]);
+            if (froms_[i] <= q) {
+                return i;
+            }
+        }
+        size_t i = overflow_.size() ? overflow_.findSlot(key) : noSlot;
+        return i != noSlot ? froms_.size() + i : noSlot;
+    }
+
+    [[nodiscard]] size_t slots() const { return froms_.size() + overflow_.slots(); }
+    [[nodiscard]] uint32_t slotValue(size_t i) const {
+        return i < froms_.size() ? values_[i] : overflow_.slotValue(i - froms_.size());
+    }
+
+    /*  built ranges, in no particular order  */
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        for (size_t b = 0; b < bases_.size(); b++) {
+            for (size_t i = offsets_[b]; i < offsets_[b] + counts_[b]; i++) {
+                auto from = bases_[b] + (static_cast<unsigned __int128>(froms_[i]) << shifts_[b]);
+                auto end = bases_[b] + (static_cast<unsigned __int128>(ends_[i]) << shifts_[b]);
+                fn(static_cast<uint64_t>(from), static_cast<uint64_t>(end - 1), values_[i]);
+            }
+        }
+        overflow_.forEach(fn);
+    }
+
+    [[nodiscard]] size_t size() const { return size_; }
+    [[nodiscard]] size_t blocks() const { return bases_.size(); }
+    [[nodiscard]] size_t memory() const {
+        return bases_.memory() + blockLast_.memory() + offsets_.memory() + shifts_.memory() + counts_.memory()
+            + ends_.memory() + froms_.memory() + values_.memory() + overflow_.memory();
+    }
+
+private:
+
+    struct Range {
+        uint64_t from;
+        uint64_t to;
+        uint32_t value;
+    };
+
+    static constexpr uint64_t maxDelta_ = 0xfffffffe;
+
+    /*  exclusive end, the last range of the key space ends at 2^64  */
+    static unsigned __int128 end(const Range& r) {
+        return static_cast<unsigned __int128>(r.to) + 1;
+    }
+
+    static unsigned int ctz(unsigned __int128 v) {
+        auto lo = static_cast<uint64_t>(v);
+        return lo ? static_cast<unsigned int>(__builtin_ctzll(lo)) : 64;
+    }
+
+    /*  number of the first n deltas not above q, lanes past n belong to the next block  */
+    static size_t countNotAbove(const uint32_t *d, uint32_t q, unsigned int n) {
+        unsigned int above = (0xffffu << n) & 0xffffu;
+#if defined(__AVX2__)
+        const __m256i bias = _mm256_set1_epi32(static_cast<int>(0x80000000));
+        const __m256i k = _mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(q)), bias);
+        __m256i a = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(d)), bias);
+        __m256i b = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(d + 8)), bias);
+        above |= static_cast<unsigned int>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, k))))
+            | static_cast<unsigned int>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(b, k)))) << 8;
+#elif defined(__SSE2__)
+        const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000));
+        const __m128i k = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(q)), bias);
+        for (unsigned int j = 0; j < 4; j++) {
+            __m128i a = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(d + j * 4)), bias);
+            above |= static_cast<unsigned int>(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, k)))) << (j * 4);
+        }
+#else
+        for (unsigned int j = 0; j < n; j++) {
+            above |= static_cast<unsigned int>(d[j] > q) << j;
+        }
+#endif
+        return blockSize - static_cast<size_t>(__builtin_popcount(above & 0xffffu));
+    }
+
+    std::vector<Range> ranges_;         // added, not built yet
+    GeoArray<uint64_t> bases_;
+    GeoArray<uint64_t> blockLast_;      // skip index
+    GeoArray<uint32_t> offsets_;
+    GeoArray<uint8_t> shifts_;
+    GeoArray<uint8_t> counts_;
+    GeoArray<uint32_t> ends_;
+    GeoArray<uint32_t> froms_;
+    GeoArray<uint32_t> values_;
+    RangeIndex<uint64_t, SortedLayout> overflow_;
+    size_t size_{0};
+};
+
+} // end of ggAdNet namespace
@@ -0,0 +1,315 @@
+#include "geo_resolver.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "base/exceptions.h"
+#include "base/file_utils.h"
+#include "base/geo_db.h"
+#include "base/log.h"
+#include "base/utils.h"
+
+using namespace ggAdNet;
+using namespace ggAdNet::Tools;
+
+namespace {
+
+const char *columnNames[] = {"country_id", "state_id", "city_id", "country_key", "state_key", "city_name"};
+
+void
+appendUint(std::string& out, unsigned int v)
+{
+    char buf[16];
+    char *p = buf + sizeof(buf);
+    do {
+        *--p = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v);
+    out.append(p, static_cast<size_t>(buf + sizeof(buf) - p));
+}
+
+/*  input pages already resolved and written are not needed anymore  */
+void
+dropPages(const char *begin, const char *end)
+{
+    auto page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    auto from = (reinterpret_cast<uintptr_t>(begin) + page - 1) & ~(page - 1);
+    auto to = reinterpret_cast<uintptr_t>(end) & ~(page - 1);
+    if (from < to) {
+        madvise(reinterpret_cast<void *>(from), to - from, MADV_DONTNEED);
+    }
+}
+
+}
+
+GeoResolver::GeoResolver(std::string input, std::string output)
+    : input_(std::move(input)), output_(std::move(output))
+{
+    config_ = Utils::loadJsonFile(configFile_);
+    initConfig(config_);
+    Log::init(config_);
+}
+
+GeoResolver::~GeoResolver()
+{
+    Log::clean();
+}
+
+void
+GeoResolver::initConfig(const rapidjson::Document& config)
+{
+    const auto& resolver = Utils::configSection(config, "resolver");
+    int threads = Utils::configInt(resolver, "threads", static_cast<int>(std::thread::hardware_concurrency()));
+    if (threads <= 0) {
+        throw ConfigException("resolver.threads must be positive");
+    }
+    threads_ = static_cast<size_t>(threads);
+    int column = Utils::configInt(resolver, "column", defaultColumn_);
+    if (column < 0) {
+        throw ConfigException("resolver.column can't be negative");
+    }
+    column_ = static_cast<size_t>(column);
+    std::string delimiter = Utils::configString(resolver, "delimiter", defaultDelimiter_);
+    if (delimiter.size() != 1 || delimiter[0] == '\n' || delimiter[0] == '"') {
+        throw ConfigException("resolver.delimiter must be a single character");
+    }
+    delimiter_ = delimiter[0];
+    header_ = false;
+    if (resolver.HasMember("header")) {
+        if (!resolver["header"].IsBool()) {
+            throw ConfigException("resolver.header must be a boolean");
+        }
+        header_ = resolver["header"].GetBool();
+    }
+    int chunkSize = Utils::configInt(resolver, "chunk_size", defaultChunkSize_);
+    if (chunkSize < 4096) {
+        throw ConfigException("resolver.chunk_size can't be less than 4096");
+    }
+    chunkSize_ = static_cast<size_t>(chunkSize);
+    int window = Utils::configInt(resolver, "window", threads * 4);
+    if (window < threads) {
+        throw ConfigException("resolver.window can't be less than resolver.threads");
+    }
+    window_ = static_cast<size_t>(window);
+}
+
+void
+GeoResolver::run()
+{
+    auto begin = Utils::nowMicros();
+    GeoDb::init(config_);
+    logInfo("geodb loaded in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
+    /**/
+    FileUtils::Mmap mmap(input_);
+    if (mmap.open() != FileUtils::Mmap::ReturnCode::SUCCESS) {
+        logError("can't mmap file %s", input_.c_str());
+        throw GeoResolverException("can't mmap input file");
+    }
+    const char *p = mmap.ptr();
+    const char *end = p + mmap.size();
+    if (p) {
+        madvise(const_cast<char *>(p), mmap.size(), MADV_SEQUENTIAL);
+    }
+    FILE *fd = output_ == "-" ? stdout : fopen(output_.c_str(), "wb");
+    if (!fd) {
+        logError("can't fopen %s for writing", output_.c_str());
+        throw GeoResolverException("can't open output file");
+    }
+    /*  header  */
+    if (header_ && p < end) {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', static_cast<size_t>(end - p)));
+        const char *next = eol ? eol + 1 : end;
+        std::string out(p, eol ? static_cast<size_t>(eol - p) : static_cast<size_t>(end - p));
+        if (!out.empty() && out.back() == '\r') {
+            out.pop_back();
+        }
+        for (const char *name : columnNames) {
+            out += delimiter_;
+            out += name;
+        }
+        out += '\n';
+        fwrite(out.data(), 1, out.size(), fd);
+        p = next;
+    }
+    /*  chunks end at line ends  */
+    chunks_.clear();
+    while (p < end) {
+        const char *e = static_cast<size_t>(end - p) > chunkSize_ ? p + chunkSize_ : end;
+        if (e < end) {
+            const char *eol = static_cast<const char *>(memchr(e, '\n', static_cast<size_t>(end - e)));
+            e = eol ? eol + 1 : end;
+        }
+        chunks_.push_back({p, e, std::string(), false});
+        p = e;
+    }
+    next_ = 0;
+    written_ = 0;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads_; i++) {
+        workers.emplace_back([this] {
+            workerLoop();
+        });
+    }
+    /*  write in input order  */
+    size_t bytes = 0;
+    bool failed = false;
+    for (size_t i = 0; i < chunks_.size(); i++) {
+        std::string out;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            cond_.wait(lock, [this, i] {
+                return chunks_[i].done;
+            });
+            out.swap(chunks_[i].out);
+        }
+        if (!failed && fwrite(out.data(), 1, out.size(), fd) != out.size()) {
+            logError("can't write %s, error: %s (%d)", output_.c_str(), strerror(errno), errno);
+            failed = true;
+        }
+        bytes += out.size();
+        dropPages(chunks_[i].begin, chunks_[i].end);
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            written_++;
+        }
+        cond_.notify_all();
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    if (fd != stdout) {
+        fclose(fd);
+    } else {
+        fflush(fd);
+    }
+    GeoDb::stop();
+    if (failed) {
+        throw GeoResolverException("can't write output file");
+    }
+    double seconds = (double) (Utils::nowMicros() - begin) / 1000000.0;
+    logInfo("resolved %zu bytes into %zu bytes in %f sec, %f MB/s", mmap.size(), bytes, seconds,
+        seconds > 0.0 ? (double) mmap.size() / seconds / 1048576.0 : 0.0);
+}
+
+void
+GeoResolver::workerLoop()
+{
+    for (;;) {
+        size_t i;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            cond_.wait(lock, [this] {
+                return next_ >= chunks_.size() || next_ < written_ + window_;
+            });
+            if (next_ >= chunks_.size()) {
+                return;
+            }
+            i = next_++;
+        }
+        Chunk& chunk = chunks_[i];
+        std::string out;
+        out.reserve(static_cast<size_t>(chunk.end - chunk.begin) * 3 / 2);
+        chunk.out.swap(out);
+        resolveChunk(chunk);
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            chunk.done = true;
+        }
+        cond_.notify_all();
+    }
+}
+
+void
+GeoResolver::resolveChunk(Chunk& chunk) const
+{
+    std::vector<CString> lines;
+    std::vector<CString> ips;
+    std::vector<GeoDb::Element> elements(batchSize_);
+    lines.reserve(batchSize_);
+    ips.reserve(batchSize_);
+    const char *p = chunk.begin;
+    while (p < chunk.end) {
+        lines.clear();
+        ips.clear();
+        while (p < chunk.end && lines.size() < batchSize_) {
+            const char *eol = static_cast<const char *>(memchr(p, '\n', static_cast<size_t>(chunk.end - p)));
+            const char *e = eol ? eol : chunk.end;
+            const char *next = eol ? eol + 1 : chunk.end;
+            if (e > p && e[-1] == '\r') {
+                e--;
+            }
+            CString line;
+            line.assign(p, static_cast<int>(e - p));
+            lines.push_back(line);
+            ips.push_back(ipField(p, e));
+            p = next;
+        }
+        GeoDb::getIps(ips.data(), ips.size(), elements.data());
+        for (size_t i = 0; i < lines.size(); i++) {
+            const auto& el = elements[i];
+            chunk.out.append(lines[i].data, static_cast<size_t>(lines[i].size));
+            chunk.out += delimiter_;
+            if (el.countryId || !el.countryKey.empty()) {
+                appendUint(chunk.out, el.countryId);
+                chunk.out += delimiter_;
+                appendUint(chunk.out, el.stateId);
+                chunk.out += delimiter_;
+                appendUint(chunk.out, el.cityId);
+            } else {
+                chunk.out += delimiter_;
+                chunk.out += delimiter_;
+            }
+            chunk.out += delimiter_;
+            appendField(chunk.out, el.countryKey);
+            chunk.out += delimiter_;
+            appendField(chunk.out, el.stateKey);
+            chunk.out += delimiter_;
+            appendField(chunk.out, el.cityName);
+            chunk.out += '\n';
+        }
+    }
+}
+
+CString
+GeoResolver::ipField(const char *p, const char *end) const
+{
+    for (size_t column = 0; column < column_; column++) {
+        const char *d = static_cast<const char *>(memchr(p, delimiter_, static_cast<size_t>(end - p)));
+        if (!d) {
+            return CString();
+        }
+        p = d + 1;
+    }
+    const char *d = static_cast<const char *>(memchr(p, delimiter_, static_cast<size_t>(end - p)));
+    const char *e = d ? d : end;
+    /*  csv quoted  */
+    if (e - p >= 2 && *p == '"' && e[-1] == '"') {
+        p++;
+        e--;
+    }
+    CString ip;
+    ip.assign(p, static_cast<int>(e - p));
+    return ip;
+}
+
+void
+GeoResolver::appendField(std::string& out, const CString& value) const
+{
+    if (!memchr(value.data, delimiter_, static_cast<size_t>(value.size)) && !memchr(value.data, '"', static_cast<size_t>(value.size))) {
+        out.append(value.data, static_cast<size_t>(value.size));
+        return;
+    }
+    out += '"';
+    for (int i = 0; i < value.size; i++) {
+        if (value.data[i] == '"') {
+            out += '"';
+        }
+        out += value.data[i];
+    }
+    out += '"';
+}
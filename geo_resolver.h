@@ -0,0 +1,76 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "rapidjson/document.h"
+
+#include "base/cstring.h"
+
+namespace ggAdNet {
+namespace Tools {
+
+class GeoResolverException: public std::runtime_error
+{
+public:
+    explicit GeoResolverException(const std::string& what) : std::runtime_error(what) {};
+    explicit GeoResolverException(const char *what) : std::runtime_error(what) {};
+};
+
+/*
+ *  Offline bulk resolver: appends geo columns (country, state and city ids, country and state
+ *  keys, city name) to every line of a delimited text file. The input is mmapped and cut into
+ *  chunks at line ends, a pool of threads resolves chunks in batches, the output is written in
+ *  input order with at most resolver.window chunks in memory.
+ */
+class GeoResolver
+{
+public:
+
+    GeoResolver(std::string input, std::string output);
+    ~GeoResolver();
+    void run();
+
+private:
+
+    struct Chunk {
+        const char *begin;
+        const char *end;
+        std::string out;
+        bool done;
+    };
+
+    void initConfig(const rapidjson::Document& config);
+    void workerLoop();
+    void resolveChunk(Chunk& chunk) const;
+    [[nodiscard]] CString ipField(const char *p, const char *end) const;
+    void appendField(std::string& out, const CString& value) const;
+
+    const std::string configFile_ = "geo_resolver.conf";
+    const int defaultColumn_ = 0;
+    const std::string defaultDelimiter_ = "\t";
+    const int defaultChunkSize_ = 4 * 1024 * 1024;
+    const size_t batchSize_ = 1024;
+
+    std::string input_;
+    std::string output_;                // - for stdout
+    /*  config  */
+    rapidjson::Document config_;
+    size_t threads_{0};
+    size_t column_{0};                  // 0-based ip column
+    char delimiter_{'\t'};
+    bool header_{false};
+    size_t chunkSize_{0};               // bytes
+    size_t window_{0};                  // chunks resolved ahead of the writer
+    /**/
+    std::vector<Chunk> chunks_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    size_t next_{0};                    // next chunk to resolve
+    size_t written_{0};
+};
+
+} // end of Tools namespace
+} // end of ggAdNet namespace
@@ -0,0 +1,170 @@
+#include "geo_reverse_index.h"
+
+#include <algorithm>
+
+using namespace ggAdNet;
+
+namespace {
+
+typedef GeoReverseIndex::Key Key;
+
+const Key keyMax = ~static_cast<Key>(0);
+
+void
+putVarint(std::vector<uint8_t>& out, Key v)
+{
+    while (v >= 0x80) {
+        out.push_back(static_cast<uint8_t>(v) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+Key
+getVarint(const uint8_t *&p)
+{
+    Key v = 0;
+    unsigned int shift = 0;
+    while (*p & 0x80) {
+        v |= static_cast<Key>(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    v |= static_cast<Key>(*p++) << shift;
+    return v;
+}
+
+unsigned int
+ctz(Key v)
+{
+    auto lo = static_cast<uint64_t>(v);
+    auto hi = static_cast<uint64_t>(v >> 64);
+    if (lo) {
+        return static_cast<unsigned int>(__builtin_ctzll(lo));
+    }
+    return hi ? 64 + static_cast<unsigned int>(__builtin_ctzll(hi)) : 128;
+}
+
+}
+
+void
+GeoReverseIndex::build()
+{
+    std::sort(staged_.begin(), staged_.end(), [](const Staged& a, const Staged& b) {
+        if (a.location != b.location) {
+            return a.location < b.location;
+        }
+        return a.family != b.family ? a.family < b.family : a.from < b.from;
+    });
+    std::vector<Entry> entries;
+    std::vector<uint8_t> postings;
+    size_t i = 0;
+    while (i < staged_.size()) {
+        Entry entry{};
+        entry.location = staged_[i].location;
+        for (uint32_t family = 0; family < f_count; family++) {
+            entry.offset[family] = postings.size();
+            Key addresses = 0;
+            Key end = 0;                    // exclusive end of the previous range
+            bool any = false;
+            while (i < staged_.size() && staged_[i].location == entry.location && staged_[i].family == family) {
+                Key from = staged_[i].from;
+                Key to = staged_[i].to;
+                /*  coalesce adjacent and overlapping ones  */
+                for (i++; i < staged_.size() && staged_[i].location == entry.location && staged_[i].family == family; i++) {
+                    if (to == keyMax || staged_[i].from > to + 1) {
+                        break;
+                    }
+                    to = std::max(to, staged_[i].to);
+                }
+                putVarint(postings, from - end);
+                putVarint(postings, to - from);
+                Key size = to - from + 1;
+                addresses = size == 0 || addresses + size < addresses ? keyMax : addresses + size;
+                end = to + 1;
+                entry.count[family]++;
+                any = true;
+                if (to == keyMax) {
+                    /*  nothing can follow the end of the address space  */
+                    while (i < staged_.size() && staged_[i].location == entry.location && staged_[i].family == family) {
+                        i++;
+                    }
+                }
+            }
+            if (any) {
+                entry.addressesHi[family] = static_cast<uint64_t>(addresses >> 64);
+                entry.addressesLo[family] = static_cast<uint64_t>(addresses);
+            }
+        }
+        entries.push_back(entry);
+    }
+    std::vector<Staged>().swap(staged_);
+    entries_.assign(std::move(entries));
+    postings_.assign(std::move(postings));
+}
+
+const GeoReverseIndex::Entry *
+GeoReverseIndex::find(Level level, uint32_t id) const
+{
+    uint64_t key = location(level, id);
+    const Entry *begin = entries_.data();
+    const Entry *end = begin + entries_.size();
+    const Entry *it = std::lower_bound(begin, end, key, [](const Entry& e, uint64_t key) {
+        return e.location < key;
+    });
+    return it != end && it->location == key ? it : nullptr;
+}
+
+bool
+GeoReverseIndex::ranges(Level level, uint32_t id, Family family, std::vector<Range>& out) const
+{
+    out.clear();
+    const Entry *entry = find(level, id);
+    if (!entry) {
+        return false;
+    }
+    out.reserve(entry->count[family]);
+    const uint8_t *p = postings_.data() + entry->offset[family];
+    Key end = 0;
+    for (uint32_t i = 0; i < entry->count[family]; i++) {
+        Key from = end + getVarint(p);
+        Key to = from + getVarint(p);
+        out.push_back({from, to});
+        end = to + 1;
+    }
+    return true;
+}
+
+GeoReverseIndex::Key
+GeoReverseIndex::addresses(Level level, uint32_t id, Family family) const
+{
+    const Entry *entry = find(level, id);
+    return entry ? static_cast<Key>(entry->addressesHi[family]) << 64 | entry->addressesLo[family] : 0;
+}
+
+size_t
+GeoReverseIndex::rangeCount(Level level, uint32_t id, Family family) const
+{
+    const Entry *entry = find(level, id);
+    return entry ? entry->count[family] : 0;
+}
+
+void
+GeoReverseIndex::cover(const Range& range, unsigned int bits, std::vector<Cidr>& out)
+{
+    Key from = range.from;
+    Key span = range.to - range.from;
+    for (;;) {
+        /*  the largest aligned block at from that still fits  */
+        unsigned int k = std::min(ctz(from), bits);
+        while (k < 128 ? (static_cast<Key>(1) << k) - 1 > span : span != keyMax) {
+            k--;
+        }
+        out.push_back({from, bits - k});
+        Key size = k < 128 ? static_cast<Key>(1) << k : 0;
+        if (size == 0 || span < size) {
+            break;
+        }
+        from += size;
+        span -= size;
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "geo_image.h"
+
+namespace ggAdNet {
+
+/*
+ *  Location to networks index: for every country, state and city id the ipv4 and ipv6
+ *  ranges it covers. Adjacent and overlapping ranges of a location are coalesced, the
+ *  result is stored sorted as a varint coded posting list of (gap to the previous range,
+ *  range length) pairs along with the total address count.
+ */
+class GeoReverseIndex
+{
+public:
+
+    typedef unsigned __int128 Key;      // ipv4 addresses as is
+
+    enum Level : uint32_t {
+        l_country,
+        l_state,
+        l_city
+    };
+
+    enum Family : uint32_t {
+        f_ipv4,
+        f_ipv6,
+        f_count
+    };
+
+    struct Range {
+        Key from;
+        Key to;
+    };
+
+    struct Cidr {
+        Key prefix;
+        unsigned int length;
+    };
+
+    /*  id 0 means unknown and is not indexed  */
+    void add(Level level, uint32_t id, Family family, Key from, Key to) {
+        if (id) {
+            staged_.push_back({location(level, id), family, from, to});
+        }
+    }
+
+    /*  must be called once all ranges are added  */
+    void build();
+
+    /*  arrays go to sections id .. id + 1  */
+    void save(GeoImageWriter& writer, uint32_t id) const {
+        writer.add(id, entries_);
+        writer.add(id + 1, postings_);
+    }
+
+    bool attach(const GeoImage& image, uint32_t id) {
+        return image.attach(id, entries_) && image.attach(id + 1, postings_);
+    }
+
+    /*  coalesced ranges of a location in address order, false if it has none in any family  */
+    bool ranges(Level level, uint32_t id, Family family, std::vector<Range>& out) const;
+    /*  saturates at 2^128 - 1  */
+    [[nodiscard]] Key addresses(Level level, uint32_t id, Family family) const;
+    [[nodiscard]] size_t rangeCount(Level level, uint32_t id, Family family) const;
+
+    /*  minimal set of prefixes covering [from, to] in a bits wide address space  */
+    static void cover(const Range& range, unsigned int bits, std::vector<Cidr>& out);
+
+    [[nodiscard]] size_t size() const { return entries_.size(); }
+    [[nodiscard]] size_t memory() const { return entries_.memory() + postings_.memory(); }
+
+private:
+
+    struct Staged {
+        uint64_t location;
+        uint32_t family;
+        Key from;
+        Key to;
+    };
+
+    /*  as laid out in an image, sorted by location  */
+    struct Entry {
+        uint64_t location;
+        uint64_t offset[f_count];           // into postings_
+        uint64_t addressesHi[f_count];
+        uint64_t addressesLo[f_count];
+        uint32_t count[f_count];
+    };
+
+    static uint64_t location(Level level, uint32_t id) {
+        return static_cast<uint64_t>(level) << 32 | id;
+    }
+
+    [[nodiscard]] const Entry *find(Level level, uint32_t id) const;
+
+    std::vector<Staged> staged_;
+    GeoArray<Entry> entries_;
+    GeoArray<uint8_t> postings_;
+};
+
+} // end of ggAdNet namespace
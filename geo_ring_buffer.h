@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace ggAdNet {
+
+/*
+ *  Bounded lock-free queue for many producers and one consumer. Every cell carries a
+ *  sequence number telling whose turn it is: producers claim a position with one CAS
+ *  and publish the cell by bumping its sequence, a full queue makes push() fail rather
+ *  than wait, so producers never block.
+ */
+template <typename T>
+class GeoRingBuffer
+{
+public:
+
+    /*  capacity is rounded up to a power of two  */
+    explicit GeoRingBuffer(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask_ = size - 1;
+        cells_ = std::make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; i++) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    GeoRingBuffer(const GeoRingBuffer&) = delete;
+    GeoRingBuffer& operator=(const GeoRingBuffer&) = delete;
+
+    /*  any thread, false when full  */
+    bool push(const T& value) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        Cell *cell;
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /*  the consumer thread only, false when empty  */
+    bool pop(T& value) {
+        Cell& cell = cells_[tail_ & mask_];
+        if (cell.seq.load(std::memory_order_acquire) != tail_ + 1) {
+            return false;
+        }
+        value = cell.value;
+        cell.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+        tail_++;
+        return true;
+    }
+
+    [[nodiscard]] size_t capacity() const { return mask_ + 1; }
+
+private:
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) size_t tail_{0};
+};
+
+} // end of ggAdNet namespace
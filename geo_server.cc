@@ -0,0 +1,487 @@
+#include "geo_server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "base/exceptions.h"
+#include "base/log.h"
+#include "base/utils.h"
+
+using namespace ggAdNet;
+using namespace ggAdNet::Tools;
+
+namespace {
+
+const size_t maxEvents = 64;
+const int maxAccepts = 16;              // per wakeup, leaves the rest to other workers
+
+void
+appendUint(std::string& out, unsigned int v)
+{
+    char buf[16];
+    char *p = buf + sizeof(buf);
+    do {
+        *--p = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while (v);
+    out.append(p, static_cast<size_t>(buf + sizeof(buf) - p));
+}
+
+uint16_t
+packedSize(const CString& s)
+{
+    return static_cast<uint16_t>(std::min(s.size, 0xffff));
+}
+
+void
+appendPackedString(std::string& out, const CString& s)
+{
+    out.append(s.data, packedSize(s));
+}
+
+}
+
+GeoServer::GeoServer()
+{
+    config_ = Utils::loadJsonFile(configFile_);
+    initConfig(config_);
+    Log::init(config_);
+}
+
+GeoServer::~GeoServer()
+{
+    Log::clean();
+}
+
+void
+GeoServer::initConfig(const rapidjson::Document& config)
+{
+    const auto& server = Utils::configSection(config, "server");
+    socket_ = Utils::configString(server, "socket", defaultSocket_);
+    if (socket_.empty() || socket_.size() >= sizeof(sockaddr_un::sun_path)) {
+        throw ConfigException("server.socket must be a path shorter than 108 characters");
+    }
+    int workers = Utils::configInt(server, "workers", static_cast<int>(std::thread::hardware_concurrency()));
+    if (workers <= 0) {
+        throw ConfigException("server.workers must be positive");
+    }
+    workers_ = static_cast<size_t>(workers);
+    pinWorkers_ = true;
+    if (server.HasMember("pin_workers")) {
+        if (!server["pin_workers"].IsBool()) {
+            throw ConfigException("server.pin_workers must be a boolean");
+        }
+        pinWorkers_ = server["pin_workers"].GetBool();
+    }
+    int maxBatch = Utils::configInt(server, "max_batch", defaultMaxBatch_);
+    if (maxBatch <= 0) {
+        throw ConfigException("server.max_batch must be positive");
+    }
+    maxBatch_ = static_cast<size_t>(maxBatch);
+    backlog_ = Utils::configInt(server, "backlog", defaultBacklog_);
+    if (backlog_ <= 0) {
+        throw ConfigException("server.backlog must be positive");
+    }
+}
+
+void
+GeoServer::run()
+{
+    /*  blocked before any thread starts, geodb ones included, so only sigwait() below sees them  */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigset_t previous;
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    auto begin = Utils::nowMicros();
+    GeoDb::init(config_);
+    logInfo("geodb loaded in %f sec", (double) (Utils::nowMicros() - begin) / 1000000.0);
+    listen();
+    /*  workers go round the cpus the process may run on  */
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    stop_ = false;
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (size_t i = 0; i < workers_; i++) {
+        auto worker = std::make_unique<Worker>();
+        worker->epoll = epoll_create1(EPOLL_CLOEXEC);
+        worker->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (worker->epoll < 0 || worker->event < 0) {
+            logError("can't create epoll, error: %s (%d)", strerror(errno), errno);
+            throw GeoServerException("can't create epoll");
+        }
+        /*  one worker is woken per connection  */
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = nullptr;
+        epoll_ctl(worker->epoll, EPOLL_CTL_ADD, listen_, &ev);
+        ev.events = EPOLLIN;
+        ev.data.ptr = worker.get();
+        epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->event, &ev);
+        worker->cpu = pinWorkers_ && !cpus.empty() ? cpus[i % cpus.size()] : -1;
+        workers.push_back(std::move(worker));
+    }
+    for (auto& worker : workers) {
+        Worker *w = worker.get();
+        worker->thread = std::thread([this, w] {
+            workerLoop(*w);
+        });
+    }
+    logInfo("serving %s with %zu workers", socket_.c_str(), workers_);
+    int signal = 0;
+    sigwait(&signals, &signal);
+    logInfo("got signal %d, stopping", signal);
+    stop_ = true;
+    for (auto& worker : workers) {
+        uint64_t one = 1;
+        if (write(worker->event, &one, sizeof(one)) != sizeof(one)) {
+            logError("can't wake worker, error: %s (%d)", strerror(errno), errno);
+        }
+    }
+    uint64_t accepted = 0;
+    uint64_t lookups = 0;
+    for (auto& worker : workers) {
+        worker->thread.join();
+        ::close(worker->epoll);
+        ::close(worker->event);
+        accepted += worker->accepted;
+        lookups += worker->lookups;
+    }
+    ::close(listen_);
+    listen_ = -1;
+    unlink(socket_.c_str());
+    GeoDb::stop();
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    logInfo("served %lu connections, %lu lookups", accepted, lookups);
+}
+
+void
+GeoServer::listen()
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socket_.data(), socket_.size());
+    /*  a live server keeps its socket, a stale one left by a crash is removed  */
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0) {
+        bool live = connect(probe, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0;
+        ::close(probe);
+        if (live) {
+            logError("another server listens on %s", socket_.c_str());
+            throw GeoServerException("socket is in use");
+        }
+    }
+    struct stat st{};
+    if (lstat(socket_.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            logError("%s exists and is not a socket", socket_.c_str());
+            throw GeoServerException("socket path is taken");
+        }
+        unlink(socket_.c_str());
+    }
+    listen_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_ < 0 || bind(listen_, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0
+            || ::listen(listen_, backlog_) != 0) {
+        logError("can't listen on %s, error: %s (%d)", socket_.c_str(), strerror(errno), errno);
+        throw GeoServerException("can't listen on socket");
+    }
+}
+
+void
+GeoServer::workerLoop(Worker& worker)
+{
+    if (worker.cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker.cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            logWarn("can't pin worker to cpu %d", worker.cpu);
+        }
+    }
+    worker.ips.reserve(maxBatch_);
+    worker.elements.resize(maxBatch_);
+    worker.buffer.resize(readSize_);
+    epoll_event events[maxEvents];
+    while (!stop_) {
+        int n = epoll_wait(worker.epoll, events, maxEvents, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logError("epoll_wait failed, error: %s (%d)", strerror(errno), errno);
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (!ptr) {
+                accept(worker);
+                continue;
+            }
+            if (ptr == &worker) {
+                continue;
+            }
+            auto *conn = static_cast<Connection *>(ptr);
+            bool ok;
+            if (conn->writing) {
+                ok = flush(worker, *conn);
+            } else {
+                ok = receive(worker, *conn);
+            }
+            if (!ok) {
+                close(worker, conn);
+            }
+        }
+    }
+    for (auto& c : worker.connections) {
+        ::close(c.first);
+    }
+    worker.connections.clear();
+}
+
+void
+GeoServer::accept(Worker& worker)
+{
+    for (int i = 0; i < maxAccepts; i++) {
+        int fd = accept4(listen_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                logError("can't accept, error: %s (%d)", strerror(errno), errno);
+            }
+            return;
+        }
+        auto conn = std::make_unique<Connection>();
+        conn->fd = fd;
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn.get();
+        if (epoll_ctl(worker.epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            logError("can't add connection, error: %s (%d)", strerror(errno), errno);
+            ::close(fd);
+            continue;
+        }
+        worker.connections.emplace(fd, std::move(conn));
+        worker.accepted++;
+    }
+}
+
+void
+GeoServer::close(Worker& worker, Connection *conn)
+{
+    int fd = conn->fd;
+    ::close(fd);
+    worker.connections.erase(fd);
+}
+
+bool
+GeoServer::receive(Worker& worker, Connection& conn)
+{
+    ssize_t r = recv(conn.fd, worker.buffer.data(), worker.buffer.size(), 0);
+    if (r < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if (r == 0) {
+        return false;
+    }
+    conn.in.append(worker.buffer.data(), static_cast<size_t>(r));
+    return process(worker, conn) && flush(worker, conn);
+}
+
+bool
+GeoServer::process(Worker& worker, Connection& conn)
+{
+    bool complete = true;
+    while (complete && conn.inPos < conn.in.size()) {
+        /*  addresses never start with G, the first byte of frameMagic  */
+        bool ok = conn.in[conn.inPos] == 'G' ? processFrame(worker, conn, complete) : processLines(worker, conn, complete);
+        if (!ok) {
+            return false;
+        }
+    }
+    if (conn.inPos == conn.in.size()) {
+        conn.in.clear();
+    } else {
+        conn.in.erase(0, conn.inPos);
+    }
+    conn.inPos = 0;
+    return true;
+}
+
+bool
+GeoServer::processFrame(Worker& worker, Connection& conn, bool& complete)
+{
+    const char *p = conn.in.data() + conn.inPos;
+    const char *end = conn.in.data() + conn.in.size();
+    complete = false;
+    FrameHeader header{};
+    if (static_cast<size_t>(end - p) < sizeof(header)) {
+        return true;
+    }
+    memcpy(&header, p, sizeof(header));
+    if (header.magic != frameMagic || header.count > maxBatch_) {
+        logWarn("bad frame, magic %08x, count %u, closing connection", header.magic, header.count);
+        return false;
+    }
+    p += sizeof(header);
+    worker.ips.clear();
+    for (uint32_t i = 0; i < header.count; i++) {
+        if (p >= end) {
+            return true;
+        }
+        auto size = static_cast<uint8_t>(*p);
+        if (end - p - 1 < size) {
+            return true;
+        }
+        CString ip;
+        ip.assign(p + 1, size);
+        worker.ips.push_back(ip);
+        p += 1 + size;
+    }
+    GeoDb::getIps(worker.ips.data(), worker.ips.size(), worker.elements.data());
+    worker.lookups += worker.ips.size();
+    conn.out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (size_t i = 0; i < worker.ips.size(); i++) {
+        appendPacked(conn.out, worker.elements[i]);
+    }
+    conn.inPos = static_cast<size_t>(p - conn.in.data());
+    complete = true;
+    return true;
+}
+
+bool
+GeoServer::processLines(Worker& worker, Connection& conn, bool& complete)
+{
+    const char *p = conn.in.data() + conn.inPos;
+    const char *end = conn.in.data() + conn.in.size();
+    worker.ips.clear();
+    while (p < end && worker.ips.size() < maxBatch_) {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', static_cast<size_t>(end - p)));
+        if (!eol) {
+            break;
+        }
+        const char *e = eol;
+        if (e > p && e[-1] == '\r') {
+            e--;
+        }
+        CString ip;
+        ip.assign(p, static_cast<int>(e - p));
+        worker.ips.push_back(ip);
+        p = eol + 1;
+    }
+    if (worker.ips.empty()) {
+        complete = false;
+        if (static_cast<size_t>(end - p) > maxLine_) {
+            logWarn("line longer than %zu bytes, closing connection", maxLine_);
+            return false;
+        }
+        return true;
+    }
+    GeoDb::getIps(worker.ips.data(), worker.ips.size(), worker.elements.data());
+    worker.lookups += worker.ips.size();
+    for (size_t i = 0; i < worker.ips.size(); i++) {
+        appendLine(conn.out, worker.elements[i]);
+    }
+    conn.inPos = static_cast<size_t>(p - conn.in.data());
+    complete = true;
+    return true;
+}
+
+bool
+GeoServer::flush(Worker& worker, Connection& conn)
+{
+    while (conn.outPos < conn.out.size()) {
+        ssize_t r = send(conn.fd, conn.out.data() + conn.outPos, conn.out.size() - conn.outPos, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+        conn.outPos += static_cast<size_t>(r);
+    }
+    bool drained = conn.outPos == conn.out.size();
+    if (drained) {
+        conn.out.clear();
+        conn.outPos = 0;
+    }
+    /*  a client not reading its answers is not read from either  */
+    if (drained == conn.writing) {
+        conn.writing = !drained;
+        epoll_event ev{};
+        ev.events = drained ? EPOLLIN : EPOLLOUT;
+        ev.data.ptr = &conn;
+        if (epoll_ctl(worker.epoll, EPOLL_CTL_MOD, conn.fd, &ev) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+GeoServer::appendLine(std::string& out, const GeoDb::Element& el) const
+{
+    if (el.countryId || !el.countryKey.empty()) {
+        appendUint(out, el.countryId);
+        out += '\t';
+        appendUint(out, el.stateId);
+        out += '\t';
+        appendUint(out, el.cityId);
+    } else {
+        out += '\t';
+        out += '\t';
+    }
+    out += '\t';
+    out.append(el.countryKey.data, static_cast<size_t>(el.countryKey.size));
+    out += '\t';
+    out.append(el.stateKey.data, static_cast<size_t>(el.stateKey.size));
+    out += '\t';
+    out.append(el.cityName.data, static_cast<size_t>(el.cityName.size));
+    out += '\t';
+    if (el.asn) {
+        appendUint(out, el.asn);
+    }
+    out += '\t';
+    out.append(el.asnOrg.data, static_cast<size_t>(el.asnOrg.size));
+    out += '\n';
+}
+
+void
+GeoServer::appendPacked(std::string& out, const GeoDb::Element& el) const
+{
+    PackedResult r{};
+    r.countryId = el.countryId;
+    r.stateId = el.stateId;
+    r.cityId = el.cityId;
+    r.asn = el.asn;
+    r.countryKeySize = packedSize(el.countryKey);
+    r.stateKeySize = packedSize(el.stateKey);
+    r.cityNameSize = packedSize(el.cityName);
+    r.asnOrgSize = packedSize(el.asnOrg);
+    out.append(reinterpret_cast<const char *>(&r), sizeof(r));
+    appendPackedString(out, el.countryKey);
+    appendPackedString(out, el.stateKey);
+    appendPackedString(out, el.cityName);
+    appendPackedString(out, el.asnOrg);
+}
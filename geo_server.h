@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "rapidjson/document.h"
+
+#include "base/cstring.h"
+#include "base/geo_db.h"
+
+namespace ggAdNet {
+namespace Tools {
+
+class GeoServerException: public std::runtime_error
+{
+public:
+    explicit GeoServerException(const std::string& what) : std::runtime_error(what) {};
+    explicit GeoServerException(const char *what) : std::runtime_error(what) {};
+};
+
+/*
+ *  Local lookup daemon: one resident geodb per host served over a unix socket. Every
+ *  worker runs its own epoll loop, pinned to a core, and accepts from the shared listening
+ *  socket. A connection sends either text lines, one address each, answered with a line of
+ *  tab separated fields, or binary frames starting with frameMagic:
+ *
+ *      request     FrameHeader, count x {uint8_t size, size address chars}
+ *      response    FrameHeader, count x {PackedResult, the four strings back to back}
+ *
+ *  in host byte order. Everything that is complete in the input buffer goes through
+ *  GeoDb::getIps() in batches of up to server.max_batch, answers keep the request order.
+ */
+class GeoServer
+{
+public:
+
+    static constexpr uint32_t frameMagic = 0x31424447;         // "GDB1"
+
+    struct FrameHeader {
+        uint32_t magic;
+        uint32_t count;
+    };
+
+    struct PackedResult {
+        uint32_t countryId;
+        uint32_t stateId;
+        uint32_t cityId;
+        uint32_t asn;
+        uint16_t countryKeySize;
+        uint16_t stateKeySize;
+        uint16_t cityNameSize;
+        uint16_t asnOrgSize;
+    };
+
+    GeoServer();
+    ~GeoServer();
+    /*  serves till SIGINT or SIGTERM  */
+    void run();
+
+private:
+
+    struct Connection {
+        int fd{-1};
+        std::string in;
+        size_t inPos{0};
+        std::string out;
+        size_t outPos{0};
+        bool writing{false};            // waits for EPOLLOUT, input is not read meanwhile
+    };
+
+    struct Worker {
+        std::thread thread;
+        int epoll{-1};
+        int event{-1};                  // eventfd, stop
+        int cpu{-1};
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;     // by fd
+        std::vector<CString> ips;
+        std::vector<GeoDb::Element> elements;
+        std::vector<char> buffer;       // recv target
+        uint64_t accepted{0};
+        uint64_t lookups{0};
+    };
+
+    void initConfig(const rapidjson::Document& config);
+    void listen();
+    void workerLoop(Worker& worker);
+    void accept(Worker& worker);
+    void close(Worker& worker, Connection *conn);
+    [[nodiscard]] bool receive(Worker& worker, Connection& conn);
+    [[nodiscard]] bool process(Worker& worker, Connection& conn);
+    [[nodiscard]] bool processFrame(Worker& worker, Connection& conn, bool& complete);
+    [[nodiscard]] bool processLines(Worker& worker, Connection& conn, bool& complete);
+    [[nodiscard]] bool flush(Worker& worker, Connection& conn);
+    void appendLine(std::string& out, const GeoDb::Element& el) const;
+    void appendPacked(std::string& out, const GeoDb::Element& el) const;
+
+    const std::string configFile_ = "geo_server.conf";
+    const std::string defaultSocket_ = "/tmp/geodb.sock";
+    const int defaultMaxBatch_ = 4096;
+    const int defaultBacklog_ = 1024;
+    const size_t maxLine_ = 256;
+    const size_t readSize_ = 64 * 1024;
+
+    /*  config  */
+    rapidjson::Document config_;
+    std::string socket_;
+    size_t workers_{0};
+    bool pinWorkers_{true};
+    size_t maxBatch_{0};                // addresses per getIps() call and per binary frame
+    int backlog_{0};
+    /**/
+    int listen_{-1};
+    std::atomic<bool> stop_{false};
+};
+
+} // end of Tools namespace
+} // end of ggAdNet namespace
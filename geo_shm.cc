@@ -0,0 +1,161 @@
+#include "geo_shm.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "geo_db.h"
+#include "utils.h"
+
+using namespace ggAdNet;
+
+GeoShm::GeoShm(std::string name, Mapping mapping)
+    : name_(std::move(name)), mapping_(mapping)
+{
+    fd_ = shm_open(name_.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd_ < 0) {
+        logError("can't open shared memory %s, error: %s (%d)", name_.c_str(), strerror(errno), errno);
+        throw GeoDbException("can't open shared memory");
+    }
+    lock();
+    struct stat st{};
+    if (fstat(fd_, &st) != 0 || (static_cast<size_t>(st.st_size) < sizeof(Control) && ftruncate(fd_, sizeof(Control)) != 0)) {
+        logError("can't size shared memory %s, error: %s (%d)", name_.c_str(), strerror(errno), errno);
+        unlock();
+        close(fd_);
+        throw GeoDbException("can't size shared memory");
+    }
+    void *p = mmap(nullptr, sizeof(Control), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) {
+        logError("can't mmap shared memory %s, error: %s (%d)", name_.c_str(), strerror(errno), errno);
+        unlock();
+        close(fd_);
+        throw GeoDbException("can't mmap shared memory");
+    }
+    control_ = static_cast<Control *>(p);
+    /*  a fresh segment is zero filled  */
+    if (memcmp(control_->magic, "GEODBSHM", sizeof(control_->magic)) != 0) {
+        control_->version = Control::currentVersion;
+        control_->generation.store(0, std::memory_order_relaxed);
+        memcpy(control_->magic, "GEODBSHM", sizeof(control_->magic));
+    } else if (control_->version != Control::currentVersion) {
+        logError("shared memory %s has version %u, expected %u", name_.c_str(), control_->version, Control::currentVersion);
+        unlock();
+        munmap(control_, sizeof(Control));
+        close(fd_);
+        throw GeoDbException("shared memory version mismatch");
+    }
+    unlock();
+}
+
+GeoShm::~GeoShm()
+{
+    munmap(control_, sizeof(Control));
+    close(fd_);
+}
+
+void
+GeoShm::lock()
+{
+    while (flock(fd_, LOCK_EX) != 0 && errno == EINTR) {
+    }
+}
+
+void
+GeoShm::unlock()
+{
+    flock(fd_, LOCK_UN);
+}
+
+std::string
+GeoShm::imageName(uint64_t generation) const
+{
+    return name_ + "." + std::to_string(generation);
+}
+
+std::shared_ptr<const GeoImage>
+GeoShm::current() const
+{
+    uint64_t generation = this->generation();
+    return generation ? map(generation) : nullptr;
+}
+
+std::shared_ptr<const GeoImage>
+GeoShm::map(uint64_t generation) const
+{
+    std::string name = imageName(generation);
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        logError("can't open shared memory %s, error: %s (%d)", name.c_str(), strerror(errno), errno);
+        return nullptr;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    auto size = static_cast<size_t>(st.st_size);
+    void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED | (mapping_.populate ? MAP_POPULATE : 0), fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        logError("can't mmap shared memory %s, error: %s (%d)", name.c_str(), strerror(errno), errno);
+        return nullptr;
+    }
+    if (mapping_.hugePages && madvise(p, size, MADV_HUGEPAGE) != 0) {
+        logError("can't use huge pages for %s, error: %s (%d)", name.c_str(), strerror(errno), errno);
+    }
+    if (mapping_.lock && mlock(p, size) != 0) {
+        logError("can't mlock %s, error: %s (%d)", name.c_str(), strerror(errno), errno);
+    }
+    auto image = std::make_shared<const GeoImage>(static_cast<const char *>(p), size, [p, size] {
+        munmap(p, size);
+    });
+    if (!image->valid() || image->header().generation != generation) {
+        logError("shared memory %s holds no valid geodb image", name.c_str());
+        return nullptr;
+    }
+    return image;
+}
+
+std::shared_ptr<const GeoImage>
+GeoShm::publish(const GeoImageWriter& writer, int64_t sourceModified, uint64_t sourceSize)
+{
+    uint64_t previous = generation();
+    uint64_t generation = previous + 1;
+    std::string name = imageName(generation);
+    /*  left over by a process died while publishing  */
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        logError("can't create shared memory %s, error: %s (%d)", name.c_str(), strerror(errno), errno);
+        return nullptr;
+    }
+    size_t size = writer.size();
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        logError("can't size shared memory %s, error: %s (%d)", name.c_str(), strerror(errno), errno);
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        logError("can't mmap shared memory %s, error: %s (%d)", name.c_str(), strerror(errno), errno);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    writer.write(static_cast<char *>(p), generation, sourceModified, sourceSize);
+    munmap(p, size);
+    control_->generation.store(generation, std::memory_order_release);
+    /*  processes still serving the previous image keep their mapping  */
+    if (previous) {
+        shm_unlink(imageName(previous).c_str());
+    }
+    logInfo("geodb image generation %llu published to %s, %zu bytes", (unsigned long long) generation, name.c_str(), size);
+    return map(generation);
+}
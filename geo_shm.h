@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "geo_image.h"
+
+namespace ggAdNet {
+
+/*
+ *  Geodb images shared by worker processes through POSIX shared memory. A small control
+ *  segment <name> holds the published generation, the image itself lives in <name>.<generation>.
+ *  lock()/unlock() serialize processes on the control segment: the first one to see a new
+ *  geodb file builds and publishes the image, the others map it read-only.
+ */
+class GeoShm
+{
+public:
+
+    /*  how images get mapped  */
+    struct Mapping {
+        bool populate{false};       // MAP_POPULATE
+        bool hugePages{false};      // madvise(MADV_HUGEPAGE), needs shmem_enabled advise or above
+        bool lock{false};           // mlock
+    };
+
+    GeoShm(std::string name, Mapping mapping);
+    GeoShm(const GeoShm&) = delete;
+    GeoShm& operator=(const GeoShm&) = delete;
+    ~GeoShm();
+
+    void lock();
+    void unlock();
+
+    /*  published generation, 0 if none  */
+    [[nodiscard]] uint64_t generation() const {
+        return control_->generation.load(std::memory_order_acquire);
+    }
+
+    /*  published image mapped read-only, nullptr if none; call under lock()  */
+    [[nodiscard]] std::shared_ptr<const GeoImage> current() const;
+
+    /*  writes the image as the next generation and drops the previous one; call under lock()  */
+    std::shared_ptr<const GeoImage> publish(const GeoImageWriter& writer, int64_t sourceModified, uint64_t sourceSize);
+
+private:
+
+    struct Control {
+        static constexpr uint32_t currentVersion = 1;
+
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        std::atomic<uint64_t> generation;
+    };
+
+    [[nodiscard]] std::string imageName(uint64_t generation) const;
+    [[nodiscard]] std::shared_ptr<const GeoImage> map(uint64_t generation) const;
+
+    std::string name_;
+    Mapping mapping_;
+    int fd_{-1};
+    Control *control_{nullptr};
+};
+
+} // end of ggAdNet namespace
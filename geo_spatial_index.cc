@@ -0,0 +1,249 @@
+#include "geo_spatial_index.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace ggAdNet;
+
+void
+GeoSpatialIndex::toVector(double latitude, double longitude, double v[3])
+{
+    double lat = latitude * M_PI / 180.0;
+    double lon = longitude * M_PI / 180.0;
+    v[0] = cos(lat) * cos(lon);
+    v[1] = cos(lat) * sin(lon);
+    v[2] = sin(lat);
+}
+
+double
+GeoSpatialIndex::chord2(const double a[3], const double b[3])
+{
+    double dx = a[0] - b[0];
+    double dy = a[1] - b[1];
+    double dz = a[2] - b[2];
+    return dx * dx + dy * dy + dz * dz;
+}
+
+double
+GeoSpatialIndex::chordToKm(double chord2)
+{
+    return 2.0 * earthRadius * asin(std::min(sqrt(chord2) / 2.0, 1.0));
+}
+
+double
+GeoSpatialIndex::kmToChord2(double km)
+{
+    double chord = 2.0 * sin(std::min(km / earthRadius, M_PI) / 2.0);
+    return chord * chord;
+}
+
+double
+GeoSpatialIndex::distance(double latitude1, double longitude1, double latitude2, double longitude2)
+{
+    double a[3];
+    double b[3];
+    toVector(latitude1, longitude1, a);
+    toVector(latitude2, longitude2, b);
+    return chordToKm(chord2(a, b));
+}
+
+void
+GeoSpatialIndex::arrange(std::vector<Node>& nodes, size_t lo, size_t hi, unsigned int depth)
+{
+    if (hi - lo <= 1) {
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    unsigned int axis = depth % 3;
+    std::nth_element(nodes.begin() + static_cast<ptrdiff_t>(lo), nodes.begin() + static_cast<ptrdiff_t>(mid),
+        nodes.begin() + static_cast<ptrdiff_t>(hi), [axis](const Node& a, const Node& b) {
+            return a.v[axis] < b.v[axis];
+        });
+    arrange(nodes, lo, mid, depth + 1);
+    arrange(nodes, mid + 1, hi, depth + 1);
+}
+
+void
+GeoSpatialIndex::build()
+{
+    /*  last added wins on equal ids  */
+    std::stable_sort(staged_.begin(), staged_.end(), [](const Staged& a, const Staged& b) {
+        return a.id < b.id;
+    });
+    std::vector<Node> nodes;
+    for (size_t i = 0; i < staged_.size(); i++) {
+        if (i + 1 < staged_.size() && staged_[i + 1].id == staged_[i].id) {
+            continue;
+        }
+        Node node{};
+        toVector(staged_[i].latitude, staged_[i].longitude, node.v);
+        node.latitude = staged_[i].latitude;
+        node.longitude = staged_[i].longitude;
+        node.id = staged_[i].id;
+        nodes.push_back(node);
+    }
+    arrange(nodes, 0, nodes.size(), 0);
+    std::vector<IdRef> ids;
+    ids.reserve(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++) {
+        ids.push_back({nodes[i].id, static_cast<uint32_t>(i)});
+    }
+    std::sort(ids.begin(), ids.end(), [](const IdRef& a, const IdRef& b) {
+        return a.id < b.id;
+    });
+    /*  neighbor lists in ids order, staged_ is sorted by id as well  */
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> neighbors;
+    offsets.reserve(ids.size() + 1);
+    for (size_t i = 0; i < staged_.size(); i++) {
+        if (i + 1 < staged_.size() && staged_[i + 1].id == staged_[i].id) {
+            continue;
+        }
+        offsets.push_back(static_cast<uint32_t>(neighbors.size()));
+        neighbors.insert(neighbors.end(), staged_[i].neighbors.begin(), staged_[i].neighbors.end());
+    }
+    offsets.push_back(static_cast<uint32_t>(neighbors.size()));
+    std::vector<Staged>().swap(staged_);
+    nodes_.assign(std::move(nodes));
+    ids_.assign(std::move(ids));
+    offsets_.assign(std::move(offsets));
+    neighbors_.assign(std::move(neighbors));
+}
+
+void
+GeoSpatialIndex::search(const double q[3], size_t lo, size_t hi, unsigned int depth, size_t k, double& bound,
+        std::vector<std::pair<double, uint32_t>>& heap) const
+{
+    if (lo >= hi) {
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    const Node& node = nodes_[mid];
+    double d = chord2(q, node.v);
+    if (heap.size() < k || d < heap.front().first) {
+        heap.emplace_back(d, static_cast<uint32_t>(mid));
+        std::push_heap(heap.begin(), heap.end());
+        if (heap.size() > k) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
+        }
+        if (heap.size() == k) {
+            bound = heap.front().first;
+        }
+    }
+    double delta = q[depth % 3] - node.v[depth % 3];
+    /*  the near side first, the far one only if the splitting plane is within the bound  */
+    if (delta < 0) {
+        search(q, lo, mid, depth + 1, k, bound, heap);
+        if (delta * delta < bound) {
+            search(q, mid + 1, hi, depth + 1, k, bound, heap);
+        }
+    } else {
+        search(q, mid + 1, hi, depth + 1, k, bound, heap);
+        if (delta * delta < bound) {
+            search(q, lo, mid, depth + 1, k, bound, heap);
+        }
+    }
+}
+
+void
+GeoSpatialIndex::collect(const double q[3], size_t lo, size_t hi, unsigned int depth, double bound,
+        std::vector<std::pair<double, uint32_t>>& out) const
+{
+    if (lo >= hi) {
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    const Node& node = nodes_[mid];
+    double d = chord2(q, node.v);
+    if (d <= bound) {
+        out.emplace_back(d, static_cast<uint32_t>(mid));
+    }
+    double delta = q[depth % 3] - node.v[depth % 3];
+    if (delta <= 0 || delta * delta <= bound) {
+        collect(q, lo, mid, depth + 1, bound, out);
+    }
+    if (delta >= 0 || delta * delta <= bound) {
+        collect(q, mid + 1, hi, depth + 1, bound, out);
+    }
+}
+
+GeoSpatialIndex::Hit
+GeoSpatialIndex::nearest(double latitude, double longitude) const
+{
+    std::vector<Hit> hits;
+    nearest(latitude, longitude, 1, hits);
+    return hits.empty() ? Hit{npos, 0.0} : hits[0];
+}
+
+void
+GeoSpatialIndex::nearest(double latitude, double longitude, size_t k, std::vector<Hit>& out) const
+{
+    out.clear();
+    if (k == 0) {
+        return;
+    }
+    double q[3];
+    toVector(latitude, longitude, q);
+    std::vector<std::pair<double, uint32_t>> heap;
+    heap.reserve(k + 1);
+    double bound = 5.0;                 // above the largest chord squared, 4
+    search(q, 0, nodes_.size(), 0, k, bound, heap);
+    std::sort_heap(heap.begin(), heap.end());
+    for (const auto& h : heap) {
+        out.push_back({nodes_[h.second].id, chordToKm(h.first)});
+    }
+}
+
+void
+GeoSpatialIndex::within(double latitude, double longitude, double km, std::vector<Hit>& out) const
+{
+    out.clear();
+    if (km < 0) {
+        return;
+    }
+    double q[3];
+    toVector(latitude, longitude, q);
+    std::vector<std::pair<double, uint32_t>> hits;
+    collect(q, 0, nodes_.size(), 0, kmToChord2(km), hits);
+    std::sort(hits.begin(), hits.end());
+    for (const auto& h : hits) {
+        out.push_back({nodes_[h.second].id, chordToKm(h.first)});
+    }
+}
+
+const GeoSpatialIndex::IdRef *
+GeoSpatialIndex::find(uint32_t id) const
+{
+    const IdRef *begin = ids_.data();
+    const IdRef *end = begin + ids_.size();
+    const IdRef *it = std::lower_bound(begin, end, id, [](const IdRef& r, uint32_t id) {
+        return r.id < id;
+    });
+    return it != end && it->id == id ? it : nullptr;
+}
+
+bool
+GeoSpatialIndex::location(uint32_t id, double& latitude, double& longitude) const
+{
+    const IdRef *ref = find(id);
+    if (!ref) {
+        return false;
+    }
+    latitude = nodes_[ref->node].latitude;
+    longitude = nodes_[ref->node].longitude;
+    return true;
+}
+
+bool
+GeoSpatialIndex::neighbors(uint32_t id, std::vector<uint32_t>& out) const
+{
+    out.clear();
+    const IdRef *ref = find(id);
+    if (!ref) {
+        return false;
+    }
+    auto i = static_cast<size_t>(ref - ids_.data());
+    out.assign(neighbors_.data() + offsets_[i], neighbors_.data() + offsets_[i + 1]);
+    return true;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "geo_image.h"
+
+namespace ggAdNet {
+
+/*
+ *  Static k-d tree over city coordinates. Points are kept as unit vectors, so distances
+ *  are chords and the antimeridian and poles need no special care; a chord maps to a
+ *  great circle distance monotonically. The tree is implicit: the node of a subarray is
+ *  its middle element, split on x, y, z by depth. Precomputed neighbor lists (nearest
+ *  cities, nearest first) are kept by city id.
+ */
+class GeoSpatialIndex
+{
+public:
+
+    static constexpr double earthRadius = 6371.0088;       // km, mean
+    static constexpr uint32_t npos = 0xffffffff;
+
+    struct Hit {
+        uint32_t id;
+        double distance;            // km
+    };
+
+    /*  coordinates in degrees, neighbors are city ids  */
+    void add(uint32_t id, double latitude, double longitude, std::vector<uint32_t> neighbors = {}) {
+        staged_.push_back({id, latitude, longitude, std::move(neighbors)});
+    }
+
+    /*  must be called once all points are added  */
+    void build();
+
+    /*  arrays go to sections id .. id + 3  */
+    void save(GeoImageWriter& writer, uint32_t id) const {
+        writer.add(id, nodes_);
+        writer.add(id + 1, ids_);
+        writer.add(id + 2, offsets_);
+        writer.add(id + 3, neighbors_);
+    }
+
+    bool attach(const GeoImage& image, uint32_t id) {
+        return image.attach(id, nodes_) && image.attach(id + 1, ids_) && image.attach(id + 2, offsets_)
+            && image.attach(id + 3, neighbors_) && offsets_.size() == ids_.size() + 1;
+    }
+
+    /*  npos if the index is empty  */
+    [[nodiscard]] Hit nearest(double latitude, double longitude) const;
+    /*  up to k nearest, nearest first  */
+    void nearest(double latitude, double longitude, size_t k, std::vector<Hit>& out) const;
+    /*  all within km, nearest first  */
+    void within(double latitude, double longitude, double km, std::vector<Hit>& out) const;
+    /*  false for an unknown id  */
+    bool location(uint32_t id, double& latitude, double& longitude) const;
+    bool neighbors(uint32_t id, std::vector<uint32_t>& out) const;
+
+    static double distance(double latitude1, double longitude1, double latitude2, double longitude2);
+
+    [[nodiscard]] size_t size() const { return nodes_.size(); }
+    [[nodiscard]] size_t memory() const {
+        return nodes_.memory() + ids_.memory() + offsets_.memory() + neighbors_.memory();
+    }
+
+private:
+
+    struct Staged {
+        uint32_t id;
+        double latitude;
+        double longitude;
+        std::vector<uint32_t> neighbors;
+    };
+
+    /*  as laid out in an image  */
+    struct Node {
+        double v[3];
+        double latitude;
+        double longitude;
+        uint32_t id;
+        uint32_t reserved;
+    };
+
+    /*  sorted by id, node is its position in nodes_  */
+    struct IdRef {
+        uint32_t id;
+        uint32_t node;
+    };
+
+    static void toVector(double latitude, double longitude, double v[3]);
+    static double chord2(const double a[3], const double b[3]);
+    static double chordToKm(double chord2);
+    static double kmToChord2(double km);
+
+    static void arrange(std::vector<Node>& nodes, size_t lo, size_t hi, unsigned int depth);
+    void search(const double q[3], size_t lo, size_t hi, unsigned int depth, size_t k, double& bound,
+        std::vector<std::pair<double, uint32_t>>& heap) const;
+    void collect(const double q[3], size_t lo, size_t hi, unsigned int depth, double bound,
+        std::vector<std::pair<double, uint32_t>>& out) const;
+    [[nodiscard]] const IdRef *find(uint32_t id) const;
+
+    std::vector<Staged> staged_;
+    GeoArray<Node> nodes_;
+    GeoArray<IdRef> ids_;
+    GeoArray<uint32_t> offsets_;        // into neighbors_ by ids_ position, one more than ids_
+    GeoArray<uint32_t> neighbors_;
+};
+
+} // end of ggAdNet namespace
@@ -0,0 +1,54 @@
+#include "geo_stats.h"
+
+using namespace ggAdNet;
+
+namespace {
+
+std::atomic<uint64_t> lastStatsId{0};
+
+}
+
+GeoStats::GeoStats()
+    : id_(lastStatsId.fetch_add(1) + 1)
+{
+}
+
+GeoStats::Shard&
+GeoStats::registerThread()
+{
+    /*  ids are never reused, shards of instances gone are never looked up again  */
+    thread_local std::unordered_map<uint64_t, Shard *> owned;
+    auto it = owned.find(id_);
+    Shard *shard;
+    if (it != owned.end()) {
+        shard = it->second;
+    } else {
+        std::lock_guard<std::mutex> guard(lock_);
+        shards_.push_back(std::make_unique<Shard>());
+        shard = shards_.back().get();
+        owned.emplace(id_, shard);
+    }
+    lastOwner_ = id_;
+    lastShard_ = shard;
+    return *shard;
+}
+
+GeoStats::Totals
+GeoStats::totals() const
+{
+    Totals totals;
+    std::lock_guard<std::mutex> guard(lock_);
+    for (const auto& shard : shards_) {
+        for (size_t c = 0; c < c_count; c++) {
+            totals.counters[c] += shard->counters[c].load(std::memory_order_relaxed);
+        }
+        for (size_t h = 0; h < h_count; h++) {
+            for (size_t b = 0; b < buckets; b++) {
+                totals.histograms[h][b] += shard->histograms[h][b].load(std::memory_order_relaxed);
+            }
+            totals.sums[h] += shard->sums[h].load(std::memory_order_relaxed);
+        }
+    }
+    totals.shards = shards_.size();
+    return totals;
+}
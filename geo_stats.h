@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace ggAdNet {
+
+/*
+ *  Lookup counters and sampled latency histograms, sharded per thread: a thread only writes
+ *  its own shard with relaxed loads and stores (no locked instructions), readers sum shards.
+ */
+class GeoStats
+{
+public:
+
+    /*  the first ones follow GeoDb::Route  */
+    enum Counter {
+        c_ipv4,
+        c_ipv4_mapped,
+        c_6to4,
+        c_teredo,
+        c_ipv6,
+        c_invalid,
+        c_miss,
+        c_count
+    };
+
+    enum Histogram {
+        h_ipv4,
+        h_ipv6,
+        h_count
+    };
+
+    static constexpr size_t buckets = 32;           // bucket i counts latencies below 2^(i + 1) ns
+    static constexpr uint64_t sampleMask = 63;      // one lookup out of 64 is timed
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[c_count]{};
+        std::atomic<uint64_t> histograms[h_count][buckets]{};
+        std::atomic<uint64_t> sums[h_count]{};      // ns
+        uint64_t calls{0};
+
+        void add(Counter c) {
+            counters[c].store(counters[c].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        bool sample() {
+            return (calls++ & sampleMask) == 0;
+        }
+
+        void record(Histogram h, uint64_t ns) {
+            size_t b = ns ? static_cast<size_t>(63 - __builtin_clzll(ns)) : 0;
+            b = b < buckets ? b : buckets - 1;
+            histograms[h][b].store(histograms[h][b].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            sums[h].store(sums[h].load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+        }
+    };
+
+    struct Totals {
+        uint64_t counters[c_count]{};
+        uint64_t histograms[h_count][buckets]{};
+        uint64_t sums[h_count]{};
+        size_t shards{0};
+    };
+
+    GeoStats();
+    GeoStats(const GeoStats&) = delete;
+    GeoStats& operator=(const GeoStats&) = delete;
+
+    /*  shard of the calling thread  */
+    Shard& shard() {
+        if (lastOwner_ == id_) {
+            return *lastShard_;
+        }
+        return registerThread();
+    }
+
+    [[nodiscard]] Totals totals() const;
+
+private:
+
+    Shard& registerThread();
+
+    inline static thread_local uint64_t lastOwner_ = 0;
+    inline static thread_local Shard *lastShard_ = nullptr;
+
+    uint64_t id_;
+    mutable std::mutex lock_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+} // end of ggAdNet namespace